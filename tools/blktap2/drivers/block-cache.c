@@ -30,13 +30,19 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 
+/* vhd.h turns DEBUG on for libvhd; keep the per-sector logging off here */
+#undef DEBUG
+
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #else
@@ -58,6 +64,28 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+/*
+ * Host-wide cache shared by every tapdisk reading the same parent.  The
+ * cache file is a set-associative table of 4K pages keyed by the parent
+ * uuid and page number, and stamped with the generation of the parent
+ * file (its mtime and size) so that a parent rewritten in place under
+ * the same uuid, as vhd-util coalesce does, never serves the old data:
+ * pages of another generation are dropped when met.  Readers are
+ * lock-free: each slot carries a sequence count which is odd while the
+ * slot is being rewritten, never goes back, and a copy is only used if
+ * the count did not change across it.  Writers claim a slot with a
+ * compare-and-swap and give up if they lose, so a cache fill never waits
+ * on another process.  The private radix tree is
+ * used when the shared cache cannot be mapped.
+ */
+#define BLOCK_CACHE_SHARED_PATH         "/dev/shm/tapdisk-block-cache"
+#define BLOCK_CACHE_SHARED_SIZE         (256ULL << 20)
+#define BLOCK_CACHE_SHARED_MAGIC        0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_SHARED_VERSION      3
+#define BLOCK_CACHE_SHARED_NO_PAGE      (~0ULL)
+#define BLOCK_CACHE_SHARED_WAYS         8
+#define BLOCK_CACHE_SHARED_MAX_SECS     (MAX_SEGMENTS_PER_REQ * BLOCK_CACHE_NODES_PER_PAGE)
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -67,6 +95,9 @@ typedef struct radix_tree_page          radix_tree_page_t;
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_shared       block_cache_shared_t;
+typedef struct block_cache_shared_hdr   block_cache_shared_hdr_t;
+typedef struct block_cache_shared_slot  block_cache_shared_slot_t;
 
 struct radix_tree_page {
 	char                           *buf;
@@ -117,12 +148,53 @@ struct block_cache_stats {
 	uint64_t                        prunes;
 };
 
+struct block_cache_shared_hdr {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint64_t                        size;
+	uint32_t                        sets;
+	uint32_t                        ways;
+	uint64_t                        slots;        /* slot table offset */
+	uint64_t                        data;         /* page array offset */
+
+	/* host-wide counters, updated atomically */
+	uint64_t                        hits;         /* sectors */
+	uint64_t                        misses;       /* sectors */
+	uint64_t                        inserts;      /* pages */
+	uint64_t                        evictions;    /* pages */
+	uint64_t                        collisions;   /* inserts lost to a racing writer */
+	uint64_t                        stale;        /* pages of a changed parent dropped */
+};
+
+struct block_cache_shared_slot {
+	volatile uint32_t               seq;          /* odd while written, only grows */
+	volatile uint32_t               ref;
+	uint64_t                        page;         /* NO_PAGE once dropped */
+	vhd_uuid_t                      uuid;
+	uint64_t                        gen;
+};
+
+struct block_cache_shared {
+	int                             refs;
+	int                             fd;
+	size_t                          size;
+	char                           *map;
+	block_cache_shared_hdr_t       *hdr;
+	block_cache_shared_slot_t      *slots;
+	char                           *data;
+};
+
 struct block_cache {
 	int                             ptype;
 	char                           *name;
 
 	uint64_t                        sectors;
 
+	block_cache_shared_t           *shared;
+	vhd_uuid_t                      uuid;
+	uint64_t                        gen;
+	uint64_t                        key;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
@@ -242,7 +314,7 @@ radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
 	int i;
 
 	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
+		DBG("%s: ejecting sector 0x%"PRIx64"\n",
 		    tree->cache->name, page->sec + i);
 
 	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
@@ -516,6 +588,550 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static block_cache_shared_t block_cache_shared = { .fd = -1 };
+
+static int
+block_cache_shared_format(int fd)
+{
+	int err;
+	struct stat st;
+	uint64_t nr, slots;
+	block_cache_shared_hdr_t hdr;
+
+	err = fstat(fd, &st);
+	if (err)
+		return -errno;
+
+	if (st.st_size) {
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			return -EIO;
+
+		/* header is written last: no magic means a format was cut short */
+		if (hdr.magic) {
+			if (hdr.magic != BLOCK_CACHE_SHARED_MAGIC ||
+			    hdr.version != BLOCK_CACHE_SHARED_VERSION ||
+			    hdr.size != BLOCK_CACHE_SHARED_SIZE)
+				return -ESTALE;
+			return 0;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic   = BLOCK_CACHE_SHARED_MAGIC;
+	hdr.version = BLOCK_CACHE_SHARED_VERSION;
+	hdr.size    = BLOCK_CACHE_SHARED_SIZE;
+	hdr.ways    = BLOCK_CACHE_SHARED_WAYS;
+	hdr.slots   = RADIX_TREE_PAGE_SIZE;
+
+	nr  = (hdr.size - hdr.slots) /
+		(RADIX_TREE_PAGE_SIZE + sizeof(block_cache_shared_slot_t));
+	nr -= nr % hdr.ways;
+
+	for (;;) {
+		slots    = nr * sizeof(block_cache_shared_slot_t);
+		hdr.data = hdr.slots + ((slots + RADIX_TREE_PAGE_SIZE - 1) &
+					~(uint64_t)(RADIX_TREE_PAGE_SIZE - 1));
+		if (hdr.data + nr * RADIX_TREE_PAGE_SIZE <= hdr.size)
+			break;
+		nr -= hdr.ways;
+	}
+
+	hdr.sets = nr / hdr.ways;
+
+	if (ftruncate(fd, 0) || ftruncate(fd, hdr.size))
+		return -errno;
+
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+
+	DPRINTF("formatted %s: %u sets of %u pages\n",
+		BLOCK_CACHE_SHARED_PATH, hdr.sets, hdr.ways);
+
+	return 0;
+}
+
+/*
+ * Open and lock the cache file, formatting it if needed.  A file left
+ * by another version of the cache is unlinked rather than reformatted:
+ * tapdisks still running that version keep their own mapping of it,
+ * and new ones start over on a fresh file.
+ */
+static int
+block_cache_shared_open(void)
+{
+	int fd, err, tries;
+	struct stat st, path;
+
+	for (tries = 0; tries < 3; tries++) {
+		fd = open(BLOCK_CACHE_SHARED_PATH, O_RDWR | O_CREAT, 0600);
+		if (fd == -1)
+			return -errno;
+
+		if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+			err = -errno;
+			goto fail;
+		}
+
+		/* unlinked while we waited for the lock: open the new one */
+		if (stat(BLOCK_CACHE_SHARED_PATH, &path) ||
+		    path.st_ino != st.st_ino || path.st_dev != st.st_dev) {
+			close(fd);
+			continue;
+		}
+
+		err = block_cache_shared_format(fd);
+		if (err == -ESTALE) {
+			DPRINTF("%s: replacing a cache of another version\n",
+				BLOCK_CACHE_SHARED_PATH);
+			unlink(BLOCK_CACHE_SHARED_PATH);
+			close(fd);
+			continue;
+		}
+
+		flock(fd, LOCK_UN);
+		if (err)
+			goto fail;
+
+		return fd;
+	}
+
+	return -EBUSY;
+
+fail:
+	close(fd);
+	return err;
+}
+
+static int
+block_cache_shared_map(void)
+{
+	int fd, err;
+	struct stat st;
+	block_cache_shared_t *shared;
+	block_cache_shared_hdr_t *hdr;
+
+	shared = &block_cache_shared;
+	if (shared->refs) {
+		shared->refs++;
+		return 0;
+	}
+
+	fd = block_cache_shared_open();
+	if (fd < 0)
+		return fd;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	shared->size = st.st_size;
+	shared->map  = mmap(NULL, shared->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+	if (shared->map == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	hdr = (block_cache_shared_hdr_t *)shared->map;
+	if (hdr->magic != BLOCK_CACHE_SHARED_MAGIC ||
+	    hdr->version != BLOCK_CACHE_SHARED_VERSION ||
+	    hdr->size != shared->size || !hdr->sets ||
+	    hdr->data + (uint64_t)hdr->sets * hdr->ways *
+	    RADIX_TREE_PAGE_SIZE > hdr->size) {
+		EPRINTF("%s: bad header\n", BLOCK_CACHE_SHARED_PATH);
+		munmap(shared->map, shared->size);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	shared->fd    = fd;
+	shared->hdr   = hdr;
+	shared->slots = (block_cache_shared_slot_t *)(shared->map + hdr->slots);
+	shared->data  = shared->map + hdr->data;
+	shared->refs  = 1;
+
+	return 0;
+
+fail:
+	close(fd);
+	return err;
+}
+
+static void
+block_cache_shared_unmap(void)
+{
+	block_cache_shared_t *shared;
+
+	shared = &block_cache_shared;
+	if (--shared->refs)
+		return;
+
+	munmap(shared->map, shared->size);
+	close(shared->fd);
+	shared->fd  = -1;
+	shared->map = NULL;
+	shared->hdr = NULL;
+}
+
+/*
+ * Parents are keyed by their vhd uuid, which every clone of a golden
+ * image agrees on whatever path it reaches it by.  Other formats fall
+ * back to the file identity.  The generation changes whenever the
+ * parent file is written; it is not part of the set hash, so that the
+ * pages it obsoletes are found, and dropped, by the next lookups.
+ */
+static int
+block_cache_shared_key(block_cache_t *cache)
+{
+	int err;
+	struct stat st;
+	vhd_context_t vhd;
+	uint64_t id[2];
+
+	if (stat(cache->name, &st))
+		return -errno;
+
+	err = vhd_open(&vhd, cache->name, VHD_OPEN_RDONLY);
+	if (!err) {
+		vhd_uuid_copy(&cache->uuid, &vhd.footer.uuid);
+		vhd_close(&vhd);
+	} else {
+		id[0] = st.st_ino;
+		id[1] = st.st_dev;
+		memcpy(&cache->uuid, id, sizeof(cache->uuid));
+	}
+
+	cache->gen  = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+		st.st_mtim.tv_nsec;
+	cache->gen ^= (uint64_t)st.st_size * 0x9e3779b97f4a7c15ULL;
+
+	memcpy(id, &cache->uuid, sizeof(id));
+	cache->key = id[0] ^ id[1];
+
+	return 0;
+}
+
+static inline block_cache_shared_slot_t *
+block_cache_shared_set(block_cache_t *cache, uint64_t page, uint64_t *hash)
+{
+	uint64_t h;
+	block_cache_shared_t *shared;
+
+	shared = cache->shared;
+
+	h  = cache->key ^ (page * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	*hash = h;
+	return shared->slots + (h % shared->hdr->sets) * shared->hdr->ways;
+}
+
+static inline char *
+block_cache_shared_page(block_cache_t *cache, block_cache_shared_slot_t *slot)
+{
+	block_cache_shared_t *shared = cache->shared;
+	return shared->data + (slot - shared->slots) * RADIX_TREE_PAGE_SIZE;
+}
+
+/*
+ * 1 if @slot holds @page of this parent, -1 if it holds it for another
+ * generation of the parent file, 0 otherwise.
+ */
+static inline int
+block_cache_shared_match(block_cache_t *cache,
+			 block_cache_shared_slot_t *slot, uint64_t page)
+{
+	if (slot->page != page ||
+	    memcmp(&slot->uuid, &cache->uuid, sizeof(cache->uuid)))
+		return 0;
+
+	return slot->gen == cache->gen ? 1 : -1;
+}
+
+static inline int
+block_cache_shared_empty(block_cache_shared_slot_t *slot, uint32_t seq)
+{
+	return !seq || slot->page == BLOCK_CACHE_SHARED_NO_PAGE;
+}
+
+/*
+ * Empty a slot read at @seq, unless a writer got to it first.  Like a
+ * fill, this moves the count on rather than back: a reader that
+ * sampled @seq must never find it again over other contents.
+ */
+static inline void
+block_cache_shared_drop(block_cache_t *cache,
+			block_cache_shared_slot_t *slot, uint32_t seq)
+{
+	if (!__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+		return;
+
+	__sync_synchronize();
+
+	slot->page = BLOCK_CACHE_SHARED_NO_PAGE;
+	slot->ref  = 0;
+
+	__sync_synchronize();
+
+	slot->seq = seq + 2;
+
+	__sync_fetch_and_add(&cache->shared->hdr->stale, 1);
+}
+
+/*
+ * Copy @secs sectors starting at sector @first of @page into @buf.
+ * Returns 0 on a miss, including when a writer got in the way.
+ */
+static int
+block_cache_shared_lookup(block_cache_t *cache, uint64_t page,
+			  int first, int secs, char *buf)
+{
+	int i, match;
+	uint32_t seq;
+	uint64_t hash;
+	block_cache_shared_slot_t *set, *slot;
+
+	set = block_cache_shared_set(cache, page, &hash);
+
+	for (i = 0; i < cache->shared->hdr->ways; i++) {
+		slot = set + i;
+
+		seq = slot->seq;
+		if (!seq || (seq & 1))
+			continue;
+
+		__sync_synchronize();
+
+		match = block_cache_shared_match(cache, slot, page);
+		if (match < 0)
+			block_cache_shared_drop(cache, slot, seq);
+		if (match <= 0)
+			continue;
+
+		memcpy(buf, block_cache_shared_page(cache, slot) +
+		       (first << RADIX_TREE_NODE_SHIFT),
+		       secs << RADIX_TREE_NODE_SHIFT);
+
+		__sync_synchronize();
+
+		if (slot->seq != seq)
+			return 0;
+
+		if (!slot->ref)
+			slot->ref = 1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Victims are picked second-chance style: an empty slot, else one not
+ * hit since the set was last swept, else the sweep clears every
+ * reference bit and a slot is picked by hash.  A slot left odd by a
+ * writer that died mid-copy just drops out of its set.
+ */
+static void
+block_cache_shared_insert(block_cache_t *cache, uint64_t page, char *buf)
+{
+	int i, ways, empty, stale;
+	uint32_t seq, vseq;
+	uint64_t hash;
+	block_cache_shared_hdr_t *hdr;
+	block_cache_shared_slot_t *set, *slot, *victim;
+
+	hdr    = cache->shared->hdr;
+	ways   = hdr->ways;
+	set    = block_cache_shared_set(cache, page, &hash);
+	victim = NULL;
+	vseq   = 0;
+	empty  = 0;
+	stale  = 0;
+
+	for (i = 0; i < ways; i++) {
+		slot = set + i;
+		seq  = slot->seq;
+
+		if (seq & 1)
+			continue;
+
+		if (block_cache_shared_empty(slot, seq)) {
+			if (!victim || !empty) {
+				victim = slot;
+				vseq   = seq;
+				empty  = 1;
+			}
+			continue;
+		}
+
+		switch (block_cache_shared_match(cache, slot, page)) {
+		case 1:
+			return;
+		case -1:
+			/* another generation of this page: replace it */
+			victim = slot;
+			vseq   = seq;
+			stale  = 1;
+			goto claim;
+		}
+
+		if (!victim && !slot->ref) {
+			victim = slot;
+			vseq   = seq;
+		}
+	}
+
+	if (!victim) {
+		for (i = 0; i < ways; i++)
+			set[i].ref = 0;
+
+		victim = set + (hash >> 32) % ways;
+		vseq   = victim->seq;
+		if (vseq & 1)
+			goto busy;
+	}
+
+claim:
+	if (!__sync_bool_compare_and_swap(&victim->seq, vseq, vseq + 1))
+		goto busy;
+
+	__sync_synchronize();
+
+	victim->page = page;
+	victim->ref  = 0;
+	vhd_uuid_copy(&victim->uuid, &cache->uuid);
+	victim->gen  = cache->gen;
+	memcpy(block_cache_shared_page(cache, victim), buf,
+	       RADIX_TREE_PAGE_SIZE);
+
+	__sync_synchronize();
+
+	victim->seq = vseq + 2;
+
+	__sync_fetch_and_add(&hdr->inserts, 1);
+	if (stale)
+		__sync_fetch_and_add(&hdr->stale, 1);
+	else if (!empty)
+		__sync_fetch_and_add(&hdr->evictions, 1);
+
+	return;
+
+busy:
+	__sync_fetch_and_add(&hdr->collisions, 1);
+}
+
+static void
+block_cache_shared_populate(td_request_t clone, int err)
+{
+	char *buf;
+	uint64_t sec, end;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (breq->err)
+		goto out;
+
+	/* only whole pages go into the cache */
+	sec = breq->treq.sec;
+	end = sec + breq->treq.secs;
+	buf = breq->treq.buf;
+
+	if (sec % BLOCK_CACHE_NODES_PER_PAGE) {
+		int skip = BLOCK_CACHE_NODES_PER_PAGE -
+			sec % BLOCK_CACHE_NODES_PER_PAGE;
+		sec += skip;
+		buf += skip << RADIX_TREE_NODE_SHIFT;
+	}
+
+	for (; sec + BLOCK_CACHE_NODES_PER_PAGE <= end;
+	     sec += BLOCK_CACHE_NODES_PER_PAGE, buf += RADIX_TREE_PAGE_SIZE)
+		block_cache_shared_insert(cache,
+					  sec / BLOCK_CACHE_NODES_PER_PAGE, buf);
+
+out:
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+static void
+block_cache_shared_miss(block_cache_t *cache, td_request_t treq)
+{
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	DBG("%s: shared cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
+
+	cache->stats.misses += treq.secs;
+	__sync_fetch_and_add(&cache->shared->hdr->misses, treq.secs);
+
+	clone = treq;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		goto out;
+
+	breq->treq    = treq;
+	breq->secs    = treq.secs;
+	breq->err     = 0;
+	breq->cache   = cache;
+
+	clone.cb      = block_cache_shared_populate;
+	clone.cb_data = breq;
+
+out:
+	td_forward_request(clone);
+}
+
+static void
+block_cache_shared_read(block_cache_t *cache, td_request_t treq)
+{
+	char *buf;
+	int first, secs;
+	uint64_t sec, left;
+
+	if (treq.secs > BLOCK_CACHE_SHARED_MAX_SECS)
+		return td_forward_request(treq);
+
+	sec  = treq.sec;
+	left = treq.secs;
+	buf  = treq.buf;
+
+	while (left) {
+		first = sec % BLOCK_CACHE_NODES_PER_PAGE;
+		secs  = BLOCK_CACHE_NODES_PER_PAGE - first;
+		if (secs > left)
+			secs = left;
+
+		if (!block_cache_shared_lookup(cache,
+					       sec / BLOCK_CACHE_NODES_PER_PAGE,
+					       first, secs, buf))
+			return block_cache_shared_miss(cache, treq);
+
+		sec  += secs;
+		left -= secs;
+		buf  += secs << RADIX_TREE_NODE_SHIFT;
+	}
+
+	DBG("%s: shared cache hit: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
+
+	cache->stats.hits += treq.secs;
+	__sync_fetch_and_add(&cache->shared->hdr->hits, treq.secs);
+
+	td_complete_request(treq, 0);
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -536,15 +1152,30 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
+	cache->requests_free = BLOCK_CACHE_REQUESTS;
+	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
+		cache->request_free_list[i] = cache->requests + i;
+
+	err = block_cache_shared_key(cache);
+	if (!err)
+		err = block_cache_shared_map();
+	if (!err) {
+		cache->shared = &block_cache_shared;
+		DPRINTF("opening shared cache for %s, sectors: %"PRIu64", "
+			"key: 0x%016"PRIx64"\n",
+			cache->name, cache->sectors, cache->key);
+		return 0;
+	}
+
+	DPRINTF("%s: no shared cache (%d), using a private one\n",
+		cache->name, err);
+
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
 	if (err)
 		goto fail;
 
 	tree->cache = cache;
-	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
-		cache->request_free_list[i] = cache->requests + i;
 
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
@@ -580,8 +1211,14 @@ block_cache_close(td_driver_t *driver)
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	if (cache->shared) {
+		block_cache_shared_unmap();
+		cache->shared = NULL;
+	} else {
+		tapdisk_server_unregister_event(cache->timeout_id);
+		radix_tree_free(tree);
+	}
+
 	free(cache->name);
 
 	return 0;
@@ -614,7 +1251,7 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	cache->stats.hits += treq.secs;
 
 	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
+		DBG("%s: block cache hit: sec 0x%08"PRIx64", hash: 0x%08"PRIx64"\n",
 		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
 
 		off = i << RADIX_TREE_NODE_SHIFT;
@@ -648,7 +1285,7 @@ block_cache_populate_cache(td_request_t clone, int err)
 
 	for (i = 0; i < breq->treq.secs; i++) {
 		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
+		DBG("%s: populating sec 0x%08"PRIx64"\n",
 		    cache->name, breq->treq.sec + i);
 		memcpy(breq->treq.buf + off,
 		       breq->buf + off, RADIX_TREE_NODE_SIZE);
@@ -672,7 +1309,7 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	DBG("%s: block cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
 
 	clone = treq;
 	tree  = &cache->tree;
@@ -719,6 +1356,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	if (cache->shared)
+		return block_cache_shared_read(cache, treq);
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -771,6 +1411,18 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->shared) {
+		block_cache_shared_hdr_t *hdr = cache->shared->hdr;
+
+		WARN("shared %s: %u sets of %u pages\n",
+		     BLOCK_CACHE_SHARED_PATH, hdr->sets, hdr->ways);
+		WARN("host hits: %"PRIu64", misses: %"PRIu64", "
+		     "inserts: %"PRIu64", evictions: %"PRIu64", "
+		     "collisions: %"PRIu64", stale: %"PRIu64"\n",
+		     hdr->hits, hdr->misses, hdr->inserts,
+		     hdr->evictions, hdr->collisions, hdr->stale);
+	}
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -41,6 +41,15 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * With a metadata journal (all but LVM and block devices), bitmap and BAT
+ * writes are not issued in place.  Bitmaps whose data writes completed
+ * are logged, together with the BAT sectors publishing any blocks they
+ * belong to, as one redo log at the end of each event loop iteration.
+ * Transactions complete once their log is on disk; logged metadata is
+ * written back to the vhd in batches (checkpoints) and on close, and
+ * the newest log is replayed on open after a crash.  Any number of
+ * blocks may be allocated concurrently.
  */
 
 #include <errno.h>
@@ -55,8 +64,10 @@
 #include <sys/mman.h>
 
 #include "libvhd.h"
+#include "libvhd-journal.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
+#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 
@@ -121,6 +132,7 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_JOURNAL_WRITE         6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -135,6 +147,9 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_STRICT         8
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
+#define VHD_FLAG_OPEN_JOURNAL        64
+
+#define VHD_JOURNAL_MAX_DIRTY        32  /* checkpoint threshold (items) */
 
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
@@ -213,6 +228,34 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+	u64                       alloc;       /* block reserved for this
+						* bitmap, awaiting a journaled
+						* bat update */
+};
+
+struct vhd_journal_item {
+	uint64_t                  offset;      /* in the vhd, bytes */
+	size_t                    size;
+	char                     *buf;
+	struct vhd_journal_item  *next;
+};
+
+struct vhd_journal_state {
+	int                       fd;
+	char                     *name;
+	char                     *buf;         /* log being written */
+	size_t                    size;        /* bytes per log region */
+	uint64_t                  gen;         /* generation of last log */
+	event_id_t                flush_id;
+	int                       flushing;
+	struct vhd_request        req;         /* for writing the log */
+	struct vhd_req_list       pending;     /* bitmap writes to log next */
+	struct vhd_req_list       inflight;    /* bitmap writes being logged */
+	struct vhd_journal_item  *staged;      /* contents of log in flight */
+	struct vhd_journal_item  *dirty;       /* logged, not checkpointed */
+	int                       nr_dirty;
+	uint64_t                  flushes;
+	uint64_t                  checkpoints;
 };
 
 struct vhd_state {
@@ -226,6 +269,7 @@ struct vhd_state {
 						* (unallocated) datablock */
 
 	struct vhd_bat_state      bat;
+	struct vhd_journal_state  journal;
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
@@ -258,6 +302,7 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void journal_schedule_flush(struct vhd_state *);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -505,6 +550,181 @@ fail:
 	return err;
 }
 
+static inline int
+vhd_journaling(struct vhd_state *s)
+{
+	return test_vhd_flag(s->flags, VHD_FLAG_OPEN_JOURNAL);
+}
+
+static struct vhd_journal_item *
+journal_find_item(struct vhd_journal_item *list, uint64_t offset)
+{
+	for (; list; list = list->next)
+		if (list->offset == offset)
+			return list;
+
+	return NULL;
+}
+
+static void
+journal_free_items(struct vhd_journal_item *list)
+{
+	struct vhd_journal_item *next;
+
+	while (list) {
+		next = list->next;
+		free(list->buf);
+		free(list);
+		list = next;
+	}
+}
+
+static int
+journal_add_item(struct vhd_journal_item **list,
+		 uint64_t offset, const char *buf, size_t size)
+{
+	int err;
+	struct vhd_journal_item *item;
+
+	item = calloc(1, sizeof(struct vhd_journal_item));
+	if (!item)
+		return -ENOMEM;
+
+	err = posix_memalign((void **)&item->buf, VHD_SECTOR_SIZE, size);
+	if (err) {
+		free(item);
+		return -err;
+	}
+
+	memcpy(item->buf, buf, size);
+	item->offset = offset;
+	item->size   = size;
+	item->next   = *list;
+	*list        = item;
+
+	return 0;
+}
+
+/*
+ * write logged metadata back in place; later logs need not carry it.
+ * only called while no log is in flight, or for items no log in
+ * flight supersedes.
+ */
+static int
+journal_checkpoint(struct vhd_state *s)
+{
+	ssize_t ret;
+	struct vhd_journal_item *item;
+	struct vhd_journal_state *j = &s->journal;
+
+	for (item = j->dirty; item; item = item->next) {
+		ret = pwrite(s->vhd.fd, item->buf, item->size, item->offset);
+		if (ret != item->size) {
+			ret = (ret == -1 ? -errno : -EIO);
+			EPRINTF("%s: journal checkpoint at 0x%08"PRIx64": %d\n",
+				s->vhd.file, item->offset, (int)ret);
+			return ret;
+		}
+	}
+
+	journal_free_items(j->dirty);
+	j->dirty    = NULL;
+	j->nr_dirty = 0;
+	j->checkpoints++;
+
+	return 0;
+}
+
+static void
+vhd_close_journal(struct vhd_state *s)
+{
+	int err;
+	struct vhd_journal_state *j = &s->journal;
+
+	if (!j->name)
+		return;
+
+	if (j->flush_id)
+		tapdisk_server_unregister_event(j->flush_id);
+
+	ASSERT(!j->flushing && !j->pending.head);
+
+	/* keep the log for replay if the vhd could not be updated */
+	err = journal_checkpoint(s);
+	close(j->fd);
+	if (!err)
+		unlink(j->name);
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+		DPRINTF("%s: journal: logs: %"PRIu64", checkpoints: %"PRIu64"\n",
+			s->vhd.file, j->flushes, j->checkpoints);
+
+	journal_free_items(j->dirty);
+	free(j->buf);
+	free(j->name);
+	memset(j, 0, sizeof(struct vhd_journal_state));
+}
+
+static int
+vhd_open_journal(struct vhd_state *s)
+{
+	int err, psize;
+	size_t entry;
+	struct vhd_journal_state *j = &s->journal;
+
+	memset(j, 0, sizeof(struct vhd_journal_state));
+
+	if (asprintf(&j->name, "%s.mdj", s->vhd.file) == -1) {
+		j->name = NULL;
+		return -ENOMEM;
+	}
+
+	/* room for a full checkpoint's worth plus a cache of bitmaps and
+	 * the bat sectors they touch */
+	psize   = getpagesize();
+	entry   = vhd_journal_log_entry_size(vhd_sectors_to_bytes(s->bm_secs));
+	j->size = sizeof(vhd_journal_header_t) +
+		(VHD_JOURNAL_MAX_DIRTY + 2 * VHD_CACHE_SIZE) * entry;
+	j->size = (j->size + psize - 1) & ~(psize - 1);
+
+	err = vhd_journal_log_replay(&s->vhd, j->name, j->size, &j->gen);
+	if (err < 0) {
+		EPRINTF("%s: replaying journal %s: %d\n",
+			s->vhd.file, j->name, err);
+		goto fail;
+	}
+
+	if (err)
+		DPRINTF("%s: replayed %d journal entries\n", s->vhd.file, err);
+
+	err = posix_memalign((void **)&j->buf, psize, j->size);
+	if (err) {
+		j->buf = NULL;
+		err    = -err;
+		goto fail;
+	}
+
+	j->fd = open(j->name, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (j->fd == -1) {
+		err = -errno;
+		EPRINTF("%s: opening journal %s: %d, journaling disabled\n",
+			s->vhd.file, j->name, err);
+		free(j->buf);
+		free(j->name);
+		memset(j, 0, sizeof(struct vhd_journal_state));
+		clear_vhd_flag(s->flags, VHD_FLAG_OPEN_JOURNAL);
+		return 0;
+	}
+
+	return 0;
+
+fail:
+	free(j->buf);
+	free(j->name);
+	memset(j, 0, sizeof(struct vhd_journal_state));
+	return err;
+}
+
 static int
 vhd_initialize_dynamic_disk(struct vhd_state *s)
 {
@@ -530,17 +750,28 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE))
 		return 0;
 
+	/* a crash may have left logged metadata that the bat depends on */
+	if (vhd_journaling(s)) {
+		err = vhd_open_journal(s);
+		if (err)
+			return err;
+	}
+
 	err = vhd_initialize_bat(s);
 	if (err)
-		return err;
+		goto fail;
 
 	err = vhd_initialize_bitmap_cache(s);
 	if (err) {
 		vhd_free_bat(s);
-		return err;
+		goto fail;
 	}
 
 	return 0;
+
+fail:
+	vhd_close_journal(s);
+	return err;
 }
 
 static int
@@ -632,6 +863,9 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s->spb = s->spp = 1;
 
+	if (!vhd_type_dynamic(&s->vhd) || s->vhd.is_block)
+		clear_vhd_flag(s->flags, VHD_FLAG_OPEN_JOURNAL);
+
 	if (vhd_type_dynamic(&s->vhd)) {
 		err = vhd_initialize_dynamic_disk(s);
 		if (err)
@@ -667,6 +901,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
         return 0;
 
  fail:
+	vhd_close_journal(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -696,6 +931,11 @@ _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
 		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
 
+	/* journal metadata updates for all but LVM storage */
+	if (driver->storage != TAPDISK_STORAGE_TYPE_LVM &&
+	    !(flags & (TD_OPEN_RDONLY | TD_OPEN_QUERY | TD_OPEN_NO_JOURNAL)))
+		vhd_flags |= VHD_FLAG_OPEN_JOURNAL;
+
 	return __vhd_open(driver, name, vhd_flags);
 }
 
@@ -734,6 +974,8 @@ _vhd_close(td_driver_t *driver)
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
+
+	vhd_close_journal(s);
 	
 	/* 
 	 * write footer if:
@@ -960,6 +1202,7 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	bm->blk    = 0;
 	bm->seqno  = 0;
 	bm->status = 0;
+	bm->alloc  = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -983,6 +1226,35 @@ get_bitmap(struct vhd_state *s, uint32_t block)
 	return NULL;
 }
 
+/* sector offset of a block whose bat entry is not yet committed */
+static inline uint64_t
+pending_block_offset(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap *bm;
+
+	if (!vhd_journaling(s))
+		return s->bat.pbw_offset;
+
+	bm = get_bitmap(s, blk);
+	ASSERT(bm && bm->alloc);
+
+	return bm->alloc;
+}
+
+/* the on-disk copy of @bm is stale until the journal is checkpointed */
+static inline int
+journal_bitmap_dirty(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	uint64_t offset;
+
+	offset = bat_entry(s, bm->blk);
+	if (offset == DD_BLK_UNUSED)
+		return 0;
+
+	return !!journal_find_item(s->journal.dirty,
+				   vhd_sectors_to_bytes(offset));
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1013,7 +1285,8 @@ bitmap_in_use(struct vhd_bitmap *bm)
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
-		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
+		bm->waiting.head || bm->tx.requests.head || bm->queue.head ||
+		bm->alloc);
 }
 
 static inline int
@@ -1033,16 +1306,24 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
+	int i, idx = 0, clean;
+	u64 seq;
 	struct vhd_bitmap *bm, *lru = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
+	/*
+	 * when journaling, prefer bitmaps whose on-disk copy is current:
+	 * reading back a dirty one forces a checkpoint.
+	 */
+	for (clean = vhd_journaling(s); !lru && clean >= 0; clean--) {
+		seq = s->bm_lru;
+		for (i = 0; i < VHD_CACHE_SIZE; i++) {
+			bm = s->bitmap[i];
+			if (bm && bm->seqno < seq && !bitmap_locked(bm) &&
+			    !(clean && journal_bitmap_dirty(s, bm))) {
+				idx = i;
+				lru = bm;
+				seq = lru->seqno;
+			}
 		}
 	}
 
@@ -1442,6 +1723,59 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * journaled allocation: reserve the block and hold it on its bitmap
+ * until the log carrying its bat entry is on disk.  nothing is written
+ * in place, so any number of blocks may be pending at once.
+ */
+static int
+journal_allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err, gap;
+	uint64_t size;
+	struct vhd_bitmap *bm;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+
+	bm = get_bitmap(s, blk);
+	if (bm && bm->alloc)
+		return 0;
+
+	if (!bm) {
+		/* install empty bitmap in cache */
+		err = alloc_vhd_bitmap(s, &bm, blk);
+		if (err)
+			return err;
+
+		install_bitmap(s, bm);
+	}
+
+	gap = 0;
+
+	/* data region of segment should begin on page boundary */
+	if ((s->next_db + s->bm_secs) % s->spp)
+		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
+		size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
+		err  = pwrite(s->vhd.fd, vhd_zeros(size), size,
+			      vhd_sectors_to_bytes(s->next_db));
+		if (err != size) {
+			err = (err == -1 ? -errno : -EIO);
+			ERR(err, "write failed");
+			return err;
+		}
+	}
+
+	bm->alloc  = s->next_db + gap;
+	s->next_db = bm->alloc + s->bm_secs + s->spb;
+	lock_bitmap(bm);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, alloc: 0x%08"PRIx64"\n", blk, bm->alloc);
+
+	return 0;
+}
+
 static int 
 schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 {
@@ -1505,7 +1839,9 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
-		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		if (vhd_journaling(s))
+			err = journal_allocate_block(s, blk);
+		else if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
 			err = allocate_block(s, blk);
 		else
 			err = update_bat(s, blk);
@@ -1513,7 +1849,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = pending_block_offset(s, blk);
 	}
 
 	offset += s->bm_secs + sec;
@@ -1567,6 +1903,13 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 
 	offset = vhd_sectors_to_bytes(offset);
 
+	if (vhd_journaling(s) &&
+	    journal_find_item(s->journal.dirty, offset)) {
+		err = journal_checkpoint(s);
+		if (err)
+			return err;
+	}
+
 	err = alloc_vhd_bitmap(s, &bm, blk);
 	if (err)
 		return err;
@@ -1608,8 +1951,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(vhd_journaling(s) ||
+		       (bat_locked(s) && s->bat.pbw_blk == blk));
+		offset = pending_block_offset(s, blk);
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1624,11 +1968,18 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	req->op        = VHD_OP_BITMAP_WRITE;
 	req->next      = NULL;
 
-	aio_write(s, req, offset);
 	lock_bitmap(bm);
 	touch_bitmap(s, bm);     /* bump lru count */
 	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
 
+	if (vhd_journaling(s)) {
+		/* logged (with any new bat entry) at end of iteration */
+		add_to_tail(&s->journal.pending, req);
+		s->queued++;
+		journal_schedule_flush(s);
+	} else
+		aio_write(s, req, offset);
+
 	DBG(TLOG_DBG, "%s: blk: 0x%04x, sec: 0x%08"PRIx64", nr_secs: 0x%04x, "
 	    "offset: 0x%"PRIx64"\n", s->vhd.file, blk, req->treq.sec,
 	    req->treq.secs, offset);
@@ -2186,6 +2537,242 @@ finish_data_write(struct vhd_request *req)
 	}
 }
 
+static void
+journal_signal(struct vhd_state *s, struct vhd_request *list, int error)
+{
+	struct vhd_request *r, *next;
+
+	for (r = list; r; r = next) {
+		next     = r->next;
+		r->next  = NULL;
+		r->error = error;
+		s->completed++;
+		finish_bitmap_write(r);
+	}
+}
+
+/* log the bitmap of @req, and the bat sector if its block is new */
+static int
+journal_stage_request(struct vhd_state *s,
+		      struct vhd_journal_item **staged, struct vhd_request *req)
+{
+	int i, err;
+	u32 blk, entry, *bat;
+	u64 offset;
+	struct vhd_bitmap *bm;
+	struct vhd_journal_item *item;
+
+	blk = req->treq.sec / s->spb;
+	bm  = get_bitmap(s, blk);
+
+	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
+
+	offset = (bm->alloc ? bm->alloc : bat_entry(s, blk));
+	err    = journal_add_item(staged, vhd_sectors_to_bytes(offset),
+				  bm->shadow, vhd_sectors_to_bytes(s->bm_secs));
+	if (err || !bm->alloc)
+		return err;
+
+	offset = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	item   = journal_find_item(*staged, offset);
+	if (!item) {
+		err = journal_add_item(staged, offset,
+				       (char *)&bat_entry(s, blk - (blk % 128)),
+				       VHD_SECTOR_SIZE);
+		if (err)
+			return err;
+
+		item = *staged;
+		bat  = (u32 *)item->buf;
+		for (i = 0; i < 128; i++)
+			BE32_OUT(&bat[i]);
+	}
+
+	entry = bm->alloc;
+	BE32_OUT(&entry);
+	((u32 *)item->buf)[blk % 128] = entry;
+
+	return 0;
+}
+
+static void
+journal_flush(struct vhd_state *s)
+{
+	int err, n;
+	size_t len;
+	struct vhd_request *r;
+	struct vhd_journal_item *staged, *item;
+	struct vhd_journal_state *j = &s->journal;
+
+	if (j->flushing || !j->pending.head)
+		return;
+
+	n      = 0;
+	len    = 0;
+	staged = NULL;
+
+	/*
+	 * if the checkpoint fails, fail what is pending rather than let
+	 * the dirty list outgrow the log; the next flush tries again.
+	 */
+	if (j->nr_dirty >= VHD_JOURNAL_MAX_DIRTY) {
+		err = journal_checkpoint(s);
+		if (err)
+			goto fail;
+	}
+
+	for (r = j->pending.head; r; r = r->next) {
+		err = journal_stage_request(s, &staged, r);
+		if (err)
+			goto fail;
+	}
+
+	for (item = staged; item; item = item->next, n++) {
+		err = vhd_journal_log_add(j->buf, j->size, &len,
+					  item->offset, item->buf, item->size);
+		if (err)
+			goto fail;
+	}
+
+	/* each log carries everything not yet checkpointed */
+	for (item = j->dirty; item; item = item->next) {
+		if (journal_find_item(staged, item->offset))
+			continue;
+
+		err = vhd_journal_log_add(j->buf, j->size, &len,
+					  item->offset, item->buf, item->size);
+		if (err)
+			goto fail;
+		n++;
+	}
+
+	vhd_journal_log_seal(j->buf, &s->vhd.footer.uuid, ++j->gen, n, len);
+	len = vhd_bytes_padded(len);
+
+	j->staged   = staged;
+	j->inflight = j->pending;
+	j->flushing = 1;
+	j->flushes++;
+	clear_req_list(&j->pending);
+
+	r = &j->req;
+	init_vhd_request(s, r);
+	r->op        = VHD_OP_JOURNAL_WRITE;
+	r->treq.secs = len >> VHD_SECTOR_SHIFT;
+	r->treq.buf  = j->buf;
+
+	/* logs alternate between two regions, so one is always whole */
+	td_prep_write(&r->tiocb, j->fd, j->buf, len,
+		      (j->gen & 1) * j->size, vhd_complete, r);
+	td_queue_tiocb(s->driver, &r->tiocb);
+
+	s->queued++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "%s: gen: %"PRIu64", entries: %d, bytes: %zu\n",
+	    s->vhd.file, j->gen, n, len);
+	return;
+
+fail:
+	ERR(err, "%s: building journal log\n", s->vhd.file);
+	journal_free_items(staged);
+	r = j->pending.head;
+	clear_req_list(&j->pending);
+	journal_signal(s, r, err);
+}
+
+static void
+journal_flush_event(event_id_t id, char mode, void *private)
+{
+	struct vhd_state *s = (struct vhd_state *)private;
+
+	tapdisk_server_unregister_event(id);
+	s->journal.flush_id = 0;
+	journal_flush(s);
+}
+
+/*
+ * bitmap writes are logged at the end of the current event loop
+ * iteration, so that everything completing in one pass shares a log.
+ */
+static void
+journal_schedule_flush(struct vhd_state *s)
+{
+	event_id_t id;
+	struct vhd_journal_state *j = &s->journal;
+
+	if (j->flush_id || j->flushing)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, /* dummy fd */
+					   0, journal_flush_event, s);
+	if (id < 0) {
+		journal_flush(s);
+		return;
+	}
+
+	j->flush_id = id;
+}
+
+static void
+finish_journal_write(struct vhd_request *req)
+{
+	struct vhd_bitmap *bm;
+	struct vhd_request *r, *list;
+	struct vhd_journal_item *item, *next, *old;
+	struct vhd_state *s = req->state;
+	struct vhd_journal_state *j = &s->journal;
+
+	s->returned++;
+	TRACE(s);
+
+	ASSERT(j->flushing);
+
+	list        = j->inflight.head;
+	j->flushing = 0;
+	clear_req_list(&j->inflight);
+
+	if (req->error) {
+		journal_free_items(j->staged);
+		j->staged = NULL;
+		goto out;
+	}
+
+	for (item = j->staged; item; item = next) {
+		next = item->next;
+		old  = journal_find_item(j->dirty, item->offset);
+		if (old) {
+			free(old->buf);
+			old->buf = item->buf;
+			free(item);
+			continue;
+		}
+
+		item->next = j->dirty;
+		j->dirty   = item;
+		j->nr_dirty++;
+	}
+	j->staged = NULL;
+
+	/* the log published any blocks its bitmaps were waiting on */
+	for (r = list; r; r = r->next) {
+		bm = get_bitmap(s, r->treq.sec / s->spb);
+		ASSERT(bm);
+		if (bm->alloc) {
+			bat_entry(s, bm->blk) = bm->alloc;
+			bm->alloc = 0;
+		}
+	}
+
+ out:
+	journal_signal(s, list, req->error);
+
+	/* group commit whatever queued up behind this log */
+	if (j->pending.head)
+		journal_schedule_flush(s);
+}
+
 void
 vhd_complete(void *arg, struct tiocb *tiocb, int err)
 {
@@ -2230,6 +2817,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_JOURNAL_WRITE:
+		finish_journal_write(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2302,6 +2893,13 @@ vhd_debug(td_driver_t *driver)
 	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
 	    s->bat.pbw_offset, s->bat.req.tx);
 
+	if (vhd_journaling(s))
+		DBG(TLOG_WARN, "JOURNAL: gen: %"PRIu64", flushing: %d, "
+		    "pending: %p, dirty: %d, logs: %"PRIu64", checkpoints: "
+		    "%"PRIu64"\n", s->journal.gen, s->journal.flushing,
+		    s->journal.pending.head, s->journal.nr_dirty,
+		    s->journal.flushes, s->journal.checkpoints);
+
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
 		DPRINTF("%d: %u\n", i, s->bat.bat[i]);
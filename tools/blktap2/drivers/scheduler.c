@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -37,6 +38,7 @@
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EVENTS         256
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -47,117 +49,251 @@
 #define scheduler_for_each_event(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+#define scheduler_wheel_slot(s, t)	\
+	(&(s)->wheel[(t) & (SCHEDULER_WHEEL_SIZE - 1)])
+
 typedef struct event {
 	char                         mode;
 	event_id_t                   id;
 
 	int                          fd;
+	int                          poll_fd;
 	int                          timeout;
 	int                          deadline;
+	int                          dead;
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             timer;
 } event_t;
 
-static void
-scheduler_prepare_events(scheduler_t *s)
+static inline int
+scheduler_now(void)
 {
-	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	gettimeofday(&now, NULL);
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	return now.tv_sec;
+}
 
-	gettimeofday(&now, NULL);
+/*
+ * Timeout events sit on a hashed wheel of one-second slots, indexed
+ * by deadline.  Deadlines further out than the wheel stay in their
+ * slot until a later rotation; ones already due go to the current
+ * slot.  wheel_time is the second last run, and its slot is looked at
+ * again on the next run, so nothing can be skipped.
+ */
+static void
+scheduler_add_timer(scheduler_t *s, event_t *event)
+{
+	int t = MAX(event->deadline, s->wheel_time);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	list_add_tail(&event->timer, scheduler_wheel_slot(s, t));
+}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_del_timer(scheduler_t *s, event_t *event)
+{
+	list_del_init(&event->timer);
+}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static int
+scheduler_next_timeout(scheduler_t *s, int now)
+{
+	struct list_head *slot;
+	event_t *event;
+	int t, end;
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+	end = s->wheel_time + SCHEDULER_WHEEL_SIZE;
+
+	for (t = s->wheel_time; t < end; t++) {
+		slot = scheduler_wheel_slot(s, t);
+
+		list_for_each_entry(event, slot, timer)
+			if (event->deadline < end)
+				return MAX(t - now, 0);
 	}
 
+	/* only far-off timers: wake up once a rotation to advance */
+	return SCHEDULER_WHEEL_SIZE;
+}
+
+static void
+scheduler_prepare_events(scheduler_t *s)
+{
+	s->timeout = MIN(scheduler_next_timeout(s, scheduler_now()),
+			 SCHEDULER_MAX_TIMEOUT);
 	s->timeout = MIN(s->timeout, s->max_timeout);
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+		scheduler_del_timer(s, event);
+		event->deadline = scheduler_now() + event->timeout;
+		scheduler_add_timer(s, event);
 	}
 
 	event->cb(event->id, mode, event->private);
 }
 
+static char
+scheduler_event_mode(event_t *event, uint32_t revents)
+{
+	if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+	    (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_READ_FD;
+
+	if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+	    (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+		return SCHEDULER_POLL_WRITE_FD;
+
+	if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+	    (revents & EPOLLPRI))
+		return SCHEDULER_POLL_EXCEPT_FD;
+
+	return 0;
+}
+
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_timers(scheduler_t *s)
 {
-	struct timeval now;
-	event_t *event, *tmp;
+	struct list_head expired;
+	event_t *event;
+	int t, now;
 
-	gettimeofday(&now, NULL);
+	now = scheduler_now();
 
- again:
-	s->restart = 0;
+	/* the clock went backwards; deadlines just come later */
+	if (now < s->wheel_time)
+		s->wheel_time = now;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
+	/*
+	 * Collect every slot that came due before running anything, so
+	 * a callback re-arming its own timer fires once per wait, as
+	 * it did under select().
+	 */
+	INIT_LIST_HEAD(&expired);
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+	for (t = s->wheel_time;
+	     t <= now && t < s->wheel_time + SCHEDULER_WHEEL_SIZE; t++) {
+		struct list_head *slot = scheduler_wheel_slot(s, t);
+
+		list_splice(slot, &expired);
+		INIT_LIST_HEAD(slot);
+	}
+
+	s->wheel_time = now;
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
+	while (!list_empty(&expired)) {
+		event = list_entry(expired.next, event_t, timer);
+		list_del_init(&event->timer);
+
+		if (event->deadline > now) {
+			scheduler_add_timer(s, event);
+			continue;
 		}
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		scheduler_event_callback(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
+}
 
-	next:
-		if (s->restart)
-			goto again;
+static void
+scheduler_run_events(scheduler_t *s, struct epoll_event *ready, int n)
+{
+	event_t *event;
+	char mode;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		event = ready[i].data.ptr;
+
+		/* unregistered by an earlier callback in this batch */
+		if (event->dead)
+			continue;
+
+		mode = scheduler_event_mode(event, ready[i].events);
+		if (mode)
+			scheduler_event_callback(s, event, mode);
+	}
+
+	scheduler_run_timers(s);
+}
+
+static void
+scheduler_free_dead_events(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	list_for_each_entry_safe(event, tmp, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
+}
+
+static int
+scheduler_poll_event(scheduler_t *s, event_t *event)
+{
+	struct epoll_event ev;
+	int err;
+
+	memset(&ev, 0, sizeof(ev));
+
+	if (event->mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (event->mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+	if (event->mode & SCHEDULER_POLL_EDGE)
+		ev.events |= EPOLLET;
+
+	ev.data.ptr = event;
+
+	event->poll_fd = event->fd;
+
+	err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, event->poll_fd, &ev);
+	if (err && errno == EEXIST) {
+		/*
+		 * epoll wants one registration per fd, select() did
+		 * not care.  A dup gives the second event its own key.
+		 */
+		event->poll_fd = dup(event->fd);
+		if (event->poll_fd < 0)
+			return -errno;
+
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD,
+				event->poll_fd, &ev);
 	}
+
+	if (err) {
+		err = -errno;
+		if (event->poll_fd != event->fd)
+			close(event->poll_fd);
+		event->poll_fd = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+static void
+scheduler_unpoll_event(scheduler_t *s, event_t *event)
+{
+	if (event->poll_fd < 0)
+		return;
+
+	/* fails harmlessly if the owner already closed the fd */
+	epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, event->poll_fd, NULL);
+
+	if (event->poll_fd != event->fd)
+		close(event->poll_fd);
+
+	event->poll_fd = -1;
 }
 
 int
@@ -165,7 +301,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -177,17 +313,29 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->timer);
 
 	event->mode     = mode;
 	event->fd       = fd;
+	event->poll_fd  = -1;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->deadline = scheduler_now() + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_poll_event(s, event);
+		if (err) {
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_add_timer(s, event);
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
@@ -207,9 +355,17 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
+			scheduler_unpoll_event(s, event);
+			scheduler_del_timer(s, event);
+
+			/*
+			 * the event may still be in the ready list being
+			 * run; free it once scheduler_wait_for_events is
+			 * done with it.
+			 */
+			event->dead = 1;
 			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+			list_add_tail(&event->next, &s->dead);
 			break;
 		}
 }
@@ -224,42 +380,53 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
+	struct epoll_event ready[SCHEDULER_MAX_EVENTS];
 	int ret;
-	struct timeval tv;
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, ready, SCHEDULER_MAX_EVENTS,
+			 s->timeout * 1000);
 
-	s->restart     = 0;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
-	if (ret < 0)
-		return ret;
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, ready, ret);
 
+out:
+	scheduler_free_dead_events(s);
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
-	memset(s, 0, sizeof(scheduler_t));
+	int i;
 
-	s->uuid = 1;
+	memset(s, 0, sizeof(scheduler_t));
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->uuid        = 1;
+	s->wheel_time  = scheduler_now();
+	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+
+	for (i = 0; i < SCHEDULER_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&s->wheel[i]);
+
+	s->epoll_fd = epoll_create(SCHEDULER_MAX_EVENTS);
+	if (s->epoll_fd < 0)
+		return -errno;
+
+	return 0;
 }
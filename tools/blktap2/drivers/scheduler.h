@@ -37,24 +37,32 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+/*
+ * Edge-triggered: the callback is only rerun once the fd signals
+ * again, so it must consume everything pending each time.
+ */
+#define SCHEDULER_POLL_EDGE          0x10
+
+#define SCHEDULER_WHEEL_SIZE         64
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
 
 	struct list_head             events;
+	struct list_head             dead;
+
+	struct list_head             wheel[SCHEDULER_WHEEL_SIZE];
+	int                          wheel_time;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
@@ -29,6 +29,10 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
@@ -44,6 +48,10 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -475,6 +483,7 @@ tapdisk_lio_setup(struct tqueue *queue, int qlen)
 {
 	struct lio *lio = queue->tio_data;
 	size_t sz;
+	char mode;
 	int err;
 
 	lio->event_id = -1;
@@ -483,8 +492,13 @@ tapdisk_lio_setup(struct tqueue *queue, int qlen)
 	if (err)
 		goto fail;
 
+	/* the eventfd is drained on every event; the aio poll fd is not */
+	mode = SCHEDULER_POLL_READ_FD;
+	if (lio->flags & LIO_FLAG_EVENTFD)
+		mode |= SCHEDULER_POLL_EDGE;
+
 	lio->event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+		tapdisk_server_register_event(mode,
 					      lio->event_fd, 0,
 					      tapdisk_lio_event,
 					      queue);
@@ -547,6 +561,510 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring
+ *
+ * Requests are written straight into the submission ring shared with
+ * the kernel, so a batch costs one io_uring_enter and no per-iocb
+ * copying.  Completions are reaped from the shared completion ring
+ * without a syscall: opportunistically after every submission, and
+ * from the scheduler when the registered eventfd fires.  Buffers in
+ * ranges registered through tapdisk_queue_register_buffer (the blktap
+ * data area of each VBD) go out as fixed-buffer ops, which saves the
+ * kernel pinning the pages on every request.
+ */
+
+#define URING_MAX_BUFS          64
+
+struct uring {
+	int                   ring_fd;
+
+	void                 *sq_mem;
+	size_t                sq_size;
+	void                 *cq_mem;
+	size_t                cq_size;
+	struct io_uring_sqe  *sqes;
+	size_t                sqes_size;
+
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_array;
+	unsigned              sq_mask;
+
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned              cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	struct io_event      *aio_events;
+
+	int                   event_fd;
+	int                   event_id;
+
+	struct iovec          bufs[URING_MAX_BUFS];
+	int                   nr_bufs;
+
+	int                   flags;
+};
+
+/* the buffer table in bufs[] is registered with the kernel */
+#define URING_FLAG_FIXED_BUFS   (1<<0)
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static int
+tapdisk_uring_check(void)
+{
+	/* IORING_OP_READ/WRITE and IORING_FEAT_NODROP appeared in 5.5/5.6 */
+	return tapdisk_linux_version() >= KERNEL_VERSION(5, 6, 0);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_size);
+		ur->sqes = NULL;
+	}
+
+	if (ur->cq_mem && ur->cq_mem != ur->sq_mem)
+		munmap(ur->cq_mem, ur->cq_size);
+	ur->cq_mem = NULL;
+
+	if (ur->sq_mem) {
+		munmap(ur->sq_mem, ur->sq_size);
+		ur->sq_mem = NULL;
+	}
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	if (ur->aio_events) {
+		free(ur->aio_events);
+		ur->aio_events = NULL;
+	}
+}
+
+static int
+tapdisk_uring_map_rings(struct tqueue *queue, struct io_uring_params *p)
+{
+	struct uring *ur = queue->tio_data;
+	void *mem;
+	int err;
+
+	ur->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ur->cq_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_size > ur->sq_size)
+			ur->sq_size = ur->cq_size;
+		ur->cq_size = ur->sq_size;
+	}
+
+	mem = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+	if (mem == MAP_FAILED)
+		goto fail;
+	ur->sq_mem = mem;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_mem = ur->sq_mem;
+	else {
+		mem = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (mem == MAP_FAILED)
+			goto fail;
+		ur->cq_mem = mem;
+	}
+
+	ur->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	mem = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+	if (mem == MAP_FAILED)
+		goto fail;
+	ur->sqes = mem;
+
+	ur->sq_head  = ur->sq_mem + p->sq_off.head;
+	ur->sq_tail  = ur->sq_mem + p->sq_off.tail;
+	ur->sq_array = ur->sq_mem + p->sq_off.array;
+	ur->sq_mask  = *(unsigned *)(ur->sq_mem + p->sq_off.ring_mask);
+
+	ur->cq_head  = ur->cq_mem + p->cq_off.head;
+	ur->cq_tail  = ur->cq_mem + p->cq_off.tail;
+	ur->cqes     = ur->cq_mem + p->cq_off.cqes;
+	ur->cq_mask  = *(unsigned *)(ur->cq_mem + p->cq_off.ring_mask);
+
+	return 0;
+
+fail:
+	err = -errno;
+	ERR(err, "failed to map io_uring rings");
+	return err;
+}
+
+/*
+ * Move whatever the kernel has posted to the completion ring over to
+ * aio_events, so the rest of the queue can treat them like libaio
+ * completions.  Never enters the kernel.
+ */
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	unsigned head, tail;
+	int n = 0;
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && n < queue->size) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+		struct io_event *ep = ur->aio_events + n++;
+
+		ep->obj  = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res  = cqe->res;
+		ep->res2 = 0;
+		head++;
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void
+tapdisk_uring_complete(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	ret = tapdisk_uring_reap(queue);
+	if (!ret)
+		return;
+
+	split = io_split(&queue->opioctx, ur->aio_events, ret);
+	tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+
+	tapdisk_uring_complete(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+
+	if (!tapdisk_uring_check()) {
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	/*
+	 * tapdisk_queue_full bounds the iocbs in flight by qlen, so a
+	 * completion ring of twice the submission ring can not overflow.
+	 */
+	memset(&p, 0, sizeof(p));
+	ur->ring_fd = __uring_setup(qlen, &p);
+	if (ur->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map_rings(queue, &p);
+	if (err)
+		goto fail;
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __uring_register(ur->ring_fd, IORING_REGISTER_EVENTFD,
+			       &ur->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD |
+					      SCHEDULER_POLL_EDGE,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	ur->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!ur->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	DPRINTF("io_uring: %u sq entries, %u cq entries\n",
+		p.sq_entries, p.cq_entries);
+
+	return 0;
+
+fail:
+	DPRINTF("Couldn't set up io_uring: %d\n", err);
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+/*
+ * The kernel buffer table can only be replaced as a whole.  Failure
+ * is not fatal (e.g. RLIMIT_MEMLOCK, or mappings that can not be
+ * pinned): requests then simply go out as non-fixed ops.
+ */
+static void
+tapdisk_uring_update_bufs(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int err;
+
+	if (ur->flags & URING_FLAG_FIXED_BUFS) {
+		__uring_register(ur->ring_fd, IORING_UNREGISTER_BUFFERS,
+				 NULL, 0);
+		ur->flags &= ~URING_FLAG_FIXED_BUFS;
+	}
+
+	if (!ur->nr_bufs)
+		return;
+
+	err = __uring_register(ur->ring_fd, IORING_REGISTER_BUFFERS,
+			       ur->bufs, ur->nr_bufs);
+	if (err) {
+		err = -errno;
+		DPRINTF("io_uring: can't register %d buffers (%d), "
+			"using unregistered I/O\n", ur->nr_bufs, err);
+		return;
+	}
+
+	ur->flags |= URING_FLAG_FIXED_BUFS;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (ur->nr_bufs == URING_MAX_BUFS)
+		return -ENOSPC;
+
+	ur->bufs[ur->nr_bufs].iov_base = buf;
+	ur->bufs[ur->nr_bufs].iov_len  = size;
+	ur->nr_bufs++;
+
+	tapdisk_uring_update_bufs(queue);
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *ur = queue->tio_data;
+	int i;
+
+	for (i = 0; i < ur->nr_bufs; i++)
+		if (ur->bufs[i].iov_base == buf)
+			break;
+
+	if (i == ur->nr_bufs)
+		return;
+
+	ur->bufs[i] = ur->bufs[--ur->nr_bufs];
+
+	tapdisk_uring_update_bufs(queue);
+}
+
+static int
+tapdisk_uring_find_buf(struct uring *ur, const struct iocb *iocb)
+{
+	unsigned long start = (unsigned long)iocb->u.c.buf;
+	unsigned long end = start + iocb->u.c.nbytes;
+	int i;
+
+	if (!(ur->flags & URING_FLAG_FIXED_BUFS))
+		return -1;
+
+	for (i = 0; i < ur->nr_bufs; i++) {
+		unsigned long base = (unsigned long)ur->bufs[i].iov_base;
+
+		if (start >= base && end <= base + ur->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *ur, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int idx = tapdisk_uring_find_buf(ur, iocb);
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (idx >= 0) {
+		sqe->opcode    = write ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->fd        = iocb->aio_fildes;
+	sqe->addr      = (unsigned long)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (uintptr_t)iocb;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/*
+	 * The kernel consumes every sqe on each enter, and at most
+	 * queue->size iocbs are in flight, so there is always room.
+	 */
+	tail = *ur->sq_tail;
+	for (i = 0; i < merged; i++) {
+		unsigned idx = (tail + i) & ur->sq_mask;
+
+		tapdisk_uring_prep_sqe(ur, &ur->sqes[idx], queue->iocbs[i]);
+		ur->sq_array[idx] = idx;
+	}
+	__atomic_store_n(ur->sq_tail, tail + merged, __ATOMIC_RELEASE);
+
+	do {
+		submitted = __uring_enter(ur->ring_fd, merged, 0, 0);
+	} while (submitted < 0 && errno == EINTR);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/*
+	 * Without SQPOLL the kernel only looks at the submission ring
+	 * inside io_uring_enter, so unconsumed sqes can be withdrawn.
+	 */
+	if (submitted < merged)
+		__atomic_store_n(ur->sq_tail, tail + submitted,
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	/* fast devices and cache hits may already be done */
+	tapdisk_uring_complete(queue);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1093,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_LINUX_IO_URING_H
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -673,6 +1196,22 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return 0;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
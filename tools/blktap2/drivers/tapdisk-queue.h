@@ -91,11 +91,17 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: long-lived I/O buffers the backend may pre-register */
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -119,6 +125,8 @@ int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+int tapdisk_queue_register_buffer(struct tqueue *, void *, size_t);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
@@ -101,6 +101,18 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -208,6 +220,13 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
+	int err;
+
+	err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_URING, NULL);
+	if (!err)
+		return 0;
+
 	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
@@ -283,9 +302,7 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return scheduler_initialize(&server.scheduler);
 }
 
 int
@@ -311,7 +328,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
@@ -580,7 +580,8 @@ tapdisk_vbd_register_event_watches(td_vbd_t *vbd)
 {
 	event_id_t id;
 
-	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD |
+					   SCHEDULER_POLL_EDGE,
 					   vbd->ring.fd, 0,
 					   tapdisk_vbd_ring_event, vbd);
 	if (id < 0)
@@ -631,6 +632,12 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
+	err = tapdisk_server_register_buffer((void *)ring->vstart,
+					     psize * MMAP_PAGES);
+	if (err)
+		DPRINTF("failed to register I/O buffers for %s: %d\n",
+			devname, err);
+
 	return 0;
 
 fail:
@@ -652,8 +659,10 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
-	if (vbd->ring.mem > 0)
+	if (vbd->ring.mem > 0) {
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
 		munmap(vbd->ring.mem, psize * BLKTAP_MMAP_REGION_SIZE);
+	}
 
 	return 0;
 }
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * vhd-bench: block allocation throughput of the tapdisk vhd driver.
+ *
+ * Creates a dynamic vhd and writes the first page of each of its first
+ * blocks with a fixed number of writes in flight, so that every write
+ * allocates.  Reports allocations/sec, then checks the bat and bitmaps
+ * of the closed image with libvhd.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define BENCH_WRITE_SIZE    4096
+
+struct bench_write {
+	uint32_t            blk;
+	char               *buf;
+	struct bench_write *next;
+};
+
+struct bench {
+	td_driver_t        *driver;
+	int                 spb;
+	int                 inflight;
+	int                 done;
+	int                 errors;
+	uint64_t            retries;
+	struct bench_write *retry;
+};
+
+static const char *program;
+
+extern tapdisk_server_t server;
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-n blocks] [-q depth] [-J] [-N] [-k] [-h] "
+		"-f file\n", program);
+	fprintf(stream, "  -n  blocks to allocate (default 1024)\n"
+		"  -q  writes in flight (default 32)\n"
+		"  -J  disable the metadata journal\n"
+		"  -N  open as NFS storage (no block preallocation)\n"
+		"  -k  keep the image\n");
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_complete(td_request_t treq, int err)
+{
+	struct bench *b = treq.cb_data;
+	struct bench_write *w = treq.private;
+
+	b->inflight--;
+
+	if (err == -EBUSY) {
+		w->next  = b->retry;
+		b->retry = w;
+		b->retries++;
+		return;
+	}
+
+	if (err) {
+		fprintf(stderr, "write to block %u failed: %d\n", w->blk, err);
+		b->errors++;
+	}
+
+	b->done++;
+}
+
+static void
+bench_submit(struct bench *b, struct bench_write *w)
+{
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = w->buf;
+	treq.sec     = (uint64_t)w->blk * b->spb;
+	treq.secs    = BENCH_WRITE_SIZE >> VHD_SECTOR_SHIFT;
+	treq.cb      = bench_complete;
+	treq.cb_data = b;
+	treq.private = w;
+
+	b->inflight++;
+	b->driver->ops->td_queue_write(b->driver, treq);
+}
+
+static int
+bench_verify(const char *name, int blocks)
+{
+	int i, j, err;
+	char *map;
+	vhd_context_t vhd;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err) {
+		fprintf(stderr, "reopening %s: %d\n", name, err);
+		return err;
+	}
+
+	err = vhd_get_bat(&vhd);
+	if (err)
+		goto out;
+
+	for (i = 0; i < blocks; i++) {
+		if (vhd.bat.bat[i] == DD_BLK_UNUSED) {
+			fprintf(stderr, "block %d not allocated\n", i);
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = vhd_read_bitmap(&vhd, i, &map);
+		if (err) {
+			fprintf(stderr, "reading bitmap %d: %d\n", i, err);
+			goto out;
+		}
+
+		for (j = 0; j < vhd.spb; j++)
+			if (!!vhd_bitmap_test(&vhd, map, j) !=
+			    (j < BENCH_WRITE_SIZE >> VHD_SECTOR_SHIFT))
+				break;
+
+		free(map);
+
+		if (j != vhd.spb) {
+			fprintf(stderr, "block %d: bad bitmap at %d\n", i, j);
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, i, err, blocks, depth, keep, storage;
+	const char *name;
+	td_flag_t flags;
+	struct bench b;
+	struct bench_write *writes, *retry, *w;
+	double start, io, end;
+
+	name    = NULL;
+	blocks  = 1024;
+	depth   = 32;
+	keep    = 0;
+	storage = TAPDISK_STORAGE_TYPE_DEFAULT;
+	flags   = 0;
+	writes  = NULL;
+	start   = io = 0;
+
+	program = basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "f:n:q:JNkh")) != -1) {
+		switch (c) {
+		case 'f':
+			name = optarg;
+			break;
+		case 'n':
+			blocks = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'J':
+			flags |= TD_OPEN_NO_JOURNAL;
+			break;
+		case 'N':
+			storage = TAPDISK_STORAGE_TYPE_NFS;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (!name || blocks <= 0 || depth <= 0)
+		goto fail_usage;
+
+	err = vhd_create(name, (uint64_t)blocks << VHD_BLOCK_SHIFT,
+			 HD_TYPE_DYNAMIC, 0);
+	if (err) {
+		fprintf(stderr, "creating %s: %d\n", name, err);
+		return -err;
+	}
+
+	tapdisk_start_logging("vhd-bench");
+
+	memset(&b, 0, sizeof(b));
+
+	err = tapdisk_server_initialize();
+	if (err)
+		goto out;
+
+	b.driver = tapdisk_driver_allocate(DISK_TYPE_VHD, (char *)name,
+					   flags, storage);
+	if (!b.driver) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = b.driver->ops->td_open(b.driver, name, flags);
+	if (err) {
+		fprintf(stderr, "opening %s: %d\n", name, err);
+		goto out;
+	}
+
+	b.spb  = VHD_BLOCK_SIZE >> VHD_SECTOR_SHIFT;
+	writes = calloc(blocks, sizeof(struct bench_write));
+	if (!writes) {
+		err = -ENOMEM;
+		goto close;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		writes[i].blk = i;
+		err = posix_memalign((void **)&writes[i].buf,
+				     BENCH_WRITE_SIZE, BENCH_WRITE_SIZE);
+		if (err) {
+			err = -err;
+			goto close;
+		}
+		memset(writes[i].buf, i & 0xff, BENCH_WRITE_SIZE);
+	}
+
+	i     = 0;
+	start = bench_now();
+
+	while (b.done < blocks) {
+		/* writes refused with -EBUSY go again once per pass */
+		retry   = b.retry;
+		b.retry = NULL;
+		while (retry) {
+			w     = retry;
+			retry = w->next;
+			bench_submit(&b, w);
+		}
+
+		while (i < blocks && b.inflight < depth)
+			bench_submit(&b, &writes[i++]);
+
+		tapdisk_submit_all_tiocbs(&server.aio_queue);
+		tapdisk_server_iterate();
+	}
+
+	io = bench_now();
+
+close:
+	b.driver->ops->td_close(b.driver);
+	end = bench_now();
+
+	if (!err && writes) {
+		printf("%s: %d blocks, depth %d, journal %s, %s\n", name,
+		       blocks, depth,
+		       (flags & TD_OPEN_NO_JOURNAL) ? "off" : "on",
+		       storage == TAPDISK_STORAGE_TYPE_NFS ?
+		       "nfs" : "preallocated");
+		printf("  %.0f allocations/sec (%.3fs, close %.3fs), "
+		       "%"PRIu64" retries, %d errors\n",
+		       blocks / (io - start), io - start, end - io,
+		       b.retries, b.errors);
+
+		err = bench_verify(name, blocks);
+		if (!err)
+			printf("  verified\n");
+		else
+			printf("  verification failed: %d\n", err);
+
+		if (b.errors && !err)
+			err = -EIO;
+	}
+
+	if (writes)
+		for (i = 0; i < blocks; i++)
+			free(writes[i].buf);
+	free(writes);
+	tapdisk_driver_free(b.driver);
+
+out:
+	if (!keep)
+		unlink(name);
+	tapdisk_stop_logging();
+
+	return -err;
+
+fail_usage:
+	usage(stderr);
+	return EINVAL;
+}
@@ -46,7 +46,9 @@ typedef struct vhd_journal_header {
 	uint64_t                   journal_data_offset;
 	uint64_t                   journal_metadata_offset;
 	uint64_t                   journal_eof;
-	char                       pad[448];
+	uint64_t                   journal_generation;
+	uint32_t                   journal_log_checksum;
+	char                       pad[436];
 } vhd_journal_header_t;
 
 typedef struct vhd_journal {
@@ -65,4 +67,20 @@ int vhd_journal_revert(vhd_journal_t *);
 int vhd_journal_close(vhd_journal_t *);
 int vhd_journal_remove(vhd_journal_t *);
 
+/*
+ * Redo logs: a journal header followed by data entries, built in memory
+ * and written with a single i/o.  Logs are written alternately to two
+ * regions of one file; the header generation orders them on replay.
+ * The header checksums the whole log, so that a torn write never passes
+ * for a complete log, even when the other region's old entries are
+ * still behind the new header.
+ */
+size_t vhd_journal_log_entry_size(size_t size);
+int vhd_journal_log_add(char *log, size_t size, size_t *len,
+			uint64_t offset, const char *buf, size_t count);
+void vhd_journal_log_seal(char *log, vhd_uuid_t *uuid,
+			  uint64_t generation, uint32_t entries, size_t len);
+int vhd_journal_log_replay(vhd_context_t *, const char *jfile,
+			   size_t region, uint64_t *generation);
+
 #endif
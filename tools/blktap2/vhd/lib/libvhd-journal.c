@@ -129,6 +129,8 @@ vhd_journal_header_in(vhd_journal_header_t *header)
 	BE32_IN(&header->journal_metadata_entries);
 	BE64_IN(&header->journal_data_offset);
 	BE64_IN(&header->journal_metadata_offset);
+	BE64_IN(&header->journal_generation);
+	BE32_IN(&header->journal_log_checksum);
 }
 
 static inline void
@@ -139,6 +141,8 @@ vhd_journal_header_out(vhd_journal_header_t *header)
 	BE32_OUT(&header->journal_metadata_entries);
 	BE64_OUT(&header->journal_data_offset);
 	BE64_OUT(&header->journal_metadata_offset);
+	BE64_OUT(&header->journal_generation);
+	BE32_OUT(&header->journal_log_checksum);
 }
 
 static int
@@ -1532,3 +1536,259 @@ vhd_journal_revert(vhd_journal_t *j)
 
 	return vhd_journal_sync(j);
 }
+
+size_t
+vhd_journal_log_entry_size(size_t size)
+{
+	return sizeof(vhd_journal_entry_t) + size;
+}
+
+int
+vhd_journal_log_add(char *log, size_t size, size_t *len,
+		    uint64_t offset, const char *buf, size_t count)
+{
+	int err;
+	vhd_journal_entry_t entry;
+
+	if (!*len)
+		*len = sizeof(vhd_journal_header_t);
+
+	if (*len + vhd_journal_log_entry_size(count) > size)
+		return -ENOSPC;
+
+	memset(&entry, 0, sizeof(vhd_journal_entry_t));
+	entry.type     = VHD_JOURNAL_ENTRY_TYPE_DATA;
+	entry.size     = count;
+	entry.offset   = offset;
+	entry.cookie   = VHD_JOURNAL_ENTRY_COOKIE;
+	entry.checksum = vhd_journal_checksum_entry(&entry, (char *)buf, count);
+
+	err = vhd_journal_validate_entry(&entry);
+	if (err)
+		return err;
+
+	vhd_journal_entry_out(&entry);
+	memcpy(log + *len, &entry, sizeof(vhd_journal_entry_t));
+	memcpy(log + *len + sizeof(vhd_journal_entry_t), buf, count);
+	*len += vhd_journal_log_entry_size(count);
+
+	return 0;
+}
+
+/*
+ * FNV-1a over the entries of @log, up to @len, then over the generation
+ * and entry count of its header.  unlike the per-entry checksums, this
+ * depends on the order of the bytes and ties the entries to the header.
+ */
+static uint32_t
+vhd_journal_log_checksum(const char *log, size_t len,
+			 uint64_t generation, uint32_t entries)
+{
+	size_t i;
+	uint32_t hash;
+	const unsigned char *p;
+
+	hash = 2166136261U;
+
+	p = (const unsigned char *)log;
+	for (i = sizeof(vhd_journal_header_t); i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	p = (const unsigned char *)&generation;
+	for (i = 0; i < sizeof(generation); i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	p = (const unsigned char *)&entries;
+	for (i = 0; i < sizeof(entries); i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	return hash;
+}
+
+void
+vhd_journal_log_seal(char *log, vhd_uuid_t *uuid,
+		     uint64_t generation, uint32_t entries, size_t len)
+{
+	vhd_journal_header_t header;
+
+	memset(&header, 0, sizeof(vhd_journal_header_t));
+	memcpy(header.cookie,
+	       VHD_JOURNAL_HEADER_COOKIE, sizeof(header.cookie));
+	vhd_uuid_copy(&header.uuid, uuid);
+	header.journal_data_entries = entries;
+	header.journal_data_offset  = sizeof(vhd_journal_header_t);
+	header.journal_eof          = len;
+	header.journal_generation   = generation;
+	header.journal_log_checksum =
+		vhd_journal_log_checksum(log, len, generation, entries);
+
+	vhd_journal_header_out(&header);
+	memcpy(log, &header, sizeof(vhd_journal_header_t));
+}
+
+/*
+ * returns 0 if @log (of @len bytes) is a complete log for @vhd,
+ * i.e. its header is intact, every entry checksums, and the whole log
+ * matches the checksum of the header.
+ */
+static int
+vhd_journal_log_validate(vhd_context_t *vhd, char *log, size_t len)
+{
+	size_t pos;
+	uint32_t i;
+	vhd_journal_entry_t entry;
+	vhd_journal_header_t *header;
+
+	header = (vhd_journal_header_t *)log;
+
+	if (memcmp(header->cookie,
+		   VHD_JOURNAL_HEADER_COOKIE, sizeof(header->cookie)))
+		return -EINVAL;
+
+	if (vhd_uuid_compare(&header->uuid, &vhd->footer.uuid))
+		return -EINVAL;
+
+	if (header->journal_eof > len ||
+	    header->journal_data_offset != sizeof(vhd_journal_header_t))
+		return -EINVAL;
+
+	pos = header->journal_data_offset;
+	for (i = 0; i < header->journal_data_entries; i++) {
+		if (pos + sizeof(vhd_journal_entry_t) > header->journal_eof)
+			return -EINVAL;
+
+		memcpy(&entry, log + pos, sizeof(vhd_journal_entry_t));
+		vhd_journal_entry_in(&entry);
+		pos += sizeof(vhd_journal_entry_t);
+
+		if (vhd_journal_validate_entry(&entry) ||
+		    entry.type != VHD_JOURNAL_ENTRY_TYPE_DATA)
+			return -EINVAL;
+
+		if (pos + entry.size > header->journal_eof)
+			return -EINVAL;
+
+		if (vhd_journal_validate_entry_data(&entry, log + pos))
+			return -EINVAL;
+
+		pos += entry.size;
+	}
+
+	if (pos != header->journal_eof)
+		return -EINVAL;
+
+	if (vhd_journal_log_checksum(log, header->journal_eof,
+				     header->journal_generation,
+				     header->journal_data_entries) !=
+	    header->journal_log_checksum)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+vhd_journal_log_apply(vhd_context_t *vhd, char *log)
+{
+	int err;
+	size_t pos;
+	uint32_t i;
+	char *buf;
+	vhd_journal_entry_t entry;
+	vhd_journal_header_t *header;
+
+	header = (vhd_journal_header_t *)log;
+	pos    = header->journal_data_offset;
+
+	for (i = 0; i < header->journal_data_entries; i++) {
+		memcpy(&entry, log + pos, sizeof(vhd_journal_entry_t));
+		vhd_journal_entry_in(&entry);
+		pos += sizeof(vhd_journal_entry_t);
+
+		err = posix_memalign((void **)&buf,
+				     VHD_SECTOR_SIZE, entry.size);
+		if (err)
+			return -err;
+
+		memcpy(buf, log + pos, entry.size);
+		pos += entry.size;
+
+		err = vhd_seek(vhd, entry.offset, SEEK_SET);
+		if (!err)
+			err = vhd_write(vhd, buf, entry.size);
+
+		free(buf);
+		if (err)
+			return err;
+	}
+
+	if (fdatasync(vhd->fd))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * replays the newest complete log found in @jfile onto @vhd.
+ * @generation is set to the newest generation seen, so that logs
+ * written afterwards sort after anything left in the file.  returns
+ * the number of entries replayed.
+ */
+int
+vhd_journal_log_replay(vhd_context_t *vhd, const char *jfile,
+		       size_t region, uint64_t *generation)
+{
+	int i, fd, err, best;
+	char *log[2];
+	ssize_t ret;
+	vhd_journal_header_t *header;
+	uint64_t gen[2];
+
+	*generation = 0;
+	log[0] = log[1] = NULL;
+
+	fd = open(jfile, O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT ? 0 : -errno);
+
+	err  = 0;
+	best = -1;
+
+	for (i = 0; i < 2; i++) {
+		log[i] = malloc(region);
+		if (!log[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		ret = pread(fd, log[i], region, (off_t)i * region);
+		if (ret < (ssize_t)sizeof(vhd_journal_header_t))
+			continue;
+
+		header = (vhd_journal_header_t *)log[i];
+		vhd_journal_header_in(header);
+
+		if (vhd_journal_log_validate(vhd, log[i], ret))
+			continue;
+
+		gen[i] = header->journal_generation;
+		if (gen[i] > *generation)
+			*generation = gen[i];
+		if (best == -1 || gen[i] > gen[best])
+			best = i;
+	}
+
+	if (best == -1)
+		goto out;
+
+	err = vhd_journal_log_apply(vhd, log[best]);
+	if (!err) {
+		header = (vhd_journal_header_t *)log[best];
+		err    = header->journal_data_entries;
+	}
+
+out:
+	free(log[0]);
+	free(log[1]);
+	close(fd);
+	return err;
+}
@@ -2,10 +2,13 @@
  * xc_compression.c
  *
  * Checkpoint Compression using Page Delta Algorithm.
- * - A LRU cache of recently dirtied guest pages is maintained.
+ * - A cache of recently dirtied guest pages is maintained, managed with the
+ * 2Q replacement policy so that pages dirtied in most checkpoints are not
+ * pushed out by a burst of pages dirtied only once.
  * - For each dirty guest page in the checkpoint, if a previous version of the
  * page exists in the cache, XOR both pages and send the non-zero sections
  * to the receiver. The cache is then updated with the newer copy of guest page.
+ * The comparison uses SSE2 or AVX2 where the cpu has them.
  * - The receiver will XOR the non-zero sections against its copy of the guest
  * page, thereby bringing the guest page up-to-date with the sender side.
  *
@@ -33,24 +36,50 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 #include "xc_private.h"
 #include "xenctrl.h"
 #include "xg_save_restore.h"
 #include "xg_private.h"
 #include "xc_dom.h"
 
-/* Page Cache for Delta Compression*/
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SIMD_DIFF
+#endif
+
+/* Default size of the Page Cache for Delta Compression */
 #define DELTA_CACHE_SIZE (XC_PAGE_SIZE * 8192)
+#define MIN_CACHE_PAGES  4
 
 /* Internal page buffer to hold dirty pages of a checkpoint,
  * to be compressed after the domain is resumed for execution.
  */
 #define PAGE_BUFFER_SIZE (XC_PAGE_SIZE * 8192)
 
+/*
+ * 2Q: pages seen for the first time enter the A1in FIFO.  When they fall
+ * off its end their pfn is remembered, without the data, in the A1out
+ * FIFO.  A page referenced again while still remembered there was
+ * evicted too early, and goes into the Am LRU of hot pages; pages are
+ * evicted from Am only while A1in is within its share of the cache.
+ *
+ * cache_page entries with a page are data slots (on A1in, Am or the free
+ * list), those without are A1out ghosts (on A1out or the free ghost
+ * list).  pfn2cache maps a pfn to whichever it currently has.
+ */
+struct cache_list
+{
+    struct cache_page *head;
+    struct cache_page *tail;
+    unsigned long count;
+};
+
 struct cache_page
 {
     char *page;
     xen_pfn_t pfn;
+    struct cache_list *list;
     struct cache_page *next;
     struct cache_page *prev;
 };
@@ -69,13 +98,22 @@ struct compression_ctx
     unsigned int pfns_len;
     unsigned int pfns_index;
 
-    /* Compression Cache (LRU) */
+    /* Compression Cache (2Q) */
     char *cache_base;
     struct cache_page **pfn2cache;
     struct cache_page *cache;
-    struct cache_page *page_list_head;
-    struct cache_page *page_list_tail;
+    struct cache_page *ghosts;
+    struct cache_list a1in, am, a1out, free_pages, free_ghosts;
+    unsigned long a1in_max;
     unsigned long dom_pfnlist_size;
+
+    /* Delta engine, picked at context creation to suit the cpu */
+    const char *diff_name;
+    void (*diff_page)(const uint32_t *new, const uint32_t *old,
+                      uint64_t *diff);
+
+    /* Running totals, and their values when last reported */
+    xc_compression_stats_t stats, reported;
 };
 
 #define RUNFLAG 0
@@ -108,6 +146,152 @@ struct compression_ctx
 #define FULL_PAGE SKIPFLAG
 #define FULL_PAGE_SIZE (XC_PAGE_SIZE + 1)
 #define MAX_DELTAS (XC_PAGE_SIZE/sizeof(uint32_t))
+#define DIFF_LONGS (MAX_DELTAS/64)
+
+/*
+ * Delta engines: set bit i of diff[] if the i'th 32-bit word of new
+ * differs from that of old.  The run encoder in compress_page() only
+ * looks at the bitmap, so every engine produces the same stream.
+ */
+static void diff_page_scalar(const uint32_t *new, const uint32_t *old,
+                             uint64_t *diff)
+{
+    unsigned int i, j;
+    uint64_t bits;
+
+    for (i = 0; i < MAX_DELTAS; i += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j++)
+            bits |= (uint64_t)(new[i + j] != old[i + j]) << j;
+        diff[i / 64] = bits;
+    }
+}
+
+#ifdef HAVE_SIMD_DIFF
+__attribute__((target("sse2")))
+static void diff_page_sse2(const uint32_t *new, const uint32_t *old,
+                           uint64_t *diff)
+{
+    unsigned int i, j;
+    uint64_t bits;
+    __m128i a, b;
+
+    for (i = 0; i < MAX_DELTAS; i += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j += 4)
+        {
+            a = _mm_loadu_si128((const __m128i *)&new[i + j]);
+            b = _mm_loadu_si128((const __m128i *)&old[i + j]);
+            bits |= (uint64_t)(~_mm_movemask_ps(
+                        _mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) & 0xf) << j;
+        }
+        diff[i / 64] = bits;
+    }
+}
+
+__attribute__((target("avx2")))
+static void diff_page_avx2(const uint32_t *new, const uint32_t *old,
+                           uint64_t *diff)
+{
+    unsigned int i, j;
+    uint64_t bits;
+    __m256i a, b;
+
+    for (i = 0; i < MAX_DELTAS; i += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j += 8)
+        {
+            a = _mm256_loadu_si256((const __m256i *)&new[i + j]);
+            b = _mm256_loadu_si256((const __m256i *)&old[i + j]);
+            bits |= (uint64_t)(~_mm256_movemask_ps(
+                        _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))) & 0xff)
+                << j;
+        }
+        diff[i / 64] = bits;
+    }
+}
+
+static void diff_cpuid(unsigned int leaf, unsigned int subleaf,
+                       unsigned int *regs)
+{
+#ifdef __i386__
+    /* Use the stack to avoid reg constraint failures with some gcc flags */
+    asm (
+        "push %%ebx; push %%edx\n\t"
+        "cpuid\n\t"
+        "mov %%ebx,4(%4)\n\t"
+        "mov %%edx,12(%4)\n\t"
+        "pop %%edx; pop %%ebx\n\t"
+        : "=a" (regs[0]), "=c" (regs[2])
+        : "0" (leaf), "1" (subleaf), "S" (regs)
+        : "memory" );
+#else
+    asm (
+        "cpuid"
+        : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
+        : "0" (leaf), "2" (subleaf) );
+#endif
+}
+#endif /* HAVE_SIMD_DIFF */
+
+static void select_diff_engine(comp_ctx *ctx)
+{
+#ifdef HAVE_SIMD_DIFF
+    unsigned int regs[4], max_leaf, ecx1, edx1, xcr0_lo, xcr0_hi;
+
+    diff_cpuid(0, 0, regs);
+    max_leaf = regs[0];
+    diff_cpuid(1, 0, regs);
+    ecx1 = regs[2];
+    edx1 = regs[3];
+
+    /* AVX2 needs OSXSAVE, and the OS to have enabled XMM and YMM state. */
+    if ( max_leaf >= 7 && (ecx1 & (1u << 27)) )
+    {
+        asm volatile ( "xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0) );
+        diff_cpuid(7, 0, regs);
+        if ( ((xcr0_lo & 6) == 6) && (regs[1] & (1u << 5)) )
+        {
+            ctx->diff_name = "avx2";
+            ctx->diff_page = diff_page_avx2;
+            return;
+        }
+    }
+
+    if ( edx1 & (1u << 26) )
+    {
+        ctx->diff_name = "sse2";
+        ctx->diff_page = diff_page_sse2;
+        return;
+    }
+#endif
+
+    ctx->diff_name = "scalar";
+    ctx->diff_page = diff_page_scalar;
+}
+
+/*
+ * Return the index of the first word at or after off whose diff bit is
+ * not copying, or MAX_DELTAS if there is none.
+ */
+static unsigned int next_run_end(const uint64_t *diff, unsigned int off,
+                                 int copying)
+{
+    unsigned int w = off / 64;
+    uint64_t bits = (copying ? ~diff[w] : diff[w]) & (~0ULL << (off % 64));
+
+    while (!bits)
+    {
+        if (++w == DIFF_LONGS)
+            return MAX_DELTAS;
+        bits = copying ? ~diff[w] : diff[w];
+    }
+
+    return w * 64 + __builtin_ctzll(bits);
+}
 
 /*
  * Add a pagetable page or a new page (uncached)
@@ -135,14 +319,12 @@ static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
 static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
 {
     char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
+    uint64_t diff[DIFF_LONGS];
 
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
+    unsigned int off, end, runlen;
+    int copying, bytes_skipped = 0;
     int complen = 0, pageoff = 0, runbytes = 0;
 
-    char runlen = 0;
-
     if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
         return -1;
 
@@ -151,45 +333,38 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
      * domU's page passed from xc_domain_save and cache_page is
      * a ptr to cache page (cache is page aligned).
      */
-    new = (uint32_t*)srcpage;
-    old = (uint32_t*)cache_page;
+    ctx->diff_page((uint32_t *)srcpage, (uint32_t *)cache_page, diff);
 
-    for (off = 0; off <= MAX_DELTAS; off++)
+    /*
+     * Walk the page as alternating runs of changed (copied) and
+     * unchanged (skipped) words, emitting each in pieces of at most
+     * LENMASK words.
+     */
+    for (off = 0; off < MAX_DELTAS; off = end)
     {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
+        copying = (diff[off / 64] >> (off % 64)) & 1;
+        end = next_run_end(diff, off, copying);
 
-        if (runlen)
+        for (; off < end; off += runlen)
         {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
-
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
+            runlen = end - off;
+            if (runlen > LENMASK)
+                runlen = LENMASK;
+            runbytes = runlen * sizeof(uint32_t);
+            dest[complen++] = runlen | (copying ? RUNFLAG : SKIPFLAG);
 
-                runlen = 0;
-                runptr = off;
+            if (copying) /* RUNFLAG */
+            {
+                pageoff = off * sizeof(uint32_t);
+                memcpy(dest + complen, srcpage + pageoff, runbytes);
+                memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+                complen += runbytes;
+            }
+            else /* SKIPFLAG */
+            {
+                bytes_skipped += runbytes;
             }
         }
-        runlen++;
-        wascopying = copying;
     }
 
     /*
@@ -205,83 +380,145 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
     return complen;
 }
 
-static
-char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
-                     int *israw)
+static void cache_list_del(struct cache_page *item)
+{
+    struct cache_list *list = item->list;
+
+    if (item->prev)
+        item->prev->next = item->next;
+    else
+        list->head = item->next;
+    if (item->next)
+        item->next->prev = item->prev;
+    else
+        list->tail = item->prev;
+
+    item->list = NULL;
+    list->count--;
+}
+
+static void cache_list_add(struct cache_list *list, struct cache_page *item)
 {
-    struct cache_page *item = NULL;
+    item->list = list;
+    item->prev = NULL;
+    item->next = list->head;
+    if (list->head)
+        list->head->prev = item;
+    else
+        list->tail = item;
+    list->head = item;
+    list->count++;
+}
 
-    item = ctx->pfn2cache[pfn];
+/* Remember the pfn of a page evicted from A1in on A1out. */
+static void cache_add_ghost(comp_ctx *ctx, xen_pfn_t pfn)
+{
+    struct cache_page *ghost;
 
-    if (!item)
+    if (ctx->free_ghosts.head)
+        ghost = ctx->free_ghosts.head;
+    else if (ctx->a1out.tail)
     {
-        *israw = 1;
+        ghost = ctx->a1out.tail;
+        ctx->pfn2cache[ghost->pfn] = NULL;
+    }
+    else
+        return;
 
-        /* If the list is full, evict a page from the tail end. */
-        item = ctx->page_list_tail;
-        if (item->pfn != INVALID_P2M_ENTRY)
-            ctx->pfn2cache[item->pfn] = NULL;
+    cache_list_del(ghost);
+    ghost->pfn = pfn;
+    ctx->pfn2cache[pfn] = ghost;
+    cache_list_add(&ctx->a1out, ghost);
+}
 
-        item->pfn = pfn;
-        ctx->pfn2cache[pfn] = item;
-    }
-        
-    /* 	if requested item is in cache move to head of list */
-    if (item != ctx->page_list_head)
+/* Find a data slot for a new page, evicting one if need be. */
+static struct cache_page *cache_get_slot(comp_ctx *ctx)
+{
+    struct cache_page *item;
+
+    if (ctx->free_pages.head)
     {
-        if (item == ctx->page_list_tail)
-        {
-            /* item at tail of list. */
-            ctx->page_list_tail = item->prev;
-            (ctx->page_list_tail)->next = NULL;
-        }
-        else
-        {
-            /* item in middle of list */
-            item->prev->next = item->next;
-            item->next->prev = item->prev;
-        }
+        item = ctx->free_pages.head;
+        cache_list_del(item);
+        return item;
+    }
 
-        item->prev = NULL;
-        item->next = ctx->page_list_head;
-        (ctx->page_list_head)->prev = item;
-        ctx->page_list_head = item;
+    ctx->stats.cache_evictions++;
+
+    if (ctx->a1in.count > ctx->a1in_max || !ctx->am.count)
+    {
+        item = ctx->a1in.tail;
+        cache_list_del(item);
+        ctx->pfn2cache[item->pfn] = NULL;
+        cache_add_ghost(ctx, item->pfn);
+    }
+    else
+    {
+        item = ctx->am.tail;
+        cache_list_del(item);
+        ctx->pfn2cache[item->pfn] = NULL;
     }
 
-    return (ctx->page_list_head)->page;
+    return item;
 }
 
-/* Remove pagetable pages from cache and move to tail, as free pages */
 static
-void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
+char *get_cache_page(comp_ctx *ctx, xen_pfn_t pfn,
+                     int *israw)
 {
-    struct cache_page *item = NULL;
+    struct cache_page *item = ctx->pfn2cache[pfn];
+    struct cache_list *list = &ctx->a1in;
 
-    item = ctx->pfn2cache[pfn];
-    if (item)
+    if (item && item->page)
     {
-        if (item != ctx->page_list_tail)
-        {
-            /* item at head of list */
-            if (item == ctx->page_list_head)
-            {
-                ctx->page_list_head = (ctx->page_list_head)->next;
-                (ctx->page_list_head)->prev = NULL;
-            }
-            else /* item in middle of list */
-            {            
-                item->prev->next = item->next;
-                item->next->prev = item->prev;
-            }
+        ctx->stats.cache_hits++;
 
-            item->next = NULL;
-            item->prev = ctx->page_list_tail;
-            (ctx->page_list_tail)->next = item;
-            ctx->page_list_tail = item;
+        /*
+         * Hot pages are kept in LRU order.  A page still on A1in stays
+         * where it is: being dirtied in a few successive checkpoints
+         * does not yet make it hot.
+         */
+        if (item->list == &ctx->am)
+        {
+            cache_list_del(item);
+            cache_list_add(&ctx->am, item);
         }
+        return item->page;
+    }
+
+    *israw = 1;
+    ctx->stats.cache_misses++;
+
+    if (item)
+    {
+        /* Recently evicted from A1in: it is hot after all. */
+        ctx->stats.cache_ghost_hits++;
+        cache_list_del(item);
+        cache_list_add(&ctx->free_ghosts, item);
         ctx->pfn2cache[pfn] = NULL;
-        (ctx->page_list_tail)->pfn = INVALID_P2M_ENTRY;
+        list = &ctx->am;
     }
+
+    item = cache_get_slot(ctx);
+    item->pfn = pfn;
+    ctx->pfn2cache[pfn] = item;
+    cache_list_add(list, item);
+
+    return item->page;
+}
+
+/* Remove pagetable pages from cache, freeing their slots */
+static
+void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
+{
+    struct cache_page *item = ctx->pfn2cache[pfn];
+
+    if (!item)
+        return;
+
+    cache_list_del(item);
+    cache_list_add(item->page ? &ctx->free_pages : &ctx->free_ghosts, item);
+    ctx->pfn2cache[pfn] = NULL;
 }
 
 int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
@@ -315,8 +552,27 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
 {
     char *cache_copy = NULL, *current_page = NULL;
     int israw, rc = 1;
+    unsigned int first = ctx->pfns_index;
+    struct timespec t0, t1;
 
     if (!ctx->pfns_len || (ctx->pfns_index == ctx->pfns_len)) {
+        uint64_t pages = ctx->stats.pages - ctx->reported.pages;
+        uint64_t bytes_out = ctx->stats.bytes_out - ctx->reported.bytes_out;
+        uint64_t hits = ctx->stats.cache_hits - ctx->reported.cache_hits;
+        uint64_t lookups = hits + ctx->stats.cache_misses -
+                           ctx->reported.cache_misses;
+
+        if (pages)
+        {
+            DPRINTF("Compressed %" PRIu64 " pages (%s): %" PRIu64 " -> %"
+                    PRIu64 " bytes (%" PRIu64 "%%), %" PRIu64 " ns/page, "
+                    "cache hit rate %" PRIu64 "%%\n", pages, ctx->diff_name,
+                    pages * XC_PAGE_SIZE, bytes_out,
+                    bytes_out * 100 / (pages * XC_PAGE_SIZE),
+                    (ctx->stats.ns - ctx->reported.ns) / pages,
+                    lookups ? hits * 100 / lookups : 0);
+            ctx->reported = ctx->stats;
+        }
         ctx->pfns_len = ctx->pfns_index = 0;
         return 0;
     }
@@ -325,6 +581,8 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
     ctx->compbuf = compbuf;
     ctx->compbuf_size = compbuf_size;
 
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
     for (; ctx->pfns_index < ctx->pfns_len; ctx->pfns_index++)
     {
         israw = 0;
@@ -353,6 +611,12 @@ int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
     if (compbuf_len)
         *compbuf_len = ctx->compbuf_pos;
 
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ctx->stats.pages += ctx->pfns_index - first;
+    ctx->stats.bytes_out += ctx->compbuf_pos;
+    ctx->stats.ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                     t1.tv_nsec - t0.tv_nsec;
+
     return rc;
 }
 
@@ -453,6 +717,12 @@ int xc_compression_uncompress_page(xc_interface *xch, char *compbuf,
     return 0;
 }
 
+void xc_compression_get_stats(xc_interface *xch, comp_ctx *ctx,
+                              xc_compression_stats_t *stats)
+{
+    *stats = ctx->stats;
+}
+
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
 {
     if (!ctx) return;
@@ -462,15 +732,23 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx)
     free(ctx->cache_base);
     free(ctx->pfn2cache);
     free(ctx->cache);
+    free(ctx->ghosts);
     free(ctx);
 }
 
 comp_ctx *xc_compression_create_context(xc_interface *xch,
-                                        unsigned long p2m_size)
+                                        unsigned long p2m_size,
+                                        unsigned long cache_size)
 {
     unsigned long i;
     comp_ctx *ctx = NULL;
-    unsigned long num_cache_pages = DELTA_CACHE_SIZE/XC_PAGE_SIZE;
+    unsigned long num_cache_pages;
+
+    if (!cache_size)
+        cache_size = DELTA_CACHE_SIZE;
+    num_cache_pages = cache_size / XC_PAGE_SIZE;
+    if (num_cache_pages < MIN_CACHE_PAGES)
+        num_cache_pages = MIN_CACHE_PAGES;
 
     ctx = (comp_ctx *)malloc(sizeof(comp_ctx));
     if (!ctx)
@@ -487,7 +765,8 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE, DELTA_CACHE_SIZE);
+    ctx->cache_base = xc_memalign(xch, XC_PAGE_SIZE,
+                                  num_cache_pages * XC_PAGE_SIZE);
     if (!ctx->cache_base)
     {
         ERROR("Failed to allocate delta cache\n");
@@ -511,25 +790,40 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
         goto error;
     }
 
-    ctx->cache = malloc(num_cache_pages * sizeof(struct cache_page));
+    ctx->cache = calloc(num_cache_pages, sizeof(struct cache_page));
     if (!ctx->cache)
     {
         ERROR("Could not alloc compression cache\n");
         goto error;
     }
 
+    /* The usual 2Q tuning: A1in gets a quarter of the cache, and A1out
+     * remembers as many pages as half the cache holds. */
+    ctx->ghosts = calloc(num_cache_pages / 2, sizeof(struct cache_page));
+    if (!ctx->ghosts)
+    {
+        ERROR("Could not alloc compression cache ghosts\n");
+        goto error;
+    }
+
     for (i = 0; i < num_cache_pages; i++)
     {
         ctx->cache[i].pfn = INVALID_P2M_ENTRY;
         ctx->cache[i].page = ctx->cache_base + i * XC_PAGE_SIZE;
-        ctx->cache[i].prev = (i == 0) ? NULL : &(ctx->cache[i - 1]);
-        ctx->cache[i].next = ((i+1) == num_cache_pages)? NULL :
-            &(ctx->cache[i + 1]);
+        cache_list_add(&ctx->free_pages, &ctx->cache[i]);
+    }
+    for (i = 0; i < num_cache_pages / 2; i++)
+    {
+        ctx->ghosts[i].pfn = INVALID_P2M_ENTRY;
+        cache_list_add(&ctx->free_ghosts, &ctx->ghosts[i]);
     }
-    ctx->page_list_head = &(ctx->cache[0]);
-    ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
+    ctx->a1in_max = num_cache_pages / 4;
     ctx->dom_pfnlist_size = p2m_size;
 
+    select_diff_engine(ctx);
+    DPRINTF("Checkpoint compression using %s delta engine, "
+            "%lu page cache\n", ctx->diff_name, num_cache_pages);
+
     return ctx;
 error:
     xc_compression_free_context(xch, ctx);
@@ -38,6 +38,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -1086,10 +1087,286 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+** Parallel page copy-in (nr_copy_workers != 0).
+**
+** apply_batch() still does everything that touches the p2m, the mmu
+** update queue or the hypervisor on the calling thread: allocating and
+** mapping the batch, handling broken pages, and copying in and
+** uncanonicalising pagetables.  Only the copy of normal data pages from
+** the page buffer into the foreign mapping is handed to a pool of copy
+** workers, as a list of contiguous runs.  The caller is then free to read
+** the next batch from the stream while earlier batches are being copied
+** in.  Each queued batch owns its mapping and a reference to the page
+** buffer it copies from, and releases both when done.
+**
+** Within one pass of the sender, pfns arrive in increasing order, so a
+** batch whose pfns do not all lie above those already queued may rewrite
+** a page that is still being copied (a resend from a later iteration, or
+** the start of the next checkpoint).  Such a batch waits for the pipeline
+** to drain first.
+*/
+#define RESTORE_MAX_COPY_WORKERS 16
+
+struct restore_pages {
+    void *buf;
+    unsigned int refs;
+};
+
+struct restore_copy {
+    char *dst;
+    const char *src;
+    unsigned int nr_pages;
+};
+
+struct restore_job {
+    struct restore_job *next;
+    char *region_base;
+    unsigned int nr_mapped;
+    struct restore_pages *pages;
+    unsigned int nr_copies;
+    struct restore_copy copies[0];
+};
+
+struct restore_pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; /* job queued, or shutdown */
+    pthread_cond_t idle_cond; /* job retired */
+    struct restore_job *head, *tail;
+    unsigned int in_flight, max_in_flight;
+    int shutdown;
+
+    /* Highest pfn queued since the pipeline was last drained, plus one. */
+    unsigned long pfn_limit;
+
+    unsigned int nr_workers;
+    pthread_t workers[RESTORE_MAX_COPY_WORKERS];
+};
+
+/* Called with pl->lock held. */
+static void restore_pages_put(struct restore_pages *pages)
+{
+    if ( pages && --pages->refs == 0 )
+    {
+        free(pages->buf);
+        free(pages);
+    }
+}
+
+static void *restore_copy_worker(void *arg)
+{
+    struct restore_pipeline *pl = arg;
+    struct restore_job *job;
+    unsigned int i;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        job = pl->head;
+        if ( !job )
+        {
+            if ( pl->shutdown )
+                break;
+            pthread_cond_wait(&pl->work_cond, &pl->lock);
+            continue;
+        }
+
+        pl->head = job->next;
+        if ( !pl->head )
+            pl->tail = NULL;
+        pthread_mutex_unlock(&pl->lock);
+
+        for ( i = 0; i < job->nr_copies; i++ )
+            memcpy(job->copies[i].dst, job->copies[i].src,
+                   job->copies[i].nr_pages * PAGE_SIZE);
+        munmap(job->region_base, job->nr_mapped * PAGE_SIZE);
+
+        pthread_mutex_lock(&pl->lock);
+        restore_pages_put(job->pages);
+        free(job);
+        pl->in_flight--;
+        pthread_cond_broadcast(&pl->idle_cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+static void restore_pipeline_drain(struct restore_pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    while ( pl->in_flight )
+        pthread_cond_wait(&pl->idle_cond, &pl->lock);
+    pl->pfn_limit = 0;
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/*
+ * Make sure nothing still in flight can touch the pfns in [lo, hi], and
+ * note that they are about to be queued.
+ */
+static void restore_pipeline_order(struct restore_pipeline *pl,
+                                   unsigned long lo, unsigned long hi)
+{
+    if ( lo < pl->pfn_limit )
+        restore_pipeline_drain(pl);
+    if ( hi + 1 > pl->pfn_limit )
+        pl->pfn_limit = hi + 1;
+}
+
+/* Take a reference on the page buffer and queue job, blocking while full. */
+static void restore_pipeline_submit(struct restore_pipeline *pl,
+                                    struct restore_job *job)
+{
+    pthread_mutex_lock(&pl->lock);
+
+    while ( pl->in_flight >= pl->max_in_flight )
+        pthread_cond_wait(&pl->idle_cond, &pl->lock);
+
+    if ( job->pages )
+        job->pages->refs++;
+    job->next = NULL;
+    if ( pl->tail )
+        pl->tail->next = job;
+    else
+        pl->head = job;
+    pl->tail = job;
+    pl->in_flight++;
+    pthread_cond_signal(&pl->work_cond);
+
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/*
+ * Hand ownership of a page buffer to the pipeline.  The caller's reference
+ * is dropped by restore_pipeline_release() once it has queued every batch
+ * that copies from it.
+ */
+static struct restore_pages *restore_pipeline_adopt(xc_interface *xch,
+                                                    void *buf)
+{
+    struct restore_pages *pages = malloc(sizeof(*pages));
+
+    if ( !pages )
+    {
+        ERROR("Unable to allocate page buffer reference");
+        return NULL;
+    }
+
+    pages->buf = buf;
+    pages->refs = 1;
+
+    return pages;
+}
+
+static void restore_pipeline_release(struct restore_pipeline *pl,
+                                     struct restore_pages *pages)
+{
+    pthread_mutex_lock(&pl->lock);
+    restore_pages_put(pages);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void restore_pipeline_destroy(struct restore_pipeline *pl)
+{
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    restore_pipeline_drain(pl);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->shutdown = 1;
+    pthread_cond_broadcast(&pl->work_cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_workers; i++ )
+        pthread_join(pl->workers[i], NULL);
+
+    pthread_cond_destroy(&pl->idle_cond);
+    pthread_cond_destroy(&pl->work_cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+}
+
+static struct restore_pipeline *restore_pipeline_create(xc_interface *xch,
+                                                        unsigned int nr)
+{
+    struct restore_pipeline *pl;
+    int rc;
+
+    if ( nr > RESTORE_MAX_COPY_WORKERS )
+        nr = RESTORE_MAX_COPY_WORKERS;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate restore pipeline");
+        return NULL;
+    }
+
+    pl->max_in_flight = 2 * nr;
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_cond_init(&pl->idle_cond, NULL);
+
+    while ( pl->nr_workers < nr )
+    {
+        rc = pthread_create(&pl->workers[pl->nr_workers], NULL,
+                            restore_copy_worker, pl);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create restore copy worker");
+            break;
+        }
+        pl->nr_workers++;
+    }
+
+    if ( !pl->nr_workers )
+    {
+        restore_pipeline_destroy(pl);
+        return NULL;
+    }
+
+    DPRINTF("Restoring pages with %u copy workers\n", pl->nr_workers);
+
+    return pl;
+}
+
+static void restore_job_add_copy(struct restore_job *job,
+                                 char *dst, const char *src)
+{
+    struct restore_copy *c;
+
+    if ( job->nr_copies )
+    {
+        c = &job->copies[job->nr_copies - 1];
+        if ( (c->dst + c->nr_pages * PAGE_SIZE == dst) &&
+             (c->src + c->nr_pages * PAGE_SIZE == src) )
+        {
+            c->nr_pages++;
+            return;
+        }
+    }
+
+    c = &job->copies[job->nr_copies++];
+    c->dst = dst;
+    c->src = src;
+    c->nr_pages = 1;
+}
+
+/*
+ * If pl is non-NULL, the copy of normal pages is queued on it rather than
+ * done here; pages is the (adopted) buffer pagebuf->pages used to point to.
+ */
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
-                       pagebuf_t* pagebuf, int curbatch)
+                       pagebuf_t* pagebuf, int curbatch,
+                       struct restore_pipeline *pl, struct restore_pages *pages)
 {
     int i, j, curpage, nr_mfns;
     int k, scount;
@@ -1104,6 +1381,8 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     struct domain_info_context *dinfo = &ctx->dinfo;
     int* pfn_err = NULL;
     int rc = -1;
+    struct restore_job *job = NULL;
+    void *pages_base = pages ? pages->buf : pagebuf->pages;
 
     unsigned long mfn, pfn, pagetype;
 
@@ -1111,6 +1390,27 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     if (j > MAX_BATCH_SIZE)
         j = MAX_BATCH_SIZE;
 
+    if ( pl )
+    {
+        unsigned long lo = ~0UL, hi = 0;
+
+        for ( i = 0; i < j; i++ )
+        {
+            pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+            pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+            if ( pagetype == XEN_DOMCTL_PFINFO_XTAB )
+                continue;
+            if ( pfn < lo )
+                lo = pfn;
+            if ( pfn > hi )
+                hi = pfn;
+        }
+
+        if ( lo <= hi )
+            restore_pipeline_order(pl, lo, hi);
+    }
+
     /* First pass for this batch: work out how much memory to alloc, and detect superpages */
     nr_mfns = scount = 0;
     for ( i = 0; i < j; i++ )
@@ -1271,6 +1571,17 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         return -1;
     }
 
+    if ( pl )
+    {
+        job = malloc(sizeof(*job) + j * sizeof(job->copies[0]));
+        if ( job == NULL )
+        {
+            ERROR("Unable to allocate restore job");
+            goto err_mapped;
+        }
+        job->nr_copies = 0;
+    }
+
     for ( i = 0, curpage = -1; i < j; i++ )
     {
         pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
@@ -1326,8 +1637,13 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                 goto err_mapped;
             }
         }
+        else if ( job && ((pagetype & XEN_DOMCTL_PFINFO_LTABTYPE_MASK) ==
+                          XEN_DOMCTL_PFINFO_NOTAB) )
+            /* A normal page: leave the copy to the workers */
+            restore_job_add_copy(job, (char *)page,
+                                 pages_base + (curpage + curbatch) * PAGE_SIZE);
         else
-            memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE,
+            memcpy(page, pages_base + (curpage + curbatch) * PAGE_SIZE,
                    PAGE_SIZE);
 
         pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
@@ -1402,7 +1718,19 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
 
     rc = nraces;
 
+    if ( job && job->nr_copies )
+    {
+        /* The workers unmap the batch once it has been copied in. */
+        job->region_base = region_base;
+        job->nr_mapped = j;
+        job->pages = pages;
+        restore_pipeline_submit(pl, job);
+        free(pfn_err);
+        return rc;
+    }
+
   err_mapped:
+    free(job);
     munmap(region_base, j*PAGE_SIZE);
     free(pfn_err);
 
@@ -1415,6 +1743,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, domid_t console_domid,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid, int checkpointed_stream,
+                      unsigned int nr_copy_workers,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks)
 {
@@ -1456,6 +1785,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     struct xc_mmu *mmu = NULL;
 
+    /* Page copy-in workers, and the page buffer they are copying from */
+    struct restore_pipeline *pipeline = NULL;
+    struct restore_pages *pages = NULL;
+
     struct mmuext_op pin[MAX_PIN_BATCH];
     unsigned int nr_pins;
 
@@ -1595,6 +1928,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    if ( nr_copy_workers &&
+         !(pipeline = restore_pipeline_create(xch, nr_copy_workers)) )
+        DPRINTF("Falling back to serial page copy-in\n");
+
     xc_report_progress_start(xch, "Reloading memory pages", dinfo->p2m_size);
 
     /*
@@ -1623,6 +1960,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         DBGPRINTF("batch %d\n",j);
 
         if ( j == 0 ) {
+            /* All pages must be in place before we poke at any of them. */
+            if ( pipeline )
+                restore_pipeline_drain(pipeline);
+
             /* catch vcpu updates */
             if (pagebuf.new_ctxt_format) {
                 max_vcpu_id = pagebuf.max_vcpu_id;
@@ -1683,13 +2024,27 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             break;  /* our work here is done */
         }
 
+        /*
+         * Hand the page buffer over to the copy workers, so the next read
+         * gets a fresh one.  Verify mode and compressed checkpoints need
+         * the serial path.
+         */
+        if ( pipeline && pagebuf.pages &&
+             !pagebuf.verify && !pagebuf.compressing )
+        {
+            if ( !(pages = restore_pipeline_adopt(xch, pagebuf.pages)) )
+                goto out;
+            pagebuf.pages = NULL;
+        }
+
         /* break pagebuf into batches */
         curbatch = 0;
         while ( curbatch < j ) {
             int brc;
 
             brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
-                              pae_extended_cr3, mmu, &pagebuf, curbatch);
+                              pae_extended_cr3, mmu, &pagebuf, curbatch,
+                              pages ? pipeline : NULL, pages);
             if ( brc < 0 )
                 goto out;
 
@@ -1698,6 +2053,12 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             curbatch += MAX_BATCH_SIZE;
         }
 
+        if ( pages )
+        {
+            restore_pipeline_release(pipeline, pages);
+            pages = NULL;
+        }
+
         pagebuf.nr_physpages = pagebuf.nr_pages = 0;
         pagebuf.compbuf_pos = pagebuf.compbuf_size = 0;
 
@@ -2338,6 +2699,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     rc = 0;
 
  out:
+    if ( pages )
+        restore_pipeline_release(pipeline, pages);
+    restore_pipeline_destroy(pipeline);
+
     if ( (rc != 0) && (dom != 0) )
         xc_domain_destroy(xch, dom);
     xc_hypercall_buffer_free(xch, ctxt);
@@ -21,10 +21,12 @@
  */
 
 #include <inttypes.h>
+#include <limits.h>
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -522,6 +524,515 @@ static int canonicalize_pagetable(struct save_ctx *ctx,
     return race;
 }
 
+/*
+** Pipelined page saving (XCFLAGS_PIPELINE).
+**
+** The main loop selects, maps and types each batch of pages as before,
+** but then hands the batch to a small pipeline instead of writing it out
+** itself.  Worker threads canonicalise the pagetable pages of queued
+** batches in parallel, and a single writer thread emits completed batches
+** (or feeds them to the checkpoint compressor) strictly in the order they
+** were queued, so the stream is identical to the one the serial path
+** produces.  The number of batches in flight is bounded, which bounds the
+** foreign mappings and pagetable copies held at any one time.
+**
+** Without XCFLAGS_PIPELINE the same batch code is simply run inline.
+*/
+#define SAVE_PIPELINE_MAX_WORKERS 4
+
+#define SAVE_BATCH_QUEUED 0 /* waiting for a worker */
+#define SAVE_BATCH_BUSY   1 /* being canonicalised */
+#define SAVE_BATCH_READY  2 /* waiting for the writer */
+
+struct save_batch {
+    struct save_batch *next;
+    int state;
+    int dobuf;               /* last_iter when the batch was selected */
+    int compressing;
+    unsigned int batch;
+    unsigned char *region_base;
+    char *pt_pages;          /* canonicalised pagetables, in batch order */
+    unsigned long pfn_type[0]; /* pfn | type, as sent in the stream */
+};
+
+struct save_pipeline {
+    xc_interface *xch;
+    struct save_ctx *ctx;
+    struct outbuf *ob;
+    comp_ctx *compress_ctx;
+    int io_fd, live;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;  /* batch queued, or shutdown */
+    pthread_cond_t ready_cond; /* batch canonicalised, or shutdown */
+    pthread_cond_t idle_cond;  /* batch retired */
+    struct save_batch *head, *tail;
+    unsigned int in_flight, max_in_flight;
+    int error, shutdown;
+
+    unsigned int nr_workers;
+    int have_writer;
+    pthread_t writer;
+    pthread_t workers[SAVE_PIPELINE_MAX_WORKERS];
+};
+
+static int is_pagetable_type(unsigned long pagetype)
+{
+    if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+         || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+         || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+        return 0;
+
+    pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+    return (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+           (pagetype <= XEN_DOMCTL_PFINFO_L4TAB);
+}
+
+/* Takes ownership of region_base, which is unmapped by save_batch_free(). */
+static struct save_batch *save_batch_alloc(xc_interface *xch,
+                                           unsigned char *region_base,
+                                           const xen_pfn_t *pfn_type,
+                                           unsigned int batch,
+                                           int dobuf, int compressing)
+{
+    struct save_batch *sb;
+    unsigned int j, nr_pt = 0;
+
+    sb = malloc(sizeof(*sb) + batch * sizeof(unsigned long));
+    if ( !sb )
+    {
+        ERROR("Unable to allocate save batch");
+        return NULL;
+    }
+
+    memset(sb, 0, sizeof(*sb));
+    sb->state = SAVE_BATCH_QUEUED;
+    sb->dobuf = dobuf;
+    sb->compressing = compressing;
+    sb->batch = batch;
+    sb->region_base = region_base;
+
+    for ( j = 0; j < batch; j++ )
+    {
+        sb->pfn_type[j] = pfn_type[j];
+        if ( is_pagetable_type(pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) )
+            nr_pt++;
+    }
+
+    if ( nr_pt && !(sb->pt_pages = malloc(nr_pt * PAGE_SIZE)) )
+    {
+        ERROR("Unable to allocate %u pagetable pages", nr_pt);
+        free(sb);
+        return NULL;
+    }
+
+    return sb;
+}
+
+static void save_batch_free(struct save_batch *sb)
+{
+    munmap(sb->region_base, sb->batch * PAGE_SIZE);
+    free(sb->pt_pages);
+    free(sb);
+}
+
+static int save_batch_canonicalise(xc_interface *xch, struct save_ctx *ctx,
+                                   struct save_batch *sb, int live)
+{
+    unsigned long pfn, pagetype;
+    char *dpage = sb->pt_pages;
+    unsigned int j;
+
+    for ( j = 0; j < sb->batch; j++ )
+    {
+        pfn      = sb->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = sb->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( !is_pagetable_type(pagetype) )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( canonicalize_pagetable(ctx, pagetype, pfn,
+                                    sb->region_base + (PAGE_SIZE*j),
+                                    dpage) && !live )
+        {
+            ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn, pagetype);
+            return -1;
+        }
+
+        dpage += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static int save_batch_add_compressed(xc_interface *xch,
+                                     comp_ctx *compress_ctx,
+                                     struct save_batch *sb, struct outbuf *ob,
+                                     int io_fd, char *page, unsigned long pfn,
+                                     int israw)
+{
+    int c_err;
+
+    c_err = xc_compression_add_page(xch, compress_ctx, page, pfn, israw);
+    if ( c_err == -2 ) /* OOB PFN */
+    {
+        ERROR("Could not add %spage (pfn:%" PRIpfn ") to page buffer",
+              israw ? "pagetable " : "", pfn);
+        return -1;
+    }
+
+    if ( c_err == -1 )
+    {
+        /*
+         * We are out of buffer space to hold dirty pages. Compress and
+         * flush the current buffer to make space. This is a corner case,
+         * that slows down checkpointing as the compression happens while
+         * domain is suspended. Happens seldom and if you find this
+         * occuring frequently, increase the PAGE_BUFFER_SIZE in
+         * xc_compression.c.
+         */
+        if ( write_compressed(xch, compress_ctx, sb->dobuf, ob, io_fd) < 0 )
+        {
+            ERROR("Error when writing compressed data (%s)",
+                  israw ? "4b" : "4c");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int save_batch_write(xc_interface *xch, struct save_batch *sb,
+                            struct outbuf *ob, comp_ctx *compress_ctx,
+                            int io_fd)
+{
+    char *region_base = (char *)sb->region_base;
+    char *ptpage = sb->pt_pages;
+    unsigned int j, run = 0;
+
+    if ( write_buffer(xch, sb->dobuf, ob, io_fd,
+                      &sb->batch, sizeof(unsigned int)) )
+    {
+        PERROR("Error when writing to state file (2)");
+        return -1;
+    }
+
+    if ( write_buffer(xch, sb->dobuf, ob, io_fd,
+                      sb->pfn_type, sizeof(unsigned long) * sb->batch) )
+    {
+        PERROR("Error when writing to state file (3)");
+        return -1;
+    }
+
+    for ( j = 0; j < sb->batch; j++ )
+    {
+        unsigned long pfn, pagetype;
+
+        pfn      = sb->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = sb->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        /* If the page is not a normal data page, write out any run of
+           pages we may have previously acumulated */
+        if ( pagetype != 0 && run )
+        {
+            if ( write_uncached(xch, sb->dobuf, ob, io_fd,
+                                region_base + (PAGE_SIZE*(j-run)),
+                                PAGE_SIZE*run) != PAGE_SIZE*run )
+            {
+                PERROR("Error when writing to state file (4a)"
+                       " (errno %d)", errno);
+                return -1;
+            }
+            run = 0;
+        }
+
+        /*
+         * skip pages that aren't present,
+         * or are broken, or are alloc-only
+         */
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+             || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+             || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        if ( is_pagetable_type(pagetype) )
+        {
+            /* Already canonicalised into pt_pages. */
+            if ( sb->compressing )
+            {
+                /* Mark pagetable page to be sent uncompressed */
+                if ( save_batch_add_compressed(xch, compress_ctx, sb, ob,
+                                               io_fd, ptpage, pfn, 1) )
+                    return -1;
+            }
+            else if ( write_uncached(xch, sb->dobuf, ob, io_fd, ptpage,
+                                     PAGE_SIZE) != PAGE_SIZE )
+            {
+                PERROR("Error when writing to state file (4b)"
+                       " (errno %d)", errno);
+                return -1;
+            }
+            ptpage += PAGE_SIZE;
+        }
+        else
+        {
+            /* We have a normal page: accumulate it for writing. */
+            if ( sb->compressing )
+            {
+                if ( save_batch_add_compressed(xch, compress_ctx, sb, ob,
+                                               io_fd,
+                                               region_base + (PAGE_SIZE*j),
+                                               pfn, 0) )
+                    return -1;
+            }
+            else
+                run++;
+        }
+    }
+
+    if ( run )
+    {
+        /* write out the last accumulated run of pages */
+        if ( write_uncached(xch, sb->dobuf, ob, io_fd,
+                            region_base + (PAGE_SIZE*(j-run)),
+                            PAGE_SIZE*run) != PAGE_SIZE*run )
+        {
+            PERROR("Error when writing to state file (4c)"
+                   " (errno %d)", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *save_pipeline_worker(void *arg)
+{
+    struct save_pipeline *pl = arg;
+    struct save_batch *sb;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        for ( sb = pl->head; sb; sb = sb->next )
+            if ( sb->state == SAVE_BATCH_QUEUED )
+                break;
+
+        if ( !sb )
+        {
+            if ( pl->shutdown )
+                break;
+            pthread_cond_wait(&pl->work_cond, &pl->lock);
+            continue;
+        }
+
+        sb->state = SAVE_BATCH_BUSY;
+        rc = pl->error;
+        pthread_mutex_unlock(&pl->lock);
+
+        /* Once something has failed, just retire what is left. */
+        if ( !rc )
+            rc = save_batch_canonicalise(pl->xch, pl->ctx, sb, pl->live);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pl->error = 1;
+        sb->state = SAVE_BATCH_READY;
+        pthread_cond_broadcast(&pl->ready_cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+static void *save_pipeline_writer(void *arg)
+{
+    struct save_pipeline *pl = arg;
+    struct save_batch *sb;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        sb = pl->head;
+        if ( !sb || sb->state != SAVE_BATCH_READY )
+        {
+            if ( !sb && pl->shutdown )
+                break;
+            pthread_cond_wait(&pl->ready_cond, &pl->lock);
+            continue;
+        }
+
+        pl->head = sb->next;
+        if ( !pl->head )
+            pl->tail = NULL;
+        rc = pl->error;
+        pthread_mutex_unlock(&pl->lock);
+
+        if ( !rc )
+            rc = save_batch_write(pl->xch, sb, pl->ob, pl->compress_ctx,
+                                  pl->io_fd);
+        save_batch_free(sb);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pl->error = 1;
+        pl->in_flight--;
+        pthread_cond_broadcast(&pl->idle_cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/* Queue a batch, blocking while the pipeline is full.  Consumes sb. */
+static int save_pipeline_submit(struct save_pipeline *pl,
+                                struct save_batch *sb)
+{
+    pthread_mutex_lock(&pl->lock);
+
+    while ( !pl->error && pl->in_flight >= pl->max_in_flight )
+        pthread_cond_wait(&pl->idle_cond, &pl->lock);
+
+    if ( pl->error )
+    {
+        pthread_mutex_unlock(&pl->lock);
+        save_batch_free(sb);
+        return -1;
+    }
+
+    sb->next = NULL;
+    if ( pl->tail )
+        pl->tail->next = sb;
+    else
+        pl->head = sb;
+    pl->tail = sb;
+    pl->in_flight++;
+    pthread_cond_signal(&pl->work_cond);
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return 0;
+}
+
+/*
+ * Wait until every queued batch has been written (or, if abort is set,
+ * discarded).  Returns -1 if any stage of the pipeline has failed.
+ */
+static int save_pipeline_drain(struct save_pipeline *pl, int abort)
+{
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    if ( abort )
+        pl->error = 1;
+    while ( pl->in_flight )
+        pthread_cond_wait(&pl->idle_cond, &pl->lock);
+    rc = pl->error ? -1 : 0;
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+static void save_pipeline_destroy(struct save_pipeline *pl)
+{
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    save_pipeline_drain(pl, 1);
+
+    pthread_mutex_lock(&pl->lock);
+    pl->shutdown = 1;
+    pthread_cond_broadcast(&pl->work_cond);
+    pthread_cond_broadcast(&pl->ready_cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_workers; i++ )
+        pthread_join(pl->workers[i], NULL);
+    if ( pl->have_writer )
+        pthread_join(pl->writer, NULL);
+
+    pthread_cond_destroy(&pl->idle_cond);
+    pthread_cond_destroy(&pl->ready_cond);
+    pthread_cond_destroy(&pl->work_cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+}
+
+static struct save_pipeline *save_pipeline_create(xc_interface *xch,
+                                                  struct save_ctx *ctx,
+                                                  struct outbuf *ob,
+                                                  comp_ctx *compress_ctx,
+                                                  int io_fd, int live)
+{
+    struct save_pipeline *pl;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nr_workers;
+    int rc;
+
+    /* Leave a cpu each for the mapping loop and the writer. */
+    nr_workers = (nr_cpus > 3) ? nr_cpus - 2 : 1;
+    if ( nr_workers > SAVE_PIPELINE_MAX_WORKERS )
+        nr_workers = SAVE_PIPELINE_MAX_WORKERS;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate save pipeline");
+        return NULL;
+    }
+
+    pl->xch = xch;
+    pl->ctx = ctx;
+    pl->ob = ob;
+    pl->compress_ctx = compress_ctx;
+    pl->io_fd = io_fd;
+    pl->live = live;
+    pl->max_in_flight = 2 * nr_workers + 2;
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_cond_init(&pl->ready_cond, NULL);
+    pthread_cond_init(&pl->idle_cond, NULL);
+
+    while ( pl->nr_workers < nr_workers )
+    {
+        rc = pthread_create(&pl->workers[pl->nr_workers], NULL,
+                            save_pipeline_worker, pl);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create save pipeline worker");
+            goto err;
+        }
+        pl->nr_workers++;
+    }
+
+    rc = pthread_create(&pl->writer, NULL, save_pipeline_writer, pl);
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Unable to create save pipeline writer");
+        goto err;
+    }
+    pl->have_writer = 1;
+
+    DPRINTF("Pipelined save: %u canonicalisation workers, %u batches "
+            "in flight\n", pl->nr_workers, pl->max_in_flight);
+
+    return pl;
+
+ err:
+    save_pipeline_destroy(pl);
+    return NULL;
+}
+
 xen_pfn_t *xc_map_m2p(xc_interface *xch,
                                  unsigned long max_mfn,
                                  int prot,
@@ -801,7 +1312,8 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
-                   unsigned long vm_generationid_addr)
+                   unsigned long vm_generationid_addr,
+                   unsigned int compress_cache_mb)
 {
     xc_dominfo_t info;
     DECLARE_DOMCTL;
@@ -810,7 +1322,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     int live  = (flags & XCFLAGS_LIVE);
     int debug = (flags & XCFLAGS_DEBUG);
     int superpages = !!hvm;
-    int race = 0, sent_last_iter, skip_this_iter = 0;
+    int sent_last_iter, skip_this_iter = 0;
     unsigned int sent_this_iter = 0;
     int tmem_saved = 0;
 
@@ -891,6 +1403,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      */
     int compressing = 0;
 
+    /* Page canonicalisation/write pipeline, if XCFLAGS_PIPELINE */
+    struct save_pipeline *pipeline = NULL;
+
     int completed = 0;
 
     DPRINTF("%s: starting save of domid %u", __func__, dom);
@@ -992,7 +1507,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     if ( flags & XCFLAGS_CHECKPOINT_COMPRESS )
     {
-        if (!(compress_ctx = xc_compression_create_context(xch, dinfo->p2m_size)))
+        if ( compress_cache_mb > (ULONG_MAX >> 20) )
+        {
+            ERROR("Compression cache of %uMB is too large", compress_cache_mb);
+            errno = EINVAL;
+            goto out;
+        }
+        if (!(compress_ctx = xc_compression_create_context(xch, dinfo->p2m_size,
+                (unsigned long)compress_cache_mb << 20)))
         {
             ERROR("Failed to create compression context");
             goto out;
@@ -1113,10 +1635,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 #define wrcompressed(fd) write_compressed(xch, compress_ctx, last_iter, ob, (fd))
 
     ob = &ob_pagebuf; /* Holds pfn_types, pages/compressed pages */
+
+    if ( (flags & XCFLAGS_PIPELINE) && !pipeline )
+    {
+        pipeline = save_pipeline_create(xch, ctx, ob, compress_ctx,
+                                        io_fd, live);
+        if ( !pipeline )
+        {
+            DPRINTF("Falling back to serial page save\n");
+            flags &= ~XCFLAGS_PIPELINE;
+        }
+    }
+
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
         unsigned int N, batch, run;
+        struct save_batch *sb;
         char reportbuf[80];
 
         snprintf(reportbuf, sizeof(reportbuf),
@@ -1330,173 +1865,46 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 continue; /* bail on this batch: no valid pages */
             }
 
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
+            sb = save_batch_alloc(xch, region_base, pfn_type, batch,
+                                  last_iter, compressing);
+            if ( !sb )
             {
-                PERROR("Error when writing to state file (2)");
-                goto out;
-            }
-
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                for ( j = 0; j < batch; j++ )
-                    ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
-            {
-                PERROR("Error when writing to state file (3)");
+                munmap(region_base, batch*PAGE_SIZE);
                 goto out;
             }
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                while ( --j >= 0 )
-                    pfn_type[j] = ((unsigned long *)pfn_type)[j];
 
-            /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
-            for ( j = 0; j < batch; j++ )
+            if ( pipeline )
             {
-                unsigned long pfn, pagetype;
-                void *spage = (char *)region_base + (PAGE_SIZE*j);
-
-                pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-                pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
-
-                if ( pagetype != 0 )
-                {
-                    /* If the page is not a normal data page, write out any
-                       run of pages we may have previously acumulated */
-                    if ( !compressing && run )
-                    {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
-                        {
-                            PERROR("Error when writing to state file (4a)"
-                                  " (errno %d)", errno);
-                            goto out;
-                        }                        
-                        run = 0;
-                    }
-                }
-
-                /*
-                 * skip pages that aren't present,
-                 * or are broken, or are alloc-only
-                 */
-                if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
-                    || pagetype == XEN_DOMCTL_PFINFO_BROKEN
-                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
-                    continue;
-
-                pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
-
-                if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
-                     (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+                if ( save_pipeline_submit(pipeline, sb) )
                 {
-                    /* We have a pagetable page: need to rewrite it. */
-                    race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
-
-                    if ( race && !live )
-                    {
-                        ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
-                              pagetype);
-                        goto out;
-                    }
-
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* Mark pagetable page to be sent uncompressed */
-                        c_err = xc_compression_add_page(xch, compress_ctx, page,
-                                                        pfn, 1 /* raw page */);
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add pagetable page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            /*
-                             * We are out of buffer space to hold dirty
-                             * pages. Compress and flush the current buffer
-                             * to make space. This is a corner case, that
-                             * slows down checkpointing as the compression
-                             * happens while domain is suspended. Happens
-                             * seldom and if you find this occuring
-                             * frequently, increase the PAGE_BUFFER_SIZE
-                             * in xc_compression.c.
-                             */
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4b)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
-                    {
-                        PERROR("Error when writing to state file (4b)"
-                              " (errno %d)", errno);
-                        goto out;
-                    }
-                }
-                else
-                {
-                    /* We have a normal page: accumulate it for writing. */
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* For checkpoint compression, accumulate the page in the
-                         * page buffer, to be compressed later.
-                         */
-                        c_err = xc_compression_add_page(xch, compress_ctx, spage,
-                                                        pfn, 0 /* not raw page */);
-
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4c)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else
-                        run++;
+                    ERROR("Error in pipelined page save");
+                    goto out;
                 }
-            } /* end of the write out for this batch */
-
-            if ( run )
+            }
+            else
             {
-                /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
-                {
-                    PERROR("Error when writing to state file (4c)"
-                          " (errno %d)", errno);
+                /* entering this, pfn_type is now in pfns (Not mfns) */
+                frc = save_batch_canonicalise(xch, ctx, sb, live);
+                if ( !frc )
+                    frc = save_batch_write(xch, sb, ob, compress_ctx, io_fd);
+                save_batch_free(sb);
+                if ( frc )
                     goto out;
-                }                        
             }
 
             sent_this_iter += batch;
 
-            munmap(region_base, batch*PAGE_SIZE);
-
         } /* end of this while loop for this iteration */
 
       skip:
 
+        /* Everything from this iteration must be out before we carry on. */
+        if ( pipeline && save_pipeline_drain(pipeline, 0) )
+        {
+            ERROR("Error in pipelined page save");
+            goto out;
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
@@ -2032,6 +2440,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
  out:
     completed = 1;
 
+    /* Flush (or, on error, discard) any batches still in the pipeline */
+    if ( pipeline && save_pipeline_drain(pipeline, rc) && !rc )
+    {
+        ERROR("Error in pipelined page save");
+        rc = 1;
+    }
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -2108,6 +2523,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Warning - couldn't disable qemu log-dirty mode");
     }
 
+    save_pipeline_destroy(pipeline);
+
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
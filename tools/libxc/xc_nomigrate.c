@@ -24,7 +24,8 @@
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
-                   unsigned long vm_generationid_addr)
+                   unsigned long vm_generationid_addr,
+                   unsigned int compress_cache_mb)
 {
     errno = ENOSYS;
     return -1;
@@ -36,6 +37,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, domid_t console_domid,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid, int checkpointed_stream,
+                      unsigned int nr_copy_workers,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks)
 {
@@ -808,6 +808,18 @@ xc_sched_arinc653_schedule_get(
     uint32_t cpupool_id,
     struct xen_sysctl_arinc653_schedule *schedule);
 
+/*
+ * sdom->vcpuid selects the vcpu, or XEN_DOMCTL_RTDS_ALL_VCPUS; period and
+ * budget are in microseconds.
+ */
+int xc_sched_rtds_domain_set(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
+
+int xc_sched_rtds_domain_get(xc_interface *xch,
+                             uint32_t domid,
+                             struct xen_domctl_sched_rtds *sdom);
+
 /**
  * This function sends a trigger to a domain.
  *
@@ -2317,10 +2329,33 @@ void xc_elf_set_logfile(xc_interface *xch, struct elf_binary *elf,
  * Checkpoint Compression
  */
 typedef struct compression_ctx comp_ctx;
+
+/**
+ * cache_size is the memory budget, in bytes, for the cache of previously
+ * sent pages that deltas are computed against; 0 selects the default.
+ */
 comp_ctx *xc_compression_create_context(xc_interface *xch,
-					unsigned long p2m_size);
+					unsigned long p2m_size,
+					unsigned long cache_size);
 void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 
+typedef struct xc_compression_stats {
+    uint64_t pages;            /* pages compressed */
+    uint64_t bytes_out;        /* compressed bytes produced */
+    uint64_t ns;               /* time spent compressing */
+    uint64_t cache_hits;       /* pages sent as a delta */
+    uint64_t cache_misses;     /* pages sent whole, having no cached copy */
+    uint64_t cache_ghost_hits; /* misses on recently evicted pages */
+    uint64_t cache_evictions;
+} xc_compression_stats_t;
+
+/**
+ * Running totals since the context was created.  A summary of each
+ * checkpoint is also logged at debug level.
+ */
+void xc_compression_get_stats(xc_interface *xch, comp_ctx *ctx,
+                              xc_compression_stats_t *stats);
+
 /**
  * Add a page to compression page buffer, to be compressed later.
  *
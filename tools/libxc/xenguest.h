@@ -28,6 +28,7 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_PIPELINE  (1 << 5)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -82,12 +83,15 @@ struct save_callbacks {
  * @parm xch a handle to an open hypervisor interface
  * @parm fd the file descriptor to save a domain to
  * @parm dom the id of the domain
+ * @parm compress_cache_mb memory budget, in MB, of the page cache used by
+ *                         XCFLAGS_CHECKPOINT_COMPRESS (0: default size)
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
-                   unsigned long vm_generationid_addr);
+                   unsigned long vm_generationid_addr,
+                   unsigned int compress_cache_mb);
 
 
 /* callbacks provided by xc_domain_restore */
@@ -115,6 +119,8 @@ struct restore_callbacks {
  * @parm superpages non-zero to allocate guest memory with superpages
  * @parm no_incr_generationid non-zero if generation id is NOT to be incremented
  * @parm checkpointed_stream non-zero if the far end of the stream is using checkpointing
+ * @parm nr_copy_workers number of threads to copy pages into the domain
+ *       with while the stream is read, or 0 to do it inline
  * @parm vm_generationid_addr returned with the address of the generation id buffer
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
@@ -126,6 +132,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned long *console_mfn, domid_t console_domid,
                       unsigned int hvm, unsigned int pae, int superpages,
                       int no_incr_generationid, int checkpointed_stream,
+                      unsigned int nr_copy_workers,
                       unsigned long *vm_generationid_addr,
                       struct restore_callbacks *callbacks);
 /**
@@ -729,6 +729,13 @@ int libxl_domain_remus_start(libxl_ctx *ctx, libxl_domain_remus_info *info,
 
     assert(info);
 
+    if (info->compression_cache_mb < 0) {
+        LOG(ERROR, "invalid compression cache size %dMB",
+            info->compression_cache_mb);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
     /* TBD: Remus setup - i.e. attach qdisc, enable disk buffering, etc */
 
     /* Point of no return */
@@ -4978,6 +4985,72 @@ static int sched_sedf_domain_set(libxl__gc *gc, uint32_t domid,
     return 0;
 }
 
+static int sched_rtds_domain_get(libxl__gc *gc, uint32_t domid,
+                                 libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    sdom.vcpuid = XEN_DOMCTL_RTDS_ALL_VCPUS;
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    libxl_domain_sched_params_init(scinfo);
+    scinfo->sched = LIBXL_SCHEDULER_RTDS;
+    scinfo->period = sdom.period;
+    scinfo->budget = sdom.budget;
+
+    return 0;
+}
+
+static int sched_rtds_domain_set(libxl__gc *gc, uint32_t domid,
+                                 const libxl_domain_sched_params *scinfo)
+{
+    struct xen_domctl_sched_rtds sdom;
+    int rc;
+
+    sdom.vcpuid = XEN_DOMCTL_RTDS_ALL_VCPUS;
+    rc = xc_sched_rtds_domain_get(CTX->xch, domid, &sdom);
+    if (rc != 0) {
+        LOGE(ERROR, "getting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    if (scinfo->period != LIBXL_DOMAIN_SCHED_PARAM_PERIOD_DEFAULT) {
+        if (scinfo->period < XEN_DOMCTL_RTDS_MIN_PERIOD) {
+            LOG(ERROR, "RTDS period %dus is below the minimum of %dus",
+                scinfo->period, XEN_DOMCTL_RTDS_MIN_PERIOD);
+            return ERROR_INVAL;
+        }
+        sdom.period = scinfo->period;
+    }
+    if (scinfo->budget != LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT) {
+        if (scinfo->budget < XEN_DOMCTL_RTDS_MIN_BUDGET) {
+            LOG(ERROR, "RTDS budget %dus is below the minimum of %dus",
+                scinfo->budget, XEN_DOMCTL_RTDS_MIN_BUDGET);
+            return ERROR_INVAL;
+        }
+        sdom.budget = scinfo->budget;
+    }
+    if (sdom.budget > sdom.period) {
+        LOG(ERROR, "RTDS budget %"PRIu32"us is larger than "
+            "the period %"PRIu32"us", sdom.budget, sdom.period);
+        return ERROR_INVAL;
+    }
+
+    sdom.vcpuid = XEN_DOMCTL_RTDS_ALL_VCPUS;
+    rc = xc_sched_rtds_domain_set(CTX->xch, domid, &sdom);
+    if (rc < 0) {
+        LOGE(ERROR, "setting domain sched rtds");
+        return ERROR_FAIL;
+    }
+
+    return 0;
+}
+
 int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
                                   const libxl_domain_sched_params *scinfo)
 {
@@ -5001,6 +5074,9 @@ int libxl_domain_sched_params_set(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_ARINC653:
         ret=sched_arinc653_domain_set(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_set(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
@@ -5031,6 +5107,9 @@ int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
     case LIBXL_SCHEDULER_CREDIT2:
         ret=sched_credit2_domain_get(gc, domid, scinfo);
         break;
+    case LIBXL_SCHEDULER_RTDS:
+        ret=sched_rtds_domain_get(gc, domid, scinfo);
+        break;
     default:
         LOG(ERROR, "Unknown scheduler");
         ret=ERROR_INVAL;
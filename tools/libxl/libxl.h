@@ -324,6 +324,24 @@
  */
 #define LIBXL_HAVE_BUILDINFO_USBVERSION 1
 
+/*
+ * LIBXL_HAVE_REMUS_COMPRESSION_CACHE
+ *
+ * If this is defined, libxl_domain_remus_info contains a
+ * compression_cache_mb field: the memory budget, in MB, of the page
+ * cache used by checkpoint compression.  0 selects the default.
+ */
+#define LIBXL_HAVE_REMUS_COMPRESSION_CACHE 1
+
+/*
+ * LIBXL_HAVE_SCHED_RTDS
+ *
+ * If this is defined, the RTDS scheduler is supported, and
+ * libxl_domain_sched_params contains a budget field.  With RTDS, period
+ * and budget are the server of each vcpu of the domain, in microseconds.
+ */
+#define LIBXL_HAVE_SCHED_RTDS 1
+
 /*
  * LIBXL_HAVE_DEVICE_BACKEND_DOMNAME
  *
@@ -1085,6 +1103,7 @@ int libxl_sched_credit_params_set(libxl_ctx *ctx, uint32_t poolid,
 #define LIBXL_DOMAIN_SCHED_PARAM_SLICE_DEFAULT     -1
 #define LIBXL_DOMAIN_SCHED_PARAM_LATENCY_DEFAULT   -1
 #define LIBXL_DOMAIN_SCHED_PARAM_EXTRATIME_DEFAULT -1
+#define LIBXL_DOMAIN_SCHED_PARAM_BUDGET_DEFAULT    -1
 
 int libxl_domain_sched_params_get(libxl_ctx *ctx, uint32_t domid,
                                   libxl_domain_sched_params *params);
@@ -1349,8 +1349,10 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
 
     if (r_info != NULL) {
         dss->interval = r_info->interval;
-        if (r_info->compression)
+        if (r_info->compression) {
             dss->xcflags |= XCFLAGS_CHECKPOINT_COMPRESS;
+            dss->compress_cache_mb = r_info->compression_cache_mb;
+        }
     }
 
     dss->xce = xc_evtchn_open(NULL, 0);
@@ -2320,6 +2320,7 @@ struct libxl__domain_suspend_state {
     int suspend_eventchn;
     int hvm;
     int xcflags;
+    unsigned int compress_cache_mb; /* for XCFLAGS_CHECKPOINT_COMPRESS */
     int guest_responded;
     const char *dm_savefile;
     int interval; /* checkpoint interval (for Remus) */
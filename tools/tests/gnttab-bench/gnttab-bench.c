@@ -0,0 +1,423 @@
+/*
+ * gnttab-bench.c
+ *
+ * Grant map/unmap throughput as the number of backend vCPUs grows.
+ *
+ * Pages are granted with gntshr to the domain we map them from (by
+ * default dom0 granting to itself), then 1, 2, 4, ... threads, each
+ * pinned to its own CPU and using its own gntdev handle, map and unmap
+ * batches of those grants for a fixed time.  With -L the hypervisor's
+ * lock profile is reset before and dumped after every run, so the
+ * grant table and maptrack locks of the granting domain can be compared
+ * across thread counts.  That needs a hypervisor built with
+ * lock_profile=y.
+ *
+ * With -C the threads issue GNTTABOP_copy batches between grants instead
+ * of mapping them.  Each batch copies -s bytes per op, and -r consecutive
+ * ops use the same source and destination grant, the way netback RX
+ * fills a guest buffer from several fragments.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+
+struct bench_thread {
+    pthread_t       thread;
+    int             cpu;
+    uint32_t       *refs;
+    uint64_t        ops;
+    int             err;
+};
+
+static uint32_t domid;
+static int nr_grants = 64;
+static int batch = 1;
+static int copy_size, copy_run;
+static volatile int running;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-d domid] [-t seconds] [-c threads] [-n grants] "
+           "[-b batch] [-C] [-s size] [-r run] [-L]\n", prog);
+    printf("  -d  domain to grant to and map from (default 0)\n");
+    printf("  -t  seconds per run (default 5)\n");
+    printf("  -c  maximum number of threads (default: online cpus)\n");
+    printf("  -n  grants per thread (default 64)\n");
+    printf("  -b  grants per map call, or ops per copy call (default 1)\n");
+    printf("  -C  measure grant copies instead of map/unmap\n");
+    printf("  -s  bytes per copy op (default 512)\n");
+    printf("  -r  consecutive copy ops per grant (default: page size / size)\n");
+    printf("  -L  report the lock profile of each run\n");
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_pin(struct bench_thread *t)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * Copy between the first and the second half of the thread's grants,
+ * copy_run ops per source/destination pair.
+ */
+static void *copy_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+    xc_interface *xch;
+    gnttab_copy_t *ops;
+    int i, g, half = nr_grants / 2;
+
+    bench_pin(t);
+
+    ops = calloc(batch, sizeof(*ops));
+    xch = xc_interface_open(0, 0, 0);
+    if ( !ops || !xch )
+    {
+        t->err = errno;
+        goto out;
+    }
+
+    for ( i = 0; i < batch; i++ )
+    {
+        g = (i / copy_run) % half;
+        ops[i].source.u.ref = t->refs[g];
+        ops[i].source.domid = domid;
+        ops[i].source.offset = (i % copy_run) * copy_size % XC_PAGE_SIZE;
+        ops[i].dest.u.ref = t->refs[half + g];
+        ops[i].dest.domid = domid;
+        ops[i].dest.offset = ops[i].source.offset;
+        ops[i].len = copy_size;
+        ops[i].flags = GNTCOPY_source_gref | GNTCOPY_dest_gref;
+    }
+
+    while ( running )
+    {
+        if ( xc_gnttab_op(xch, GNTTABOP_copy, ops, sizeof(*ops), batch) )
+        {
+            t->err = errno;
+            goto out;
+        }
+        for ( i = 0; i < batch; i++ )
+        {
+            if ( ops[i].status != GNTST_okay )
+            {
+                fprintf(stderr, "copy op %d: status %d\n",
+                        i, ops[i].status);
+                t->err = EIO;
+                goto out;
+            }
+        }
+        t->ops += batch;
+    }
+
+ out:
+    if ( xch )
+        xc_interface_close(xch);
+    free(ops);
+    return NULL;
+}
+
+static void *map_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+    xc_gnttab *xcg;
+    void *addr;
+    int i;
+
+    bench_pin(t);
+
+    xcg = xc_gnttab_open(NULL, 0);
+    if ( !xcg )
+    {
+        t->err = errno;
+        return NULL;
+    }
+    xc_gnttab_set_max_grants(xcg, batch);
+
+    while ( running )
+    {
+        for ( i = 0; i + batch <= nr_grants && running; i += batch )
+        {
+            addr = xc_gnttab_map_domain_grant_refs(xcg, batch, domid,
+                                                   &t->refs[i],
+                                                   PROT_READ | PROT_WRITE);
+            if ( !addr )
+            {
+                t->err = errno;
+                goto out;
+            }
+            /* Touch the mapping so that it is really established. */
+            *(volatile char *)addr;
+            if ( xc_gnttab_munmap(xcg, addr, batch) )
+            {
+                t->err = errno;
+                goto out;
+            }
+            t->ops += batch;
+        }
+    }
+
+ out:
+    xc_gnttab_close(xcg);
+    return NULL;
+}
+
+static int lockprof_report(xc_interface *xch)
+{
+    uint32_t i, j, n;
+    uint64_t time;
+    DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
+
+    n = 0;
+    if ( xc_lockprof_query_number(xch, &n) )
+    {
+        fprintf(stderr, "    lock profile not available: %d (%s)\n",
+                errno, strerror(errno));
+        return -1;
+    }
+
+    n += 32;
+    data = xc_hypercall_buffer_alloc(xch, data, sizeof(*data) * n);
+    if ( !data )
+        return -1;
+
+    i = n;
+    if ( xc_lockprof_query(xch, &i, &time, HYPERCALL_BUFFER(data)) )
+    {
+        fprintf(stderr, "    error getting lock profile: %d (%s)\n",
+                errno, strerror(errno));
+        xc_hypercall_buffer_free(xch, data);
+        return -1;
+    }
+    if ( i > n )
+        i = n;
+
+    /*
+     * The per-domain locks of the granting domain, plus any global lock
+     * that was contended during the run.
+     */
+    for ( j = 0; j < i; j++ )
+    {
+        if ( data[j].type == LOCKPROF_TYPE_PERDOM )
+        {
+            if ( data[j].idx != domid || !data[j].lock_cnt )
+                continue;
+            printf("    domain %d %-24s", data[j].idx, data[j].name);
+        }
+        else if ( data[j].type == LOCKPROF_TYPE_GLOBAL )
+        {
+            if ( !data[j].block_cnt )
+                continue;
+            printf("    global %-26s", data[j].name);
+        }
+        else
+            continue;
+
+        printf(": lock %12"PRId64" (%10.6fs) block %10"PRId64" (%10.6fs)\n",
+               data[j].lock_cnt, data[j].lock_time / 1e9,
+               data[j].block_cnt, data[j].block_time / 1e9);
+    }
+
+    xc_hypercall_buffer_free(xch, data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, nr, max_threads, seconds, lockprof, copy, rc = 1;
+    xc_interface *xch = NULL;
+    xc_gntshr *xgs;
+    struct bench_thread *threads;
+    uint32_t *refs;
+    void *pages;
+    double start, elapsed, base = 0;
+    uint64_t ops;
+
+    seconds = 5;
+    lockprof = 0;
+    copy = 0;
+    copy_size = 512;
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ( (c = getopt(argc, argv, "d:t:c:n:b:Cs:r:Lh")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'c':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            nr_grants = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'C':
+            copy = 1;
+            break;
+        case 's':
+            copy_size = atoi(optarg);
+            break;
+        case 'r':
+            copy_run = atoi(optarg);
+            break;
+        case 'L':
+            lockprof = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !copy_run && copy_size > 0 )
+        copy_run = XC_PAGE_SIZE / copy_size;
+
+    if ( seconds <= 0 || max_threads <= 0 || batch <= 0 ||
+         (!copy && nr_grants < batch) ||
+         (copy && (nr_grants < 2 || copy_size <= 0 ||
+                   copy_size > XC_PAGE_SIZE || copy_run <= 0)) )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    threads = calloc(max_threads, sizeof(*threads));
+    refs = calloc((size_t)max_threads * nr_grants, sizeof(*refs));
+    if ( !threads || !refs )
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    xgs = xc_gntshr_open(NULL, 0);
+    if ( !xgs )
+    {
+        perror("xc_gntshr_open");
+        return 1;
+    }
+
+    pages = xc_gntshr_share_pages(xgs, domid, max_threads * nr_grants,
+                                  refs, 1);
+    if ( !pages )
+    {
+        perror("xc_gntshr_share_pages");
+        goto out_gntshr;
+    }
+
+    if ( lockprof )
+    {
+        xch = xc_interface_open(0, 0, 0);
+        if ( !xch )
+        {
+            perror("xc_interface_open");
+            goto out_unshare;
+        }
+    }
+
+    if ( copy )
+        printf("dom%u: copy %d bytes, %d ops per grant, batch %d, "
+               "%ds per run\n", domid, copy_size, copy_run, batch, seconds);
+    else
+        printf("dom%u: %d grants per thread, batch %d, %ds per run\n",
+               domid, nr_grants, batch, seconds);
+
+    /* 1, 2, 4, ... threads, always finishing with max_threads. */
+    for ( nr = 1; ; nr = nr * 2 < max_threads ? nr * 2 : max_threads )
+    {
+        if ( lockprof && xc_lockprof_reset(xch) )
+            fprintf(stderr, "lock profile reset failed: %d (%s)\n",
+                    errno, strerror(errno));
+
+        running = 1;
+        for ( i = 0; i < nr; i++ )
+        {
+            threads[i].cpu = i;
+            threads[i].refs = &refs[i * nr_grants];
+            threads[i].ops = 0;
+            threads[i].err = 0;
+            if ( pthread_create(&threads[i].thread, NULL,
+                                copy ? copy_thread : map_thread,
+                                &threads[i]) )
+            {
+                perror("pthread_create");
+                running = 0;
+                nr = i;
+                break;
+            }
+        }
+
+        start = now();
+        sleep(seconds);
+        running = 0;
+
+        ops = 0;
+        for ( i = 0; i < nr; i++ )
+        {
+            pthread_join(threads[i].thread, NULL);
+            if ( threads[i].err )
+                fprintf(stderr, "thread %d: %d (%s)\n", i,
+                        threads[i].err, strerror(threads[i].err));
+            ops += threads[i].ops;
+        }
+        elapsed = now() - start;
+
+        if ( nr == 1 )
+            base = ops / elapsed;
+
+        printf("%3d threads: %12.0f %s/s %12.0f per thread "
+               "speedup %5.2f\n", nr, ops / elapsed,
+               copy ? "copies" : "map+unmap", ops / elapsed / nr,
+               base ? ops / elapsed / base : 0);
+
+        if ( lockprof )
+            lockprof_report(xch);
+
+        if ( nr == max_threads )
+            break;
+    }
+
+    rc = 0;
+
+    if ( xch )
+        xc_interface_close(xch);
+ out_unshare:
+    xc_gntshr_munmap(xgs, pages, max_threads * nr_grants);
+ out_gntshr:
+    xc_gntshr_close(xgs);
+    free(refs);
+    free(threads);
+    return rc;
+}
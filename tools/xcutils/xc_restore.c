@@ -11,10 +11,21 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <xenctrl.h>
 #include <xenguest.h>
 
+static void
+usage(const char *prog)
+{
+    errx(1, "usage: %s [-b] [-w workers] iofd domid store_evtchn "
+         "console_evtchn hvm pae apic [superpages [checkpointed]]\n"
+         "  -b          report restore throughput (iofd must be a file)\n"
+         "  -w workers  copy pages in with this many threads", prog);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -26,10 +37,32 @@ main(int argc, char **argv)
     unsigned long store_mfn = 0, console_mfn = 0;
     xentoollog_level lvl;
     xentoollog_logger *l;
+    unsigned int workers = 0;
+    int bench = 0, opt;
+    off_t start = 0, end;
+    struct timeval t0, t1;
+    double secs;
+    const char *prog = argv[0];
+
+    while ( (opt = getopt(argc, argv, "bw:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'b':
+            bench = 1;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        default:
+            usage(prog);
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
 
     if ( !( argc >= 8 && argc <= 10) )
-        errx(1, "usage: %s iofd domid store_evtchn "
-             "console_evtchn hvm pae apic [superpages [checkpointed]]", argv[0]);
+        usage(prog);
 
     lvl = XTL_DETAIL;
     lflags = XTL_STDIOSTREAM_SHOW_PID | XTL_STDIOSTREAM_HIDE_PROGRESS;
@@ -54,9 +87,23 @@ main(int argc, char **argv)
     else
         checkpointed = 0;
 
+    if ( bench && (start = lseek(io_fd, 0, SEEK_CUR)) == (off_t)-1 )
+        err(1, "benchmark mode needs a seekable iofd");
+
+    gettimeofday(&t0, NULL);
     ret = xc_domain_restore(xch, io_fd, domid, store_evtchn, &store_mfn, 0,
                             console_evtchn, &console_mfn, 0, hvm, pae, superpages,
-                            0, checkpointed, NULL, NULL);
+                            0, checkpointed, workers, NULL, NULL);
+    gettimeofday(&t1, NULL);
+
+    if ( bench )
+    {
+        end = lseek(io_fd, 0, SEEK_CUR);
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        fprintf(stderr, "restored %lld bytes in %.3fs: %.3f GB/s "
+                "(%u copy workers)\n", (long long)(end - start), secs,
+                secs > 0 ? (end - start) / secs / 1e9 : 0.0, workers);
+    }
 
     if ( ret == 0 )
     {
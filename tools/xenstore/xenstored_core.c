@@ -70,7 +70,7 @@ static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+TDB_CONTEXT *tdb_ctx = NULL;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
@@ -89,22 +89,12 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+static struct transaction *conn_transaction(struct connection *conn)
 {
 	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	if (!conn)
+		return NULL;
+	return conn->transaction;
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -396,38 +386,44 @@ bool is_child(const char *child, const char *parent)
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	struct transaction *trans = conn_transaction(conn);
 
 	key.dptr = (void *)name;
 	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
+	if (trans) {
+		if (transaction_fetch(trans, key, &data) != 0)
+			return NULL;
+	} else {
+		data = tdb_fetch(tdb_ctx, key);
+		if (data.dptr == NULL) {
+			if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+				errno = ENOENT;
+			else {
+				log("TDB error on read: %s",
+				    tdb_errorstr(tdb_ctx));
+				errno = EIO;
+			}
+			return NULL;
 		}
-		return NULL;
 	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	hdr = (void *)data.dptr;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -440,16 +436,18 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * conn_transaction copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+	struct transaction *trans = conn_transaction(conn);
 	void *p;
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -457,10 +455,13 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	/* Records written by a transaction get stamped when it commits. */
+	hdr->generation = trans ? 0 : generation++;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -468,8 +469,11 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (trans) {
+		if (transaction_store(trans, key, data) != 0)
+			goto error;
+	} else if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
+		/* TDB should set errno, but doesn't even set ecode AFAICT. */
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -787,13 +791,22 @@ static void do_read(struct connection *conn, const char *name)
 static void delete_node_single(struct connection *conn, struct node *node)
 {
 	TDB_DATA key;
+	struct transaction *trans = conn_transaction(conn);
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
-		corrupt(conn, "Could not delete '%s'", node->name);
-		return;
+	if (trans) {
+		if (transaction_delete(trans, key) != 0) {
+			corrupt(conn, "Could not delete '%s'", node->name);
+			return;
+		}
+	} else {
+		if (tdb_delete(tdb_ctx, key) != 0) {
+			corrupt(conn, "Could not delete '%s'", node->name);
+			return;
+		}
+		generation++;
 	}
 	domain_entry_dec(conn, node);
 }
@@ -832,7 +845,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn_transaction(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -861,7 +874,10 @@ static int destroy_node(void *_node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	tdb_delete(node->tdb, key);
+	if (node->trans)
+		transaction_delete(node->trans, key);
+	else
+		tdb_delete(tdb_ctx, key);
 	return 0;
 }
 
@@ -1519,7 +1535,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1532,7 +1548,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -98,11 +98,21 @@ struct connection
 };
 extern struct list_head connections;
 
+/* Header of the node record as stored in the tdb. */
+struct xs_tdb_record_hdr {
+	/* Value of the store generation when this record was written. */
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL for the main store) */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,14 +157,12 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* The main store: transactions only keep the nodes they touched. */
+extern TDB_CONTEXT *tdb_ctx;
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hashtable helpers for tables keyed by node name. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
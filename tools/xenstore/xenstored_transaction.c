@@ -30,12 +30,46 @@
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * A transaction doesn't copy the store.  Instead it records every node it
+ * touches, together with the generation that node had in the main store
+ * when the transaction first saw it.  Reads of nodes not yet touched go
+ * to the main store, writes and deletes only modify the transaction's own
+ * copy of the node.  At commit time the recorded generations are checked
+ * against the main store: if none of the touched nodes changed in the
+ * meantime, the modified nodes are written back, otherwise the client
+ * gets EAGAIN.  Start and commit thus cost O(nodes touched), not
+ * O(size of the store).
+ */
+
+/* Generation of a node which didn't exist when first accessed. */
+#define NO_GENERATION ~((uint64_t)0)
+
+struct accessed_node
+{
+	/* List of all nodes accessed in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation of the node in the main store when first accessed. */
+	uint64_t generation;
+
+	/* Has the transaction changed (or deleted) the node? */
+	bool modified;
+
+	/* The node record as seen by the transaction (NULL if none). */
+	TDB_DATA data;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -69,11 +103,11 @@ struct transaction
 	uint32_t id;
 
 	/* Generation when transaction started. */
-	unsigned int generation;
+	uint64_t generation;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes, and the same indexed by name. */
+	struct list_head accessed;
+	struct hashtable *accessed_hash;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,13 +117,7 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
-
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
-{
-	return trans->tdb;
-}
+uint64_t generation;
 
 /* Callers get a change node (which can fail) and only commit after they've
  * finished.  This way they don't have to unwind eg. a write. */
@@ -97,11 +125,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Changes to the global database bump the generation themselves. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -113,14 +139,200 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 	list_add_tail(&i->list, &trans->changes);
 }
 
+/* Find the transaction's view of a node, recording it on first access. */
+static struct accessed_node *get_accessed_node(struct transaction *trans,
+					       TDB_DATA key)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	char *name, *hashkey;
+
+	name = talloc_strndup(trans, (char *)key.dptr, key.dsize);
+	if (!name) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	i = hashtable_search(trans->accessed_hash, name);
+	if (i) {
+		talloc_free(name);
+		return i;
+	}
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i) {
+		talloc_free(name);
+		errno = ENOMEM;
+		return NULL;
+	}
+	i->node = talloc_steal(i, name);
+
+	i->data = tdb_fetch(tdb_ctx, key);
+	if (i->data.dptr) {
+		talloc_steal(i, i->data.dptr);
+		hdr = (void *)i->data.dptr;
+		i->generation = hdr->generation;
+	} else if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
+		i->generation = NO_GENERATION;
+	} else {
+		talloc_free(i);
+		errno = EIO;
+		return NULL;
+	}
+
+	/* The hashtable owns (and frees) its keys. */
+	hashkey = strdup(i->node);
+	if (!hashkey ||
+	    !hashtable_insert(trans->accessed_hash, hashkey, i)) {
+		free(hashkey);
+		talloc_free(i);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list_add_tail(&i->list, &trans->accessed);
+	return i;
+}
+
+int transaction_fetch(struct transaction *trans, TDB_DATA key, TDB_DATA *data)
+{
+	struct accessed_node *i;
+
+	i = get_accessed_node(trans, key);
+	if (!i)
+		return -1;
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Callers modify the record in place, so hand out a copy. */
+	data->dptr = talloc_memdup(NULL, i->data.dptr, i->data.dsize);
+	if (!data->dptr) {
+		errno = ENOMEM;
+		return -1;
+	}
+	data->dsize = i->data.dsize;
+	return 0;
+}
+
+int transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data)
+{
+	struct accessed_node *i;
+	void *dptr;
+
+	i = get_accessed_node(trans, key);
+	if (!i)
+		return -1;
+
+	dptr = talloc_memdup(i, data.dptr, data.dsize);
+	if (!dptr) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = dptr;
+	i->data.dsize = data.dsize;
+	i->modified = true;
+	return 0;
+}
+
+int transaction_delete(struct transaction *trans, TDB_DATA key)
+{
+	struct accessed_node *i;
+
+	i = get_accessed_node(trans, key);
+	if (!i)
+		return -1;
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return 0;
+}
+
+/* Has any node we accessed been changed in the main store since? */
+static bool transaction_conflicts(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key, data;
+	uint64_t gen;
+
+	/* Nothing at all was committed since we started. */
+	if (trans->generation == generation)
+		return false;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+
+		data = tdb_fetch(tdb_ctx, key);
+		if (data.dptr) {
+			hdr = (void *)data.dptr;
+			gen = hdr->generation;
+			talloc_free(data.dptr);
+		} else
+			gen = NO_GENERATION;
+
+		if (gen != i->generation)
+			return true;
+	}
+
+	return false;
+}
+
+/* Write the nodes changed by the transaction to the main store. */
+static bool transaction_commit(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+
+		if (i->data.dptr) {
+			hdr = (void *)i->data.dptr;
+			hdr->generation = generation++;
+			if (tdb_store(tdb_ctx, key, i->data, TDB_REPLACE) != 0)
+				goto error;
+		} else {
+			if (tdb_delete(tdb_ctx, key) != 0 &&
+			    tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
+				goto error;
+			generation++;
+		}
+	}
+
+	return true;
+ error:
+	eprintf("commit of %s failed: %s", i->node,
+		tdb_errorstr(tdb_ctx));
+	errno = EIO;
+	return false;
+}
+
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	/* Values are talloc children of the transaction. */
+	if (trans->accessed_hash)
+		hashtable_destroy(trans->accessed_hash, 0);
 	return 0;
 }
 
@@ -156,18 +368,17 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
 	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	talloc_set_destructor(trans, destroy_transaction);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,7 +389,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
@@ -209,17 +419,15 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		/* Only fail if a node we looked at changed under us. */
+		if (transaction_conflicts(trans)) {
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
+		if (!transaction_commit(trans)) {
 			send_error(conn, errno);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -35,8 +35,15 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Access a node record as seen by the transaction: these only touch the
+ * transaction's view until it is committed.  Return -1 and set errno on
+ * failure.  Fetched data is talloced and owned by the caller. */
+int transaction_fetch(struct transaction *trans, TDB_DATA key, TDB_DATA *data);
+int transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data);
+int transaction_delete(struct transaction *trans, TDB_DATA key);
+
+/* Bumped on every change to the main store. */
+extern uint64_t generation;
 
 void conn_delete_all_transactions(struct connection *conn);
 
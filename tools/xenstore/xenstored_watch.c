@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -33,11 +34,16 @@
 
 extern int quota_nb_watch_per_domain;
 
+struct watch_path;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, from all connections */
+	struct list_head path_list;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -46,8 +52,107 @@ struct watch
 
 	char *token;
 	char *node;
+
+	struct connection *conn;
+	struct watch_path *path;
+};
+
+/*
+ * All watches are indexed by the path they watch, in a tree which mirrors
+ * the part of the store that is being watched: there is an entry for each
+ * watched path and for each of its parents.  The entries are also kept in
+ * a hashtable by path, so that firing the watches for a node only has to
+ * look up the node's parents (and walk its children on removal) instead of
+ * checking every watch of every connection.  Special paths starting with
+ * '@' have no parents.
+ */
+struct watch_path
+{
+	/* Entries below the same parent. */
+	struct list_head list;
+
+	/* Entries directly below this one. */
+	struct list_head children;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+
+	struct watch_path *parent;
+	char *path;
 };
 
+static struct hashtable *watch_paths;
+
+static void put_watch_path(struct watch_path *wp)
+{
+	struct watch_path *parent;
+
+	while (wp && list_empty(&wp->watches) && list_empty(&wp->children)) {
+		parent = wp->parent;
+		if (parent)
+			list_del(&wp->list);
+		hashtable_remove(watch_paths, wp->path);
+		talloc_free(wp);
+		wp = parent;
+	}
+}
+
+/* Find or create the index entry for path: NULL on allocation failure. */
+static struct watch_path *get_watch_path(const char *path)
+{
+	struct watch_path *wp, *parent = NULL;
+	char *key, *slash;
+
+	if (!watch_paths) {
+		watch_paths = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_paths)
+			return NULL;
+	}
+
+	wp = hashtable_search(watch_paths, (void *)path);
+	if (wp)
+		return wp;
+
+	if (path[0] == '/' && path[1] != '\0') {
+		char *parentpath = talloc_strdup(NULL, path);
+
+		if (!parentpath)
+			return NULL;
+		slash = strrchr(parentpath, '/');
+		slash[slash == parentpath ? 1 : 0] = '\0';
+		parent = get_watch_path(parentpath);
+		talloc_free(parentpath);
+		if (!parent)
+			return NULL;
+	}
+
+	wp = talloc(talloc_autofree_context(), struct watch_path);
+	key = strdup(path);
+	if (!wp || !key)
+		goto nomem;
+	wp->path = talloc_strdup(wp, path);
+	if (!wp->path)
+		goto nomem;
+	INIT_LIST_HEAD(&wp->children);
+	INIT_LIST_HEAD(&wp->watches);
+	INIT_LIST_HEAD(&wp->list);
+	wp->parent = parent;
+
+	/* The hashtable owns (and frees) its keys. */
+	if (!hashtable_insert(watch_paths, key, wp))
+		goto nomem;
+	if (parent)
+		list_add_tail(&wp->list, &parent->children);
+	return wp;
+
+ nomem:
+	free(key);
+	talloc_free(wp);
+	put_watch_path(parent);
+	return NULL;
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -86,29 +191,71 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+/* Fire the watches on wp (with name) and, if recurse, all below it. */
+static void fire_watch_path(struct watch_path *wp, const char *name,
+			    bool recurse)
 {
-	struct connection *i;
+	struct watch_path *child;
 	struct watch *watch;
 
+	list_for_each_entry(watch, &wp->watches, path_list)
+		add_event(watch->conn, watch, name ? name : watch->node);
+
+	if (recurse)
+		list_for_each_entry(child, &wp->children, list)
+			fire_watch_path(child, NULL, true);
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_path *wp, *child;
+	char *path, *slash;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
+	if (!watch_paths)
+		return;
+
+	/* Watches on / see everything, including special events. */
+	wp = hashtable_search(watch_paths, "/");
+	if (wp)
+		fire_watch_path(wp, name, false);
+
+	if (name[0] != '/') {
+		wp = hashtable_search(watch_paths, (void *)name);
+		if (wp)
+			fire_watch_path(wp, name, false);
+	} else if (!streq(name, "/")) {
+		/* Walk down towards name for as long as anything is watched. */
+		path = talloc_strdup(NULL, name);
+		for (slash = path; wp && slash; ) {
+			slash = strchr(slash + 1, '/');
+			if (slash)
+				*slash = '\0';
+			wp = hashtable_search(watch_paths, path);
+			if (wp)
+				fire_watch_path(wp, name, false);
+			if (slash)
+				*slash = '/';
 		}
+		talloc_free(path);
 	}
+
+	/* wp is now the entry for name if anything below it is watched. */
+	if (recurse && wp)
+		list_for_each_entry(child, &wp->children, list)
+			fire_watch_path(child, NULL, true);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	list_del(&watch->path_list);
+	put_watch_path(watch->path);
 	return 0;
 }
 
@@ -160,11 +307,20 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 		watch->relative_path = get_implicit_path(conn);
 	else
 		watch->relative_path = NULL;
+	watch->conn = conn;
+
+	watch->path = get_watch_path(watch->node);
+	if (!watch->path) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
 
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->path_list, &watch->path->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
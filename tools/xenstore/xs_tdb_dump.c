@@ -11,6 +11,7 @@
 #include "utils.h"
 
 struct record_hdr {
+	uint64_t generation;
 	uint32_t num_perms;
 	uint32_t datalen;
 	uint32_t childlen;
@@ -23,8 +23,13 @@
 #include <string.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -57,9 +62,12 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned int threads;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        compress:1,
+        report_lost:1;
 } settings_t;
 
 struct t_struct {
@@ -77,6 +85,43 @@ static xc_evtchn *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
 
+/*
+ * Offset in the output file at which the next window goes, or -1 if the
+ * output can't seek (a pipe).  Consumer threads reserve space by moving it
+ * forward and then write in parallel; without it, and into the memory
+ * buffer, their writes are serialised by write_lock.
+ */
+static off_t out_offset = -1;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The trace buffers, shared by all the consumer threads. */
+static struct {
+    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
+    unsigned char **data;        /* pointers to the trace buffer data areas
+                                  * where they are mapped into user space.   */
+    unsigned int num;            /* number of trace buffers / logical CPUS   */
+    unsigned long data_size;     /* size of the data area of each buffer     */
+    unsigned long *lost;         /* records lost by Xen, per CPU             */
+} tb;
+
+/*
+ * Consumer thread n looks after CPUs n, n + opts.threads, ...  Thread 0 is
+ * the main thread, which also waits for VIRQ_TBUF and then has all the
+ * threads drain their buffers once.
+ */
+struct consumer {
+    pthread_t thread;
+    unsigned int first;
+#ifdef HAVE_LZ4
+    LZ4F_compressionContext_t lz4;
+    unsigned char *zbuf;
+    size_t zbuf_size;
+#endif
+};
+
+static pthread_barrier_t poll_start, poll_done;
+static int consumers_exit;
+
 static void close_handler(int signal)
 {
     interrupted = 1;
@@ -329,97 +374,167 @@ fail:
     return;
 }
 
-/**
- * write_buffer - write a section of the trace buffer
- * @cpu      - source buffer CPU ID
- * @start
- * @size     - size of write (may be less than total window size)
- * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
- *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
- */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void check_disk_space(size_t size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+    unsigned long long freespace;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
     {
-        unsigned long long freespace;
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
 
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+#ifdef HAVE_LZ4
+/*
+ * Compress a window, cpu_change record included, into one LZ4 frame.  The
+ * frames just follow each other in the output, which "lz4 -d" turns back
+ * into the usual stream of records.
+ */
+static size_t compress_window(struct consumer *c, const struct iovec *iov,
+                              int nr)
+{
+    size_t done, ret;
+    int i;
 
-        freespace >>= 20; /* Convert to MB */
+    ret = LZ4F_compressBegin(c->lz4, c->zbuf, c->zbuf_size, NULL);
+    if ( LZ4F_isError(ret) )
+        goto fail;
+    done = ret;
 
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
+    for ( i = 0; i < nr; i++ )
+    {
+        ret = LZ4F_compressUpdate(c->lz4, c->zbuf + done, c->zbuf_size - done,
+                                  iov[i].iov_base, iov[i].iov_len, NULL);
+        if ( LZ4F_isError(ret) )
+            goto fail;
+        done += ret;
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
+    ret = LZ4F_compressEnd(c->lz4, c->zbuf + done, c->zbuf_size - done, NULL);
+    if ( LZ4F_isError(ret) )
+        goto fail;
+
+    return done + ret;
+
+ fail:
+    fprintf(stderr, "LZ4 compression failed: %s\n", LZ4F_getErrorName(ret));
+    exit(EXIT_FAILURE);
+}
+#endif
+
+/**
+ * write_window - write a window of a trace buffer
+ * @c:      consumer thread doing the write
+ * @cpu:    source buffer CPU ID
+ * @iov:    the window, in one or two pieces (two if it wraps), after a
+ *          free slot for the cpu_change record
+ * @nr:     number of entries in @iov, free slot included
+ *
+ * Outputs the window, prepending the CPU and size of the window.  The data
+ * goes to the file straight from the mapped trace buffer.
+ */
+static void write_window(struct consumer *c, unsigned int cpu,
+                         struct iovec *iov, int nr)
+{
+    struct cpu_change_record rec;
+    size_t total_size = 0;
+    ssize_t written;
+    int i;
+
+    for ( i = 1; i < nr; i++ )
+        total_size += iov[i].iov_len;
+
+    if ( opts.memory_buffer )
     {
-        if ( opts.memory_buffer )
-        {
-            membuf_reserve_window(cpu, total_size);
-        }
-        else
-        {
-            struct cpu_change_record rec;
+        pthread_mutex_lock(&write_lock);
+        membuf_reserve_window(cpu, total_size);
+        for ( i = 1; i < nr; i++ )
+            membuf_write(iov[i].iov_base, iov[i].iov_len);
+        pthread_mutex_unlock(&write_lock);
+        return;
+    }
 
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = cpu;
+    rec.data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
-        }
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    total_size += sizeof(rec);
+
+#ifdef HAVE_LZ4
+    if ( opts.compress )
+    {
+        total_size = compress_window(c, iov, nr);
+        iov[0].iov_base = c->zbuf;
+        iov[0].iov_len = total_size;
+        nr = 1;
     }
+#endif
 
-    if ( opts.memory_buffer )
+    if ( opts.disk_rsvd != 0 )
+        check_disk_space(total_size);
+
+    if ( out_offset < 0 )
     {
-        membuf_write(start, size);
+        pthread_mutex_lock(&write_lock);
+        written = writev(outfd, iov, nr);
+        pthread_mutex_unlock(&write_lock);
     }
     else
+        written = pwritev(outfd, iov, nr,
+                          __sync_fetch_and_add(&out_offset, total_size));
+
+    if ( written != (ssize_t)total_size )
     {
-        written = write(outfd, start, size);
-        if ( written != size )
-        {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
-            goto fail;
-        }
+        fprintf(stderr, "Write failed! (size %zu, returned %zd)\n",
+                total_size, written);
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
     }
+}
 
-    return;
+/*
+ * Report the records Xen lost, in one piece of a window.  Records never
+ * straddle the end of the buffer, so each piece can be walked on its own.
+ */
+static void scan_lost_records(unsigned int cpu, const unsigned char *p,
+                              unsigned long size)
+{
+    const struct t_rec *rec;
+    const uint32_t *extra;
+    unsigned long off, len;
 
-fail:
-    PERROR("Failed to write trace data");
-    exit(EXIT_FAILURE);
+    for ( off = 0; off + sizeof(uint32_t) <= size; off += len )
+    {
+        rec = (const struct t_rec *)(p + off);
+        len = sizeof(uint32_t) * (1 + rec->extra_u32 +
+                                  (rec->cycles_included ? 2 : 0));
+
+        if ( rec->event != TRC_LOST_RECORDS || !rec->extra_u32 ||
+             off + len > size )
+            continue;
+
+        extra = rec->cycles_included ? rec->u.cycles.extra_u32
+                                     : rec->u.nocycles.extra_u32;
+        tb.lost[cpu] += extra[0];
+        fprintf(stderr, "CPU%u: %u records lost (%lu in total)\n",
+                cpu, extra[0], tb.lost[cpu]);
+    }
 }
 
 static void disable_tbufs(void)
@@ -626,32 +741,210 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/**
+ * consume_window - write out and consume the new records of a buffer
+ * @c:      consumer thread
+ * @i:      buffer to consume
+ */
+static void consume_window(struct consumer *c, unsigned int i)
+{
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+    unsigned long data_size = tb.data_size;
+    struct iovec iov[3];
+    int nr;
+
+    /* Read window information only once. */
+    cons = tb.meta[i]->cons;
+    prod = tb.meta[i]->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = prod % data_size;
+
+    iov[1].iov_base = tb.data[i] + start_offset;
+    if ( end_offset > start_offset )
+    {
+        /* If window does not wrap, write in one big chunk */
+        iov[1].iov_len = window_size;
+        nr = 2;
+    }
+    else
+    {
+        /* If wrapped, write in two chunks:
+         * - first, start to the end of the buffer
+         * - second, start of buffer to end of window
+         */
+        iov[1].iov_len = data_size - start_offset;
+        iov[2].iov_base = tb.data[i];
+        iov[2].iov_len = end_offset;
+        nr = 3;
+    }
+
+    if ( opts.report_lost )
+    {
+        scan_lost_records(i, iov[1].iov_base, iov[1].iov_len);
+        if ( nr == 3 )
+            scan_lost_records(i, iov[2].iov_base, iov[2].iov_len);
+    }
+
+    write_window(c, i, iov, nr);
+
+    xen_mb(); /* read buffer, then update cons. */
+    tb.meta[i]->cons = prod;
+}
+
+static void consume_buffers(struct consumer *c)
+{
+    unsigned int i;
+
+    for ( i = c->first; i < tb.num; i += opts.threads )
+        consume_window(c, i);
+}
+
+static void *consumer_thread(void *arg)
+{
+    struct consumer *c = arg;
+
+    for ( ; ; )
+    {
+        pthread_barrier_wait(&poll_start);
+        if ( consumers_exit )
+            break;
+        consume_buffers(c);
+        pthread_barrier_wait(&poll_done);
+    }
+
+    return NULL;
+}
+
+/**
+ * start_consumers - set up the consumer threads
+ *
+ * Signals are blocked in all but the main thread, so that they interrupt
+ * its wait for VIRQ_TBUF.
+ */
+static struct consumer *start_consumers(void)
+{
+    struct consumer *consumers;
+    sigset_t all, old;
+    unsigned int i;
+
+    if ( opts.threads > tb.num )
+        opts.threads = tb.num;
+
+    consumers = calloc(opts.threads, sizeof(*consumers));
+    if ( consumers == NULL )
+    {
+        PERROR("Failed to allocate consumer threads");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( pthread_barrier_init(&poll_start, NULL, opts.threads) ||
+         pthread_barrier_init(&poll_done, NULL, opts.threads) )
+    {
+        PERROR("Failed to initialise consumer threads");
+        exit(EXIT_FAILURE);
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for ( i = 0; i < opts.threads; i++ )
+    {
+        consumers[i].first = i;
+
+#ifdef HAVE_LZ4
+        if ( opts.compress )
+        {
+            /* Room for a whole window, fed in up to three pieces. */
+            consumers[i].zbuf_size =
+                LZ4F_compressFrameBound(tb.data_size, NULL) +
+                3 * LZ4F_compressBound(0, NULL) +
+                sizeof(struct cpu_change_record) + 64;
+            consumers[i].zbuf = malloc(consumers[i].zbuf_size);
+            if ( consumers[i].zbuf == NULL ||
+                 LZ4F_isError(LZ4F_createCompressionContext(
+                                  &consumers[i].lz4, LZ4F_VERSION)) )
+            {
+                fprintf(stderr, "Failed to set up LZ4 compression\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+#endif
+
+        if ( i != 0 &&
+             pthread_create(&consumers[i].thread, NULL, consumer_thread,
+                            &consumers[i]) )
+        {
+            PERROR("Failed to start consumer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return consumers;
+}
+
+static void stop_consumers(struct consumer *consumers)
+{
+    unsigned int i;
+
+    consumers_exit = 1;
+    pthread_barrier_wait(&poll_start);
+
+    for ( i = 0; i < opts.threads; i++ )
+    {
+        if ( i != 0 )
+            pthread_join(consumers[i].thread, NULL);
+#ifdef HAVE_LZ4
+        if ( opts.compress )
+        {
+            LZ4F_freeCompressionContext(consumers[i].lz4);
+            free(consumers[i].zbuf);
+        }
+#endif
+    }
+
+    free(consumers);
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
  */
 static int monitor_tbufs(void)
 {
-    int i;
+    unsigned int i;
 
     struct t_struct *tbufs;      /* Pointer to hypervisor maps */
-    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
+    struct consumer *consumers;
     unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
-    unsigned int  num;           /* number of trace buffers / logical CPUS   */
     unsigned long tinfo_size;    /* size of t_info metadata map */
     unsigned long size;          /* size of a single trace buffer            */
 
-    unsigned long data_size;
-
     int last_read = 1;
 
     /* prepare to listen for VIRQ_TBUF */
     event_init();
 
     /* get number of logical CPUs (and therefore number of trace buffers) */
-    num = get_num_cpus();
+    tb.num = get_num_cpus();
 
     /* setup access to trace buffers */
     get_tbufs(&tbufs_mfn, &tinfo_size);
@@ -659,74 +952,34 @@ static int monitor_tbufs(void)
     if ( opts.start_disabled )
         disable_tbufs();
     
-    tbufs = map_tbufs(tbufs_mfn, num, tinfo_size);
+    tbufs = map_tbufs(tbufs_mfn, tb.num, tinfo_size);
 
     size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
 
-    data_size = size - sizeof(struct t_buf);
+    tb.data_size = size - sizeof(struct t_buf);
 
-    meta = tbufs->meta;
-    data = tbufs->data;
+    tb.meta = tbufs->meta;
+    tb.data = tbufs->data;
+
+    tb.lost = calloc(tb.num, sizeof(*tb.lost));
+    if ( tb.lost == NULL )
+    {
+        PERROR("Failed to allocate memory for lost record counts");
+        exit(EXIT_FAILURE);
+    }
 
     if ( opts.discard )
-        for ( i = 0; i < num; i++ )
-            meta[i]->cons = meta[i]->prod;
+        for ( i = 0; i < tb.num; i++ )
+            tb.meta[i]->cons = tb.meta[i]->prod;
+
+    consumers = start_consumers();
 
     /* now, scan buffers for events */
     while ( 1 )
     {
-        for ( i = 0; i < num; i++ )
-        {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
-
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
-        }
+        pthread_barrier_wait(&poll_start);
+        consume_buffers(&consumers[0]);
+        pthread_barrier_wait(&poll_done);
 
         if ( interrupted )
         {
@@ -745,12 +998,20 @@ static int monitor_tbufs(void)
         wait_for_event_or_timeout(opts.poll_sleep);
     }
 
+    stop_consumers(consumers);
+
     if ( opts.memory_buffer )
         membuf_dump();
 
+    if ( opts.report_lost )
+        for ( i = 0; i < tb.num; i++ )
+            if ( tb.lost[i] )
+                fprintf(stderr, "CPU%u: %lu records lost\n", i, tb.lost[i]);
+
     /* cleanup */
-    free(meta);
-    free(data);
+    free(tb.lost);
+    free(tb.meta);
+    free(tb.data);
     /* don't need to munmap - cleanup is automatic */
     close(outfd);
 
@@ -802,6 +1063,12 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -j, --threads=n         Write the trace buffers out from n threads, each\n" \
+"                          looking after its share of the CPUs (default 1).\n" \
+"  -z, --compress          Compress the output into LZ4 frames, one for each\n" \
+"                          window of a trace buffer; read it with lz4 -d.\n" \
+"  -l, --report-lost       Report records lost by Xen, for each CPU, as they\n" \
+"                          are found, and in total on exit.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -922,12 +1189,15 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "threads",        required_argument, 0, 'j' },
+        { "compress",       no_argument,       0, 'z' },
+        { "report-lost",    no_argument,       0, 'l' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:j:zlDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -977,6 +1247,25 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'j':
+            opts.threads = argtol(optarg, 0);
+            if ( opts.threads == 0 )
+                usage();
+            break;
+
+        case 'z':
+#ifdef HAVE_LZ4
+            opts.compress = 1;
+#else
+            fprintf(stderr, "xentrace was built without LZ4 support.\n");
+            exit(EXIT_FAILURE);
+#endif
+            break;
+
+        case 'l':
+            opts.report_lost = 1;
+            break;
+
         default:
             usage();
         }
@@ -1007,9 +1296,16 @@ int main(int argc, char **argv)
     opts.disable_tracing = 1;
     opts.start_disabled = 0;
     opts.timeout = 0;
+    opts.threads = 1;
 
     parse_args(argc, argv);
 
+    if ( opts.compress && opts.memory_buffer )
+    {
+        fprintf(stderr, "Cannot compress into a memory buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+
     xc_handle = xc_interface_open(0,0,0);
     if ( !xc_handle ) 
     {
@@ -1045,6 +1341,8 @@ int main(int argc, char **argv)
 
     if ( opts.memory_buffer > 0 )
         membuf_alloc(opts.memory_buffer);
+    else
+        out_offset = lseek(outfd, 0, SEEK_CUR);
 
     /* ensure that if we get a signal, we'll do cleanup, then exit */
     act.sa_handler = close_handler;
@@ -268,6 +268,7 @@ void __cpuinit identify_cpu(struct cpuinfo_x86 *c)
 	c->phys_proc_id = BAD_APICID;
 	c->cpu_core_id = BAD_APICID;
 	c->compute_unit_id = BAD_APICID;
+	c->cpu_llc_id = BAD_APICID;
 	memset(&c->x86_capability, 0, sizeof c->x86_capability);
 
 	generic_identify(c);
@@ -303,6 +304,10 @@ void __cpuinit identify_cpu(struct cpuinfo_x86 *c)
 	if (this_cpu->c_init)
 		this_cpu->c_init(c);
 
+	/* Without better information, assume one last level cache per socket. */
+	if (c->cpu_llc_id == BAD_APICID)
+		c->cpu_llc_id = c->phys_proc_id;
+
         /* Initialize xsave/xrstor features */
 	if ( !use_xsave )
 		clear_bit(X86_FEATURE_XSAVE, boot_cpu_data.x86_capability);
@@ -197,7 +197,6 @@ static void __devinit init_intel(struct cpuinfo_x86 *c)
 	detect_extended_topology(c);
 
 	select_idle_routine(c);
-	l2 = init_intel_cacheinfo(c);
 	if (c->cpuid_level > 9) {
 		unsigned eax = cpuid_eax(10);
 		/* Check for version and the number of counters */
@@ -211,6 +210,9 @@ static void __devinit init_intel(struct cpuinfo_x86 *c)
 		detect_ht(c);
 	}
 
+	/* After topology detection: the cache IDs are derived from the APIC ID. */
+	l2 = init_intel_cacheinfo(c);
+
 	if (c == &boot_cpu_data && c->x86 == 6) {
 		if (probe_intel_cpuid_faulting())
 			set_bit(X86_FEATURE_CPUID_FAULTING, c->x86_capability);
@@ -217,6 +217,11 @@ unsigned int __cpuinit init_intel_cacheinfo(struct cpuinfo_x86 *c)
 				}
 			}
 		}
+
+		if (new_l3)
+			c->cpu_llc_id = l3_id;
+		else if (new_l2)
+			c->cpu_llc_id = l2_id;
 	}
 	/*
 	 * Don't use cpuid2 if cpuid4 is supported. For P4, we use cpuid2 for
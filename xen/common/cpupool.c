@@ -667,6 +667,8 @@ void dump_runq(unsigned char key)
         schedule_dump(*c);
     }
 
+    sched_core_dump();
+
     local_irq_restore(flags);
     spin_unlock(&cpupool_lock);
 }
@@ -141,12 +141,42 @@ struct active_grant_entry {
                                in the page.                           */
     unsigned      length:16; /* For sub-page grants, the length of the
                                 grant.                                */
+    spinlock_t    lock;      /* Lock protecting updates to this entry. */
 };
 
 #define ACGNT_PER_PAGE (PAGE_SIZE / sizeof(struct active_grant_entry))
-#define active_entry(t, e) \
+#define _active_entry(t, e) \
     ((t)->active[(e)/ACGNT_PER_PAGE][(e)%ACGNT_PER_PAGE])
 
+/* Caller must hold the table lock, for reading at least. */
+static inline struct active_grant_entry *
+active_entry_acquire(struct grant_table *t, grant_ref_t e)
+{
+    struct active_grant_entry *act;
+
+    ASSERT(rw_is_locked(&t->lock));
+
+    act = &_active_entry(t, e);
+    spin_lock(&act->lock);
+
+    return act;
+}
+
+static inline void active_entry_release(struct active_grant_entry *act)
+{
+    spin_unlock(&act->lock);
+}
+
+static inline void
+active_entry_init_frame(struct active_grant_entry *act)
+{
+    unsigned int i;
+
+    clear_page(act);
+    for ( i = 0; i < ACGNT_PER_PAGE; i++ )
+        spin_lock_init(&act[i].lock);
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -206,63 +236,82 @@ static int __get_paged_frame(unsigned long gfn, unsigned long *frame, struct pag
     return rc;
 }
 
+/*
+ * Only needed to keep the IOMMU in step with the maptrack (see
+ * mapcount()), which walks both tables without the active entry locks.
+ */
 static inline void
 double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
 {
     if ( lgt < rgt )
     {
-        spin_lock(&lgt->lock);
-        spin_lock(&rgt->lock);
+        write_lock(&lgt->lock);
+        write_lock(&rgt->lock);
     }
     else
     {
         if ( lgt != rgt )
-            spin_lock(&rgt->lock);
-        spin_lock(&lgt->lock);
+            write_lock(&rgt->lock);
+        write_lock(&lgt->lock);
     }
 }
 
 static inline void
 double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 {
-    spin_unlock(&lgt->lock);
+    write_unlock(&lgt->lock);
     if ( lgt != rgt )
-        spin_unlock(&rgt->lock);
+        write_unlock(&rgt->lock);
 }
 
-static inline int
-__get_maptrack_handle(
-    struct grant_table *t)
-{
-    unsigned int h;
-    if ( unlikely((h = t->maptrack_head) == MAPTRACK_TAIL) )
-        return -1;
-    t->maptrack_head = maptrack_entry(t, h).ref;
-    return h;
-}
+/*
+ * Free maptrack handles live on lists threaded through the ref field of
+ * the free entries: one per grant table, fed by maptrack growth, and a
+ * small cache on each vCPU of the owning domain.  A vCPU takes handles
+ * from and returns them to its own cache, and only moves them to or from
+ * the table-wide list a batch at a time.  Once the maptrack is at its
+ * limit, a vCPU with an empty cache steals from the other vCPUs.  The
+ * table and vCPU maptrack locks are never held together.
+ */
+#define MAPTRACK_BATCH 32
 
-static inline void
-put_maptrack_handle(
-    struct grant_table *t, int handle)
+/*
+ * Detach up to @nr handles from the front of the list at @head.  Returns
+ * how many were detached; @first and @last delimit them.
+ */
+static unsigned int
+maptrack_take(
+    struct grant_table *t, unsigned int *head, unsigned int nr,
+    unsigned int *first, unsigned int *last)
 {
-    spin_lock(&t->lock);
-    maptrack_entry(t, handle).ref = t->maptrack_head;
-    t->maptrack_head = handle;
-    spin_unlock(&t->lock);
+    unsigned int h, n;
+
+    if ( (h = *head) == MAPTRACK_TAIL )
+        return 0;
+
+    *first = h;
+    for ( n = 1; n < nr && maptrack_entry(t, h).ref != MAPTRACK_TAIL; n++ )
+        h = maptrack_entry(t, h).ref;
+
+    *head = maptrack_entry(t, h).ref;
+    maptrack_entry(t, h).ref = MAPTRACK_TAIL;
+    *last = h;
+
+    return n;
 }
 
-static inline int
-get_maptrack_handle(
-    struct grant_table *lgt)
+/* Take a batch from the table-wide list, growing the maptrack if needed. */
+static unsigned int
+maptrack_refill(
+    struct grant_table *lgt, unsigned int *first, unsigned int *last)
 {
     int                   i;
-    grant_handle_t        handle;
     struct grant_mapping *new_mt;
-    unsigned int          new_mt_limit, nr_frames;
+    unsigned int          new_mt_limit, nr_frames, n;
 
-    spin_lock(&lgt->lock);
+    spin_lock(&lgt->maptrack_lock);
 
-    while ( unlikely((handle = __get_maptrack_handle(lgt)) == -1) )
+    while ( unlikely(lgt->maptrack_head == MAPTRACK_TAIL) )
     {
         nr_frames = nr_maptrack_frames(lgt);
         if ( nr_frames >= max_nr_maptrack_frames() )
@@ -289,9 +338,104 @@ get_maptrack_handle(
                  nr_frames + 1);
     }
 
-    spin_unlock(&lgt->lock);
+    n = maptrack_take(lgt, &lgt->maptrack_head, MAPTRACK_BATCH, first, last);
+
+    spin_unlock(&lgt->maptrack_lock);
+
+    return n;
+}
+
+/* Take half of the first non-empty cache of another vCPU. */
+static unsigned int
+maptrack_steal(
+    struct grant_table *lgt, struct vcpu *curr,
+    unsigned int *first, unsigned int *last)
+{
+    struct domain *d = curr->domain;
+    struct vcpu   *v;
+    unsigned int   i, n = 0;
+
+    for ( i = 1; i < d->max_vcpus && !n; i++ )
+    {
+        v = d->vcpu[(curr->vcpu_id + i) % d->max_vcpus];
+        if ( v == NULL )
+            continue;
 
-    return handle;
+        spin_lock(&v->maptrack_lock);
+        n = maptrack_take(lgt, &v->maptrack_head,
+                          (v->maptrack_count + 1) / 2, first, last);
+        v->maptrack_count -= n;
+        spin_unlock(&v->maptrack_lock);
+    }
+
+    return n;
+}
+
+static inline void
+put_maptrack_handle(
+    struct grant_table *t, int handle)
+{
+    struct vcpu  *curr = current;
+    unsigned int  first, last, n = 0;
+
+    ASSERT(curr->domain->grant_table == t);
+
+    spin_lock(&curr->maptrack_lock);
+    maptrack_entry(t, handle).ref = curr->maptrack_head;
+    curr->maptrack_head = handle;
+    if ( ++curr->maptrack_count > 2 * MAPTRACK_BATCH )
+    {
+        n = maptrack_take(t, &curr->maptrack_head, MAPTRACK_BATCH,
+                          &first, &last);
+        curr->maptrack_count -= n;
+    }
+    spin_unlock(&curr->maptrack_lock);
+
+    if ( n )
+    {
+        spin_lock(&t->maptrack_lock);
+        maptrack_entry(t, last).ref = t->maptrack_head;
+        t->maptrack_head = first;
+        spin_unlock(&t->maptrack_lock);
+    }
+}
+
+static inline int
+get_maptrack_handle(
+    struct grant_table *lgt)
+{
+    struct vcpu  *curr = current;
+    unsigned int  handle, first, last, n;
+
+    ASSERT(curr->domain->grant_table == lgt);
+
+    spin_lock(&curr->maptrack_lock);
+    if ( likely((handle = curr->maptrack_head) != MAPTRACK_TAIL) )
+    {
+        curr->maptrack_head = maptrack_entry(lgt, handle).ref;
+        curr->maptrack_count--;
+        spin_unlock(&curr->maptrack_lock);
+        return handle;
+    }
+    spin_unlock(&curr->maptrack_lock);
+
+    n = maptrack_refill(lgt, &first, &last);
+    if ( unlikely(n == 0) )
+        n = maptrack_steal(lgt, curr, &first, &last);
+    if ( unlikely(n == 0) )
+        return -1;
+
+    /* Hand out the first handle of the batch and cache the rest. */
+    if ( n > 1 )
+    {
+        spin_lock(&curr->maptrack_lock);
+        maptrack_entry(lgt, last).ref = curr->maptrack_head;
+        curr->maptrack_head = maptrack_entry(lgt, first).ref;
+        curr->maptrack_count += n - 1;
+        spin_unlock(&curr->maptrack_lock);
+    }
+
+    return first;
 }
 
 /* Number of grant table entries. Caller must hold d's grant table lock. */
@@ -478,6 +622,10 @@ static int _set_status(unsigned gt_version,
         return _set_status_v2(domid, readonly, mapflag, shah, act, status);
 }
 
+/*
+ * Count the mappings of @mfn granted by @rd.  Both grant tables must be
+ * write-locked: the active entries are read without their own locks.
+ */
 static void mapcount(
     struct grant_table *lgt, struct domain *rd, unsigned long mfn,
     unsigned int *wrc, unsigned int *rdc)
@@ -485,6 +633,9 @@ static void mapcount(
     struct grant_mapping *map;
     grant_handle_t handle;
 
+    ASSERT(rw_is_write_locked(&lgt->lock));
+    ASSERT(rw_is_write_locked(&rd->grant_table->lock));
+
     *wrc = *rdc = 0;
 
     for ( handle = 0; handle < lgt->maptrack_limit; handle++ )
@@ -493,7 +644,7 @@ static void mapcount(
         if ( !(map->flags & (GNTMAP_device_map|GNTMAP_host_map)) ||
              map->domid != rd->domain_id )
             continue;
-        if ( active_entry(rd->grant_table, map->ref).frame == mfn )
+        if ( _active_entry(rd->grant_table, map->ref).frame == mfn )
             (map->flags & GNTMAP_readonly) ? (*rdc)++ : (*wrc)++;
     }
 }
@@ -525,6 +676,7 @@ __gnttab_map_grant_ref(
     grant_entry_v2_t *sha2;
     grant_entry_header_t *shah;
     uint16_t *status;
+    bool_t         need_iommu_map;
 
     led = current;
     ld = led->domain;
@@ -570,7 +722,7 @@ __gnttab_map_grant_ref(
     }
 
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -580,7 +732,7 @@ __gnttab_map_grant_ref(
     if ( unlikely(op->ref >= nr_grant_entries(rgt)))
         PIN_FAIL(unlock_out, GNTST_bad_gntref, "Bad ref (%d).\n", op->ref);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
     shah = shared_entry_header(rgt, op->ref);
     if (rgt->gt_version == 1) {
         sha1 = &shared_entry_v1(rgt, op->ref);
@@ -597,7 +749,7 @@ __gnttab_map_grant_ref(
          ((act->domid != ld->domain_id) ||
           (act->pin & 0x80808080U) != 0 ||
           (act->is_sub_page)) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d\n",
                  act->domid, ld->domain_id, act->pin, act->is_sub_page);
 
@@ -608,7 +760,7 @@ __gnttab_map_grant_ref(
         if ( (rc = _set_status(rgt->gt_version, ld->domain_id,
                                op->flags & GNTMAP_readonly,
                                1, shah, act, status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         if ( !act->pin )
         {
@@ -643,7 +795,8 @@ __gnttab_map_grant_ref(
 
     cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     /* pg may be set, with a refcount included, from __get_paged_frame */
     if ( !pg )
@@ -719,12 +872,14 @@ __gnttab_map_grant_ref(
         goto undo_out;
     }
 
-    double_gt_lock(lgt, rgt);
-
-    if ( is_pv_domain(ld) && need_iommu(ld) )
+    need_iommu_map = is_pv_domain(ld) && need_iommu(ld);
+    if ( need_iommu_map )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
+        double_gt_lock(lgt, rgt);
+
         /* Shouldn't happen, because you can't use iommu in a HVM domain. */
         BUG_ON(paging_mode_translate(ld));
         /* We're not translated, so we know that gmfns and mfns are
@@ -752,12 +907,19 @@ __gnttab_map_grant_ref(
 
     TRACE_1D(TRC_MEM_PAGE_GRANT_MAP, op->dom);
 
+    /*
+     * Unmap looks at the flags before anything else, so publish them
+     * last.  The table locks are only held here if mapcount() may be
+     * walking the maptrack.
+     */
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
-    mt->flags = op->flags;
+    wmb();
+    write_atomic(&mt->flags, op->flags);
 
-    double_gt_unlock(lgt, rgt);
+    if ( need_iommu_map )
+        double_gt_unlock(lgt, rgt);
 
     op->dev_bus_addr = (u64)frame << PAGE_SHIFT;
     op->handle       = handle;
@@ -780,9 +942,9 @@ __gnttab_map_grant_ref(
         put_page(pg);
     }
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
 
     if ( op->flags & GNTMAP_device_map )
         act->pin -= (op->flags & GNTMAP_readonly) ?
@@ -799,8 +961,11 @@ __gnttab_map_grant_ref(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     op->status = rc;
     put_maptrack_handle(lgt, handle);
     rcu_unlock_domain(rd);
@@ -835,6 +1000,7 @@ __gnttab_unmap_common(
     struct domain   *ld, *rd;
     struct grant_table *lgt, *rgt;
     struct active_grant_entry *act;
+    grant_ref_t      ref;
     s16              rc = 0;
 
     ld = current->domain;
@@ -850,18 +1016,15 @@ __gnttab_unmap_common(
     }
 
     op->map = &maptrack_entry(lgt, op->handle);
-    spin_lock(&lgt->lock);
 
-    if ( unlikely(!op->map->flags) )
+    if ( unlikely(!read_atomic(&op->map->flags)) )
     {
-        spin_unlock(&lgt->lock);
         gdprintk(XENLOG_INFO, "Zero flags for handle (%d).\n", op->handle);
         op->status = GNTST_bad_handle;
         return;
     }
 
     dom = op->map->domid;
-    spin_unlock(&lgt->lock);
 
     if ( unlikely((rd = rcu_lock_domain_by_id(dom)) == NULL) )
     {
@@ -882,18 +1045,35 @@ __gnttab_unmap_common(
     TRACE_1D(TRC_MEM_PAGE_GRANT_UNMAP, dom);
 
     rgt = rd->grant_table;
-    double_gt_lock(lgt, rgt);
+    read_lock(&rgt->lock);
 
-    op->flags = op->map->flags;
-    if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) )
+    /*
+     * The handle is only stable once the active entry it names is locked:
+     * re-read everything under that lock and give up if another vCPU got
+     * to the handle first.
+     */
+    ref = op->map->ref;
+    if ( unlikely(rgt->gt_version == 0) ||
+         unlikely(ref >= nr_grant_entries(rgt)) )
     {
         gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
         rc = GNTST_bad_handle;
         goto unmap_out;
     }
 
+    act = active_entry_acquire(rgt, ref);
+
+    op->flags = read_atomic(&op->map->flags);
+    smp_rmb();
+    if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) ||
+         unlikely(op->map->ref != ref) )
+    {
+        gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
+        rc = GNTST_bad_handle;
+        goto act_release_out;
+    }
+
     op->rd = rd;
-    act = &active_entry(rgt, op->map->ref);
 
     if ( op->frame == 0 )
     {
@@ -902,7 +1082,7 @@ __gnttab_unmap_common(
     else
     {
         if ( unlikely(op->frame != act->frame) )
-            PIN_FAIL(unmap_out, GNTST_general_error,
+            PIN_FAIL(act_release_out, GNTST_general_error,
                      "Bad frame number doesn't match gntref. (%lx != %lx)\n",
                      op->frame, act->frame);
         if ( op->flags & GNTMAP_device_map )
@@ -921,7 +1101,7 @@ __gnttab_unmap_common(
         if ( (rc = replace_grant_host_mapping(op->host_addr,
                                               op->frame, op->new_addr, 
                                               op->flags)) < 0 )
-            goto unmap_out;
+            goto act_release_out;
 
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
@@ -931,29 +1111,34 @@ __gnttab_unmap_common(
             act->pin -= GNTPIN_hstw_inc;
     }
 
-    if ( is_pv_domain(ld) && need_iommu(ld) )
+ act_release_out:
+    active_entry_release(act);
+ unmap_out:
+    read_unlock(&rgt->lock);
+
+    if ( rc == GNTST_okay && is_pv_domain(ld) && need_iommu(ld) )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
         BUG_ON(paging_mode_translate(ld));
+
+        double_gt_lock(lgt, rgt);
         mapcount(lgt, rd, op->frame, &wrc, &rdc);
         if ( (wrc + rdc) == 0 )
             err = iommu_unmap_page(ld, op->frame);
         else if ( wrc == 0 )
             err = iommu_map_page(ld, op->frame, op->frame, IOMMUF_readable);
+        double_gt_unlock(lgt, rgt);
+
         if ( err )
-        {
             rc = GNTST_general_error;
-            goto unmap_out;
-        }
     }
 
     /* If just unmapped a writable mapping, mark as dirtied */
-    if ( !(op->flags & GNTMAP_readonly) )
+    if ( rc == GNTST_okay && !(op->flags & GNTMAP_readonly) )
          gnttab_mark_dirty(rd, op->frame);
 
- unmap_out:
-    double_gt_unlock(lgt, rgt);
     op->status = rc;
     rcu_unlock_domain(rd);
 }
@@ -983,12 +1168,12 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
 
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
-        goto unmap_out;
+        goto unlock_out;
 
-    act = &active_entry(rgt, op->map->ref);
+    act = active_entry_acquire(rgt, op->map->ref);
     sha = shared_entry_header(rgt, op->map->ref);
 
     if ( rgt->gt_version == 1 )
@@ -1002,7 +1187,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
          * Suggests that __gntab_unmap_common failed early and so
          * nothing further to do
          */
-        goto unmap_out;
+        goto act_release_out;
     }
 
     pg = mfn_to_page(op->frame);
@@ -1026,7 +1211,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
              * Suggests that __gntab_unmap_common failed in
              * replace_grant_host_mapping() so nothing further to do
              */
-            goto unmap_out;
+            goto act_release_out;
         }
 
         if ( !is_iomem_page(op->frame) ) 
@@ -1047,8 +1232,11 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
     if ( act->pin == 0 )
         gnttab_clear_flag(_GTF_reading, status);
 
- unmap_out:
-    spin_unlock(&rgt->lock);
+ act_release_out:
+    active_entry_release(act);
+ unlock_out:
+    read_unlock(&rgt->lock);
+
     if ( put_handle )
     {
         op->map->flags = 0;
@@ -1237,11 +1425,12 @@ gnttab_unpopulate_status_frames(struct domain *d, struct grant_table *gt)
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
 {
-    /* d's grant table lock must be held by the caller */
+    /* d's grant table write lock must be held by the caller */
 
     struct grant_table *gt = d->grant_table;
     unsigned int i;
 
+    ASSERT(rw_is_write_locked(&gt->lock));
     ASSERT(req_nr_frames <= max_nr_grant_frames);
 
     gdprintk(XENLOG_INFO,
@@ -1254,7 +1443,7 @@ gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
     {
         if ( (gt->active[i] = alloc_xenheap_page()) == NULL )
             goto active_alloc_failed;
-        clear_page(gt->active[i]);
+        active_entry_init_frame(gt->active[i]);
     }
 
     /* Shared */
@@ -1342,7 +1531,7 @@ gnttab_setup_table(
     }
 
     gt = d->grant_table;
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         gt->gt_version = 1;
@@ -1370,7 +1559,7 @@ gnttab_setup_table(
     }
 
  out3:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
  out2:
     rcu_unlock_domain(d);
  out1:
@@ -1412,13 +1601,13 @@ gnttab_query_size(
         goto query_out_unlock;
     }
 
-    spin_lock(&d->grant_table->lock);
+    read_lock(&d->grant_table->lock);
 
     op.nr_frames     = nr_grant_frames(d->grant_table);
     op.max_nr_frames = max_nr_grant_frames;
     op.status        = GNTST_okay;
 
-    spin_unlock(&d->grant_table->lock);
+    read_unlock(&d->grant_table->lock);
 
  
  query_out_unlock:
@@ -1444,7 +1633,7 @@ gnttab_prepare_for_transfer(
     union grant_combo   scombo, prev_scombo, new_scombo;
     int                 retries = 0;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
     {
@@ -1495,11 +1684,11 @@ gnttab_prepare_for_transfer(
         scombo = prev_scombo;
     }
 
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 1;
 
  fail:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 0;
 }
 
@@ -1510,6 +1699,7 @@ gnttab_transfer(
     struct domain *d = current->domain;
     struct domain *e;
     struct page_info *page;
+    struct active_grant_entry *act;
     int i;
     struct gnttab_transfer gop;
     unsigned long mfn;
@@ -1691,7 +1881,8 @@ gnttab_transfer(
         TRACE_1D(TRC_MEM_PAGE_GRANT_TRANSFER, e->domain_id);
 
         /* Tell the guest about its new page frame. */
-        spin_lock(&e->grant_table->lock);
+        read_lock(&e->grant_table->lock);
+        act = active_entry_acquire(e->grant_table, gop.ref);
 
         if ( e->grant_table->gt_version == 1 )
         {
@@ -1709,7 +1900,8 @@ gnttab_transfer(
         shared_entry_header(e->grant_table, gop.ref)->flags |=
             GTF_transfer_completed;
 
-        spin_unlock(&e->grant_table->lock);
+        active_entry_release(act);
+        read_unlock(&e->grant_table->lock);
 
         rcu_unlock_domain(e);
 
@@ -1747,9 +1939,9 @@ __release_grant_for_copy(
     released_read = 0;
     released_write = 0;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     sha = shared_entry_header(rgt, gref);
     r_frame = act->frame;
 
@@ -1788,7 +1980,8 @@ __release_grant_for_copy(
         released_read = 1;
     }
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     if ( td != rd )
     {
@@ -1805,7 +1998,7 @@ __release_grant_for_copy(
 
 /* The status for a grant indicates that we're taking more access than
    the pin requires.  Fix up the status to match the pin.  Called
-   under the domain's grant table lock. */
+   under the active entry's lock. */
 /* Only safe on transitive grants.  Even then, note that we don't
    attempt to drop any pin on the referent grant. */
 static void __fixup_status_for_copy_pin(const struct active_grant_entry *act,
@@ -1846,7 +2039,7 @@ __acquire_grant_for_copy(
 
     *page = NULL;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -1856,7 +2049,7 @@ __acquire_grant_for_copy(
         PIN_FAIL(unlock_out, GNTST_bad_gntref,
                  "Bad grant reference %ld\n", gref);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     shah = shared_entry_header(rgt, gref);
     if ( rgt->gt_version == 1 )
     {
@@ -1873,7 +2066,7 @@ __acquire_grant_for_copy(
 
     /* If already pinned, check the active domid and avoid refcnt overflow. */
     if ( act->pin && ((act->domid != ldom) || (act->pin & 0x80808080U) != 0) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x\n",
                  act->domid, ldom, act->pin);
 
@@ -1884,7 +2077,7 @@ __acquire_grant_for_copy(
         if ( (rc = _set_status(rgt->gt_version, ldom,
                                readonly, 0, shah, act,
                                status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         td = rd;
         trans_gref = gref;
@@ -1915,17 +2108,21 @@ __acquire_grant_for_copy(
                 PIN_FAIL(unlock_out_clear, GNTST_general_error,
                          "transitive grant referenced bad domain %d\n",
                          trans_domid);
-            spin_unlock(&rgt->lock);
+            active_entry_release(act);
+            read_unlock(&rgt->lock);
 
             rc = __acquire_grant_for_copy(td, trans_gref, rd->domain_id,
                                           readonly, &grant_frame, page,
                                           &trans_page_off, &trans_length, 0);
 
-            spin_lock(&rgt->lock);
+            read_lock(&rgt->lock);
+            act = active_entry_acquire(rgt, gref);
+
             if ( rc != GNTST_okay ) {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 return rc;
             }
 
@@ -1937,7 +2134,8 @@ __acquire_grant_for_copy(
             {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 put_page(*page);
                 return __acquire_grant_for_copy(rd, gref, ldom, readonly,
                                                 frame, page, page_off, length,
@@ -2005,7 +2203,8 @@ __acquire_grant_for_copy(
     *length = act->length;
     *frame = act->frame;
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
     return rc;
  
  unlock_out_clear:
@@ -2016,136 +2215,228 @@ __acquire_grant_for_copy(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return rc;
 }
 
+/*
+ * One side of a grant copy.  A batch keeps the frame acquired for the
+ * previous op and reuses it as long as consecutive ops name the same
+ * domain and grant (or gmfn), which is what netback RX does when it
+ * fills a guest buffer from several packet fragments.
+ */
+struct gnttab_copy_buf {
+    /* As named by the guest. */
+    domid_t           domid;
+    bool_t            is_gref;
+    unsigned long     ref;          /* grant reference or gmfn */
+    bool_t            read_only;
+
+    /* What has been acquired for it. */
+    struct domain    *domain;
+    unsigned long     frame;
+    struct page_info *page;
+    void             *virt;
+    unsigned int      off, len;     /* accessible part of the frame */
+    bool_t            have_grant;
+    bool_t            have_type;
+};
+
+/* Drop the frame held by @buf, keeping its domain. */
 static void
-__gnttab_copy(
-    struct gnttab_copy *op)
+gnttab_copy_put_frame(struct gnttab_copy_buf *buf)
 {
-    struct domain *sd = NULL, *dd = NULL;
-    unsigned long s_frame, d_frame;
-    struct page_info *s_pg = NULL, *d_pg = NULL;
-    char *sp, *dp;
-    s16 rc = GNTST_okay;
-    int have_d_grant = 0, have_s_grant = 0;
-    int src_is_gref, dest_is_gref;
+    if ( buf->virt )
+    {
+        unmap_domain_page(buf->virt);
+        buf->virt = NULL;
+    }
+    if ( buf->have_type )
+    {
+        put_page_type(buf->page);
+        buf->have_type = 0;
+    }
+    if ( buf->page )
+    {
+        put_page(buf->page);
+        buf->page = NULL;
+    }
+    if ( buf->have_grant )
+    {
+        __release_grant_for_copy(buf->domain, buf->ref, buf->read_only);
+        buf->have_grant = 0;
+    }
+}
 
-    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
-         ((op->dest.offset + op->len) > PAGE_SIZE) )
-        PIN_FAIL(error_out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+static void
+gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
+{
+    gnttab_copy_put_frame(buf);
+    if ( buf->domain )
+    {
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
+    }
+}
 
-    src_is_gref = op->flags & GNTCOPY_source_gref;
-    dest_is_gref = op->flags & GNTCOPY_dest_gref;
+static int
+gnttab_copy_buf_valid(
+    const struct gnttab_copy_buf *buf, domid_t domid, bool_t is_gref,
+    unsigned long ref)
+{
+    return buf->virt && buf->domid == domid && buf->is_gref == is_gref &&
+           buf->ref == ref;
+}
 
-    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
-         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
-        PIN_FAIL(error_out, GNTST_permission_denied,
-                 "only allow copy-by-mfn for DOMID_SELF.\n");
-
-    if ( op->source.domid == DOMID_SELF )
-        sd = rcu_lock_current_domain();
-    else if ( (sd = rcu_lock_domain_by_id(op->source.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->source.domid);
-
-    if ( op->dest.domid == DOMID_SELF )
-        dd = rcu_lock_current_domain();
-    else if ( (dd = rcu_lock_domain_by_id(op->dest.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->dest.domid);
-
-    rc = xsm_grant_copy(XSM_HOOK, sd, dd);
-    if ( rc )
+/* Make sure @buf holds a reference on the domain named by the op. */
+static int
+gnttab_copy_lock_domain(struct gnttab_copy_buf *buf, domid_t domid)
+{
+    if ( buf->domain && buf->domid == domid )
+        return GNTST_okay;
+
+    gnttab_copy_release_buf(buf);
+
+    if ( domid == DOMID_SELF )
+        buf->domain = rcu_lock_current_domain();
+    else if ( (buf->domain = rcu_lock_domain_by_id(domid)) == NULL )
     {
-        rc = GNTST_permission_denied;
-        goto error_out;
+        gdprintk(XENLOG_WARNING, "couldn't find %d\n", domid);
+        return GNTST_bad_domain;
     }
+    buf->domid = domid;
+
+    return GNTST_okay;
+}
 
-    if ( src_is_gref )
+/* Acquire and map the frame named by the op.  The domain must be locked. */
+static int
+gnttab_copy_claim_buf(
+    struct gnttab_copy_buf *buf, bool_t is_gref, unsigned long ref)
+{
+    int rc;
+
+    gnttab_copy_put_frame(buf);
+
+    buf->is_gref = is_gref;
+    buf->ref = ref;
+
+    if ( is_gref )
     {
-        unsigned source_off, source_len;
-        rc = __acquire_grant_for_copy(sd, op->source.u.ref,
-                                      current->domain->domain_id, 1,
-                                      &s_frame, &s_pg,
-                                      &source_off, &source_len, 1);
+        rc = __acquire_grant_for_copy(buf->domain, ref,
+                                      current->domain->domain_id,
+                                      buf->read_only, &buf->frame,
+                                      &buf->page, &buf->off, &buf->len, 1);
         if ( rc != GNTST_okay )
-            goto error_out;
-        have_s_grant = 1;
-        if ( op->source.offset < source_off ||
-             op->len > source_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy source out of bounds: %d < %d || %d > %d\n",
-                     op->source.offset, source_off,
-                     op->len, source_len);
+            return rc;
+        buf->have_grant = 1;
     }
     else
     {
-        rc = __get_paged_frame(op->source.u.gmfn, &s_frame, &s_pg, 1, sd);
+        rc = __get_paged_frame(ref, &buf->frame, &buf->page,
+                               buf->read_only, buf->domain);
         if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "source frame %lx invalid.\n", s_frame);
+        {
+            gdprintk(XENLOG_WARNING, "%s frame %lx invalid.\n",
+                     buf->read_only ? "source" : "destination", ref);
+            return rc;
+        }
+        buf->off = 0;
+        buf->len = PAGE_SIZE;
     }
 
-    if ( dest_is_gref )
+    if ( !buf->read_only )
     {
-        unsigned dest_off, dest_len;
-        rc = __acquire_grant_for_copy(dd, op->dest.u.ref,
-                                      current->domain->domain_id, 0,
-                                      &d_frame, &d_pg, &dest_off, &dest_len, 1);
-        if ( rc != GNTST_okay )
-            goto error_out;
-        have_d_grant = 1;
-        if ( op->dest.offset < dest_off ||
-             op->len > dest_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy dest out of bounds: %d < %d || %d > %d\n",
-                     op->dest.offset, dest_off,
-                     op->len, dest_len);
+        if ( !get_page_type(buf->page, PGT_writable_page) )
+        {
+            if ( !buf->domain->is_dying )
+                gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n",
+                         buf->frame);
+            return GNTST_general_error;
+        }
+        buf->have_type = 1;
     }
-    else
+
+    buf->virt = map_domain_page(buf->frame);
+
+    return GNTST_okay;
+}
+
+static int
+__gnttab_copy(
+    struct gnttab_copy *op,
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    int rc;
+    bool_t src_is_gref, dest_is_gref;
+    unsigned long src_ref, dest_ref;
+
+    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
+         ((op->dest.offset + op->len) > PAGE_SIZE) )
     {
-        rc = __get_paged_frame(op->dest.u.gmfn, &d_frame, &d_pg, 0, dd);
-        if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "destination frame %lx invalid.\n", d_frame);
+        gdprintk(XENLOG_WARNING, "copy beyond page area.\n");
+        return GNTST_bad_copy_arg;
     }
 
-    if ( !get_page_type(d_pg, PGT_writable_page) )
+    src_is_gref = !!(op->flags & GNTCOPY_source_gref);
+    dest_is_gref = !!(op->flags & GNTCOPY_dest_gref);
+
+    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
+         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
     {
-        if ( !dd->is_dying )
-            gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n", d_frame);
-        rc = GNTST_general_error;
-        goto error_out;
+        gdprintk(XENLOG_WARNING, "only allow copy-by-mfn for DOMID_SELF.\n");
+        return GNTST_permission_denied;
     }
 
-    sp = map_domain_page(s_frame);
-    dp = map_domain_page(d_frame);
+    src_ref = src_is_gref ? op->source.u.ref : op->source.u.gmfn;
+    dest_ref = dest_is_gref ? op->dest.u.ref : op->dest.u.gmfn;
 
-    memcpy(dp + op->dest.offset, sp + op->source.offset, op->len);
+    if ( (rc = gnttab_copy_lock_domain(src, op->source.domid)) != GNTST_okay ||
+         (rc = gnttab_copy_lock_domain(dest, op->dest.domid)) != GNTST_okay )
+        return rc;
 
-    unmap_domain_page(dp);
-    unmap_domain_page(sp);
+    if ( xsm_grant_copy(XSM_HOOK, src->domain, dest->domain) )
+        return GNTST_permission_denied;
 
-    gnttab_mark_dirty(dd, d_frame);
+    if ( !gnttab_copy_buf_valid(src, op->source.domid, src_is_gref, src_ref) )
+    {
+        rc = gnttab_copy_claim_buf(src, src_is_gref, src_ref);
+        if ( rc != GNTST_okay )
+            return rc;
+    }
 
-    put_page_type(d_pg);
- error_out:
-    if ( d_pg )
-        put_page(d_pg);
-    if ( s_pg )
-        put_page(s_pg);
-    if ( have_s_grant )
-        __release_grant_for_copy(sd, op->source.u.ref, 1);
-    if ( have_d_grant )
-        __release_grant_for_copy(dd, op->dest.u.ref, 0);
-    if ( sd )
-        rcu_unlock_domain(sd);
-    if ( dd )
-        rcu_unlock_domain(dd);
-    op->status = rc;
+    if ( op->source.offset < src->off || op->len > src->len )
+    {
+        gdprintk(XENLOG_WARNING,
+                 "copy source out of bounds: %d < %d || %d > %d\n",
+                 op->source.offset, src->off, op->len, src->len);
+        return GNTST_general_error;
+    }
+
+    if ( !gnttab_copy_buf_valid(dest, op->dest.domid, dest_is_gref, dest_ref) )
+    {
+        rc = gnttab_copy_claim_buf(dest, dest_is_gref, dest_ref);
+        if ( rc != GNTST_okay )
+            return rc;
+    }
+
+    if ( op->dest.offset < dest->off || op->len > dest->len )
+    {
+        gdprintk(XENLOG_WARNING,
+                 "copy dest out of bounds: %d < %d || %d > %d\n",
+                 op->dest.offset, dest->off, op->len, dest->len);
+        return GNTST_general_error;
+    }
+
+    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+           op->len);
+    gnttab_mark_dirty(dest->domain, dest->frame);
+
+    return GNTST_okay;
 }
 
 static long
@@ -2153,20 +2444,44 @@ gnttab_copy(
     XEN_GUEST_HANDLE_PARAM(gnttab_copy_t) uop, unsigned int count)
 {
     int i;
+    long rc = 0;
     struct gnttab_copy op;
+    struct gnttab_copy_buf src = { .read_only = 1 };
+    struct gnttab_copy_buf dest = { .read_only = 0 };
 
     for ( i = 0; i < count; i++ )
     {
-        if (i && hypercall_preempt_check())
-            return i;
+        if ( i && hypercall_preempt_check() )
+        {
+            rc = i;
+            break;
+        }
         if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-            return -EFAULT;
-        __gnttab_copy(&op);
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        op.status = __gnttab_copy(&op, &src, &dest);
+        if ( op.status != GNTST_okay )
+        {
+            /* Don't carry a half-acquired buffer into the next op. */
+            gnttab_copy_release_buf(&src);
+            gnttab_copy_release_buf(&dest);
+        }
+
         if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
         guest_handle_add_offset(uop, 1);
     }
-    return 0;
+
+    gnttab_copy_release_buf(&src);
+    gnttab_copy_release_buf(&dest);
+
+    return rc;
 }
 
 static long
@@ -2191,7 +2506,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     if ( gt->gt_version == op.version )
         goto out;
 
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
     /* Make sure that the grant table isn't currently in use when we
        change the version number, except for the first 8 entries which
        are allowed to be in use (xenstore/xenconsole keeps them mapped).
@@ -2200,7 +2515,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     {
         for ( i = GNTTAB_NR_RESERVED_ENTRIES; i < nr_grant_entries(gt); i++ )
         {
-            act = &active_entry(gt, i);
+            act = &_active_entry(gt, i);
             if ( act->pin != 0 )
             {
                 gdprintk(XENLOG_WARNING,
@@ -2277,7 +2592,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     gt->gt_version = op.version;
 
 out_unlock:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
 
 out:
     op.version = gt->gt_version;
@@ -2333,7 +2648,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
 
     op.status = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     for ( i = 0; i < op.nr_frames; i++ )
     {
@@ -2342,7 +2657,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
             op.status = GNTST_bad_virt_addr;
     }
 
-    spin_unlock(&gt->lock);
+    read_unlock(&gt->lock);
 out2:
     rcu_unlock_domain(d);
 out1:
@@ -2391,7 +2706,7 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     struct active_grant_entry *act;
     s16 rc = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
 
     /* Bounds check on the grant refs */
     if ( unlikely(ref_a >= nr_grant_entries(d->grant_table)))
@@ -2399,11 +2714,11 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     if ( unlikely(ref_b >= nr_grant_entries(d->grant_table)))
         PIN_FAIL(out, GNTST_bad_gntref, "Bad ref-b (%d).\n", ref_b);
 
-    act = &active_entry(gt, ref_a);
+    act = &_active_entry(gt, ref_a);
     if ( act->pin )
         PIN_FAIL(out, GNTST_eagain, "ref a %ld busy\n", (long)ref_a);
 
-    act = &active_entry(gt, ref_b);
+    act = &_active_entry(gt, ref_b);
     if ( act->pin )
         PIN_FAIL(out, GNTST_eagain, "ref b %ld busy\n", (long)ref_b);
 
@@ -2431,7 +2746,7 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     }
 
 out:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
 
     rcu_unlock_domain(d);
 
@@ -2608,6 +2923,14 @@ do_grant_table_op(
 #include "compat/grant_table.c"
 #endif
 
+void
+grant_table_init_vcpu(struct vcpu *v)
+{
+    spin_lock_init(&v->maptrack_lock);
+    v->maptrack_head = MAPTRACK_TAIL;
+    v->maptrack_count = 0;
+}
+
 int 
 grant_table_create(
     struct domain *d)
@@ -2619,7 +2942,8 @@ grant_table_create(
         goto no_mem_0;
 
     /* Simple stuff. */
-    spin_lock_init(&t->lock);
+    rwlock_init(&t->lock);
+    spin_lock_init_prof(t, maptrack_lock);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -2631,7 +2955,7 @@ grant_table_create(
     {
         if ( (t->active[i] = alloc_xenheap_page()) == NULL )
             goto no_mem_2;
-        clear_page(t->active[i]);
+        active_entry_init_frame(t->active[i]);
     }
 
     /* Tracking of mapped foreign frames table */
@@ -2668,6 +2992,8 @@ grant_table_create(
     t->nr_status_frames = 0;
 
     /* Okay, install the structure. */
+    lock_profile_register_struct(LOCKPROF_TYPE_PERDOM, t, d->domain_id,
+                                 "Domain");
     d->grant_table = t;
     return 0;
 
@@ -2726,9 +3052,9 @@ gnttab_release_mappings(
         }
 
         rgt = rd->grant_table;
-        spin_lock(&rgt->lock);
+        read_lock(&rgt->lock);
 
-        act = &active_entry(rgt, ref);
+        act = active_entry_acquire(rgt, ref);
         sha = shared_entry_header(rgt, ref);
         if (rgt->gt_version == 1)
             status = &sha->flags;
@@ -2786,7 +3112,8 @@ gnttab_release_mappings(
         if ( act->pin == 0 )
             gnttab_clear_flag(_GTF_reading, status);
 
-        spin_unlock(&rgt->lock);
+        active_entry_release(act);
+        read_unlock(&rgt->lock);
 
         rcu_unlock_domain(rd);
 
@@ -2804,7 +3131,9 @@ grant_table_destroy(
 
     if ( t == NULL )
         return;
-    
+
+    lock_profile_deregister_struct(LOCKPROF_TYPE_PERDOM, t);
+
     for ( i = 0; i < nr_grant_frames(t); i++ )
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
@@ -2834,7 +3163,7 @@ static void gnttab_usage_print(struct domain *rd)
     printk("      -------- active --------       -------- shared --------\n");
     printk("[ref] localdom mfn      pin          localdom gmfn     flags\n");
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         goto out;
@@ -2848,9 +3177,12 @@ static void gnttab_usage_print(struct domain *rd)
         uint16_t status;
         uint64_t frame;
 
-        act = &active_entry(gt, ref);
+        act = active_entry_acquire(gt, ref);
         if ( !act->pin )
+        {
+            active_entry_release(act);
             continue;
+        }
 
         sha = shared_entry_header(gt, ref);
 
@@ -2880,10 +3212,11 @@ static void gnttab_usage_print(struct domain *rd)
         printk("[%3d]    %5d 0x%06lx 0x%08x      %5d 0x%06"PRIx64" 0x%02x\n",
                ref, act->domid, act->frame, act->pin,
                sha->domid, frame, status);
+        active_entry_release(act);
     }
 
  out:
-    spin_unlock(&gt->lock);
+    read_unlock(&gt->lock);
 
     if ( first )
         printk("grant-table for remote domain:%5d ... "
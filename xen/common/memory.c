@@ -92,11 +92,79 @@ static void increase_reservation(struct memop_args *a)
     a->nr_done = i;
 }
 
+/* Extents read from the guest's extent list at a time. */
+#define POPULATE_BATCH 64
+
+/* Superpage orders tried for translated guests, largest first. */
+static const unsigned int populate_orders[] = {
+    18, /* 1GB */
+    9,  /* 2MB */
+};
+
+/* Do the @nr extents from @i on cover the gpfns from @gpfn on, in order? */
+static bool_t populate_run_contiguous(struct memop_args *a, unsigned long i,
+                                      xen_pfn_t gpfn, unsigned long nr)
+{
+    xen_pfn_t gpfns[POPULATE_BATCH];
+    unsigned long j, k, n;
+
+    for ( j = 0; j < nr; j += n )
+    {
+        n = min_t(unsigned long, nr - j, POPULATE_BATCH);
+        if ( unlikely(__copy_from_guest_offset(gpfns, a->extent_list,
+                                               i + j, n)) )
+            return 0;
+        for ( k = 0; k < n; k++ )
+            if ( gpfns[k] != gpfn + ((j + k) << a->extent_order) )
+                return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Try to back the run of extents starting at @i, @gpfn with a single
+ * larger allocation, installed in the p2m in one go.  The run must be
+ * aligned to the larger order and fully described by the extent list.
+ * On success, *@order is the order allocated.
+ */
+static struct page_info *populate_superpage(struct memop_args *a,
+                                            unsigned long i, xen_pfn_t gpfn,
+                                            unsigned int *order)
+{
+    struct domain *d = a->domain;
+    struct page_info *page;
+    unsigned long nr;
+    unsigned int k;
+
+    for ( k = 0; k < ARRAY_SIZE(populate_orders); k++ )
+    {
+        *order = populate_orders[k];
+        if ( *order <= a->extent_order || *order > MAX_ORDER ||
+             (gpfn & ((1UL << *order) - 1)) )
+            continue;
+
+        nr = 1UL << (*order - a->extent_order);
+        if ( nr > a->nr_extents - i ||
+             d->tot_pages + (1UL << *order) > d->max_pages ||
+             !multipage_allocation_permitted(current->domain, *order) ||
+             !populate_run_contiguous(a, i, gpfn, nr) )
+            continue;
+
+        page = alloc_domheap_pages(d, *order, a->memflags);
+        if ( page != NULL )
+            return page;
+    }
+
+    return NULL;
+}
+
 static void populate_physmap(struct memop_args *a)
 {
     struct page_info *page;
-    unsigned long i, j;
-    xen_pfn_t gpfn, mfn;
+    unsigned long i, j, nr, batch = 0, batch_nr = 0;
+    unsigned int order;
+    xen_pfn_t gpfn, mfn, gpfns[POPULATE_BATCH];
     struct domain *d = a->domain;
 
     if ( !guest_handle_subrange_okay(a->extent_list, a->nr_done,
@@ -107,7 +175,7 @@ static void populate_physmap(struct memop_args *a)
          !multipage_allocation_permitted(current->domain, a->extent_order) )
         return;
 
-    for ( i = a->nr_done; i < a->nr_extents; i++ )
+    for ( i = a->nr_done; i < a->nr_extents; i += nr )
     {
         if ( i != a->nr_done && hypercall_preempt_check() )
         {
@@ -115,8 +183,17 @@ static void populate_physmap(struct memop_args *a)
             goto out;
         }
 
-        if ( unlikely(__copy_from_guest_offset(&gpfn, a->extent_list, i, 1)) )
-            goto out;
+        if ( i - batch >= batch_nr )
+        {
+            batch = i;
+            batch_nr = min_t(unsigned long, a->nr_extents - i,
+                             POPULATE_BATCH);
+            if ( unlikely(__copy_from_guest_offset(gpfns, a->extent_list,
+                                                   batch, batch_nr)) )
+                goto out;
+        }
+        gpfn = gpfns[i - batch];
+        nr = 1;
 
         if ( a->memflags & MEMF_populate_on_demand )
         {
@@ -126,6 +203,8 @@ static void populate_physmap(struct memop_args *a)
         }
         else
         {
+            order = a->extent_order;
+
             if ( is_domain_direct_mapped(d) )
             {
                 mfn = gpfn;
@@ -147,7 +226,20 @@ static void populate_physmap(struct memop_args *a)
                 put_page(page);
             }
             else
-                page = alloc_domheap_pages(d, a->extent_order, a->memflags);
+            {
+                /*
+                 * Translated guests don't see machine addresses, so runs
+                 * of small extents can be backed by a superpage.
+                 */
+                page = NULL;
+                if ( paging_mode_translate(d) )
+                    page = populate_superpage(a, i, gpfn, &order);
+                if ( page == NULL )
+                {
+                    order = a->extent_order;
+                    page = alloc_domheap_pages(d, order, a->memflags);
+                }
+            }
 
             if ( unlikely(page == NULL) ) 
             {
@@ -160,7 +252,8 @@ static void populate_physmap(struct memop_args *a)
             }
 
             mfn = page_to_mfn(page);
-            guest_physmap_add_page(d, gpfn, mfn, a->extent_order);
+            guest_physmap_add_page(d, gpfn, mfn, order);
+            nr = 1UL << (order - a->extent_order);
 
             if ( !paging_mode_translate(d) )
             {
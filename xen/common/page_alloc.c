@@ -38,6 +38,7 @@
 #include <xen/event.h>
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
+#include <xen/cpu.h>
 #include <public/sysctl.h>
 #include <public/sched.h>
 #include <asm/page.h>
@@ -64,6 +65,20 @@ string_param("badpage", opt_badpage);
 static bool_t opt_bootscrub __initdata = 1;
 boolean_param("bootscrub", opt_bootscrub);
 
+/*
+ * bootscrub_chunk -> Amount of memory each CPU scrubs at boot between
+ * progress reports.
+ */
+static unsigned long __initdata opt_bootscrub_chunk = MB(128);
+size_param("bootscrub_chunk", opt_bootscrub_chunk);
+
+/*
+ * no-bootscrub_nt -> Scrub at boot with ordinary stores rather than the
+ * non-temporal ones clear_page() uses where the CPU has them.
+ */
+static bool_t __initdata opt_bootscrub_nt = 1;
+boolean_param("bootscrub_nt", opt_bootscrub_nt);
+
 /*
  * Bit width of the DMA heap -- used to override NUMA-node-first.
  * allocation strategy, which can otherwise exhaust low memory.
@@ -270,6 +285,26 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/*
+ * Free pages still holding data of their previous owner are marked
+ * PGC_need_scrub, and are counted per node whether or not they currently
+ * sit on a free list.  Chunks containing such pages are kept at the tail
+ * of their free list, so that clean memory is handed out first; idle CPUs
+ * scrub them in the background, and allocations scrub whatever dirty
+ * pages they still get.
+ */
+#define INVALID_DIRTY_IDX ((1U << 31) - 1) /* all of page_info's first_dirty */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Most pages scrubbed by an idle CPU before it looks for other work. */
+#define SCRUB_CHUNK_ORDER 9
+
+#ifndef NDEBUG
+#define SCRUB_PATTERN 0xc2
+#else
+#define SCRUB_PATTERN 0
+#endif
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
@@ -277,6 +312,14 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/* Per-CPU caches of small free blocks, see further down. */
+static struct page_info *heap_cache_alloc(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order);
+static bool_t heap_cache_free(struct page_info *pg, unsigned int order);
+static unsigned long heap_cache_drain_all(void);
+static unsigned long heap_cache_pages(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -347,7 +390,7 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     }
 
     /* how much memory is available? */
-    avail_pages = total_avail_pages;
+    avail_pages = total_avail_pages + heap_cache_pages();
 
     /* Note: The usage of claim means that allocation from a guest *might*
      * have to come from freeable memory. Using free memory is always better, if
@@ -557,19 +600,191 @@ static void check_low_mem_virq(void)
     }
 }
 
+/* Put a free chunk on its free list: clean ones at the head. */
+static void page_list_add_scrub(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+static unsigned int find_first_dirty(
+    const struct page_info *pg, unsigned int order)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1U << order); i++ )
+        if ( pg[i].count_info & PGC_need_scrub )
+            return i;
+
+    return INVALID_DIRTY_IDX;
+}
+
+/*
+ * Mark a chunk just taken off the free lists in use.  Caller must hold
+ * heap_lock.
+ */
+static void mark_heap_block_inuse(struct page_info *pg, unsigned int order)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* Reference count must continuously be zero for free pages. */
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
+    }
+}
+
+/*
+ * Take a free 2^@order block from @node's heap, splitting a larger one if
+ * need be.  Caller must hold heap_lock.
+ */
+static struct page_info *take_heap_block(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order)
+{
+    unsigned int j, zone, first_dirty;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+    bool_t use_dirty = 0;
+
+ again:
+    zone = zone_hi;
+    do {
+        /* Check if target node can support the allocation. */
+        if ( !avail[node] || (avail[node][zone] < request) )
+            continue;
+
+        /*
+         * Find smallest order which can satisfy the request, with a chunk
+         * that needs no scrubbing if there is one.
+         */
+        for ( j = order; j <= MAX_ORDER; j++ )
+        {
+            if ( page_list_empty(&heap(node, zone, j)) )
+                continue;
+            pg = page_list_first(&heap(node, zone, j));
+            if ( use_dirty || pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+                goto found;
+        }
+    } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    if ( !use_dirty && node_need_scrub[node] )
+    {
+        use_dirty = 1;
+        goto again;
+    }
+
+    return NULL;
+
+ found: 
+    page_list_del(pg, &heap(node, zone, j));
+    first_dirty = pg->u.free.first_dirty;
+
+    /* We may have to halve the chunk a number of times. */
+    while ( j != order )
+    {
+        j--;
+        page_list_add_scrub(pg, node, zone, j,
+                            (1U << j) > first_dirty ?
+                            first_dirty : INVALID_DIRTY_IDX);
+        pg += 1 << j;
+
+        if ( first_dirty != INVALID_DIRTY_IDX )
+        {
+            /* The upper half may hold dirty pages past first_dirty. */
+            if ( first_dirty >= (1U << j) )
+                first_dirty -= 1U << j;
+            else
+                first_dirty = 0;
+        }
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    total_avail_pages -= request;
+    ASSERT(total_avail_pages >= 0);
+
+    return pg;
+}
+
+/*
+ * Get 2^@order pages that have just been marked in use ready to be handed
+ * out: scrub those that need it and flush any TLBs that may still map them.
+ */
+static void prepare_alloc_pages(struct page_info *pg, unsigned int order)
+{
+    unsigned int i, dirty = 0;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+        {
+            scrub_one_page(&pg[i]);
+            clear_bit(_PGC_need_scrub, &pg[i].count_info);
+            dirty++;
+        }
+
+        if ( pg[i].u.free.need_tlbflush &&
+             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
+             (!need_tlbflush ||
+              (pg[i].tlbflush_timestamp > tlbflush_timestamp)) )
+        {
+            need_tlbflush = 1;
+            tlbflush_timestamp = pg[i].tlbflush_timestamp;
+        }
+
+        /* Initialise fields which have other uses for free pages. */
+        pg[i].u.inuse.type_info = 0;
+        page_set_owner(&pg[i], NULL);
+
+        /* Ensure cache and RAM are consistent for platforms where the
+         * guest can control its own visibility of/through the cache.
+         */
+        flush_page_to_ram(page_to_mfn(&pg[i]));
+    }
+
+    if ( need_tlbflush )
+    {
+        cpumask_t mask = cpu_online_map;
+        tlbflush_filter(mask, tlbflush_timestamp);
+        if ( !cpumask_empty(&mask) )
+        {
+            perfc_incr(need_flush_tlb_flush);
+            flush_tlb_mask(&mask);
+        }
+    }
+
+    if ( dirty )
+    {
+        spin_lock(&heap_lock);
+        node_need_scrub[phys_to_nid(page_to_maddr(pg))] -= dirty;
+        spin_unlock(&heap_lock);
+    }
+}
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
+    unsigned int first_node, start_node, nodemask_retry;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
     unsigned long request = 1UL << order;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
-    bool_t need_tlbflush = 0;
-    uint32_t tlbflush_timestamp = 0;
+    bool_t drained = 0;
 
     if ( node == NUMA_NO_NODE )
     {
@@ -583,7 +798,7 @@ static struct page_info *alloc_heap_pages(
         if ( node >= MAX_NUMNODES )
             node = cpu_to_node(smp_processor_id());
     }
-    first_node = node;
+    start_node = node;
 
     ASSERT(node >= 0);
     ASSERT(zone_lo <= zone_hi);
@@ -592,6 +807,26 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    /*
+     * The caches know nothing of claims: while any are outstanding, only a
+     * domain whose own claim covers the request may use them.  Everybody
+     * else goes through the claims check below, which drains the caches
+     * before giving up.
+     */
+    if ( (!outstanding_claims ||
+          (d != NULL && d->outstanding_pages >= request)) &&
+         (pg = heap_cache_alloc(node, zone_lo, zone_hi, order)) != NULL )
+    {
+        if ( d != NULL )
+            d->last_alloc_node = node;
+        goto out;
+    }
+
+ retry:
+    first_node = node = start_node;
+    nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
+    nodemask_retry = 0;
+
     spin_lock(&heap_lock);
 
     /*
@@ -621,17 +856,8 @@ static struct page_info *alloc_heap_pages(
      */
     for ( ; ; )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        if ( (pg = take_heap_block(node, zone_lo, zone_hi, order)) != NULL )
+            goto found;
 
         if ( memflags & MEMF_exact_node )
             goto not_found;
@@ -671,64 +897,28 @@ static struct page_info *alloc_heap_pages(
  not_found:
     /* No suitable memory blocks. Fail the request. */
     spin_unlock(&heap_lock);
-    return NULL;
 
- found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
+    /* Unless what is missing is sitting in the per-CPU caches. */
+    if ( !drained && heap_cache_drain_all() )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
+        drained = 1;
+        goto retry;
     }
 
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
+    return NULL;
 
+ found: 
     check_low_mem_virq();
 
     if ( d != NULL )
         d->last_alloc_node = node;
 
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
-
-        if ( pg[i].u.free.need_tlbflush &&
-             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
-             (!need_tlbflush ||
-              (pg[i].tlbflush_timestamp > tlbflush_timestamp)) )
-        {
-            need_tlbflush = 1;
-            tlbflush_timestamp = pg[i].tlbflush_timestamp;
-        }
-
-        /* Initialise fields which have other uses for free pages. */
-        pg[i].u.inuse.type_info = 0;
-        page_set_owner(&pg[i], NULL);
-
-        /* Ensure cache and RAM are consistent for platforms where the
-         * guest can control its own visibility of/through the cache.
-         */
-        flush_page_to_ram(page_to_mfn(&pg[i]));
-    }
+    mark_heap_block_inuse(pg, order);
 
     spin_unlock(&heap_lock);
 
-    if ( need_tlbflush )
-    {
-        cpumask_t mask = cpu_online_map;
-        tlbflush_filter(mask, tlbflush_timestamp);
-        if ( !cpumask_empty(&mask) )
-        {
-            perfc_incr(need_flush_tlb_flush);
-            flush_tlb_mask(&mask);
-        }
-    }
+ out:
+    prepare_alloc_pages(pg, order);
 
     return pg;
 }
@@ -781,8 +971,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    find_first_dirty(cur_head, cur_order));
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -798,6 +988,13 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        /* Scrubbed, if need be, when it is onlined again. */
+        if ( cur_head->count_info & PGC_need_scrub )
+        {
+            cur_head->count_info &= ~PGC_need_scrub;
+            node_need_scrub[node]--;
+        }
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -808,18 +1005,20 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Return a 2^@order block to the heap, marking its pages as needing a
+ * scrub if @need_scrub.  Caller must hold heap_lock.
+ */
+static void free_heap_block(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
+    unsigned long mask;
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
-    unsigned int zone = page_to_zone(pg);
+    unsigned int zone = page_to_zone(pg), first_dirty = INVALID_DIRTY_IDX;
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -836,20 +1035,21 @@ static void free_heap_pages(
          */
         ASSERT(!page_state_is(&pg[i], offlined));
         pg[i].count_info =
-            ((pg[i].count_info & PGC_broken) |
+            ((pg[i].count_info & (PGC_broken | PGC_need_scrub)) |
              (page_state_is(&pg[i], offlining)
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
 
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+        if ( need_scrub &&
+             !(pg[i].count_info & (PGC_broken | PGC_need_scrub)) )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            node_need_scrub[node]++;
+        }
+        if ( (pg[i].count_info & PGC_need_scrub) &&
+             first_dirty == INVALID_DIRTY_IDX )
+            first_dirty = i;
     }
 
     avail[node][zone] += 1 << order;
@@ -874,6 +1074,10 @@ static void free_heap_pages(
                 break;
             pg -= mask;
             page_list_del(pg, &heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pg->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
         }
         else
         {
@@ -884,58 +1088,558 @@ static void free_heap_pages(
                  (phys_to_nid(page_to_maddr(pg+mask)) != node) )
                 break;
             page_list_del(pg + mask, &heap(node, zone, order));
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 (pg + mask)->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = mask + (pg + mask)->u.free.first_dirty;
         }
 
         order++;
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages, to be scrubbed before reuse if @need_scrub. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
+    unsigned int i;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            pg[i].tlbflush_timestamp = tlbflush_current_time();
+
+        /* This page is not a guest frame any more. */
+        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
+        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+    }
+
+    /* The per-CPU caches only hold clean pages. */
+    if ( !need_scrub && heap_cache_free(pg, order) )
+        return;
 
+    spin_lock(&heap_lock);
+    free_heap_block(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
 
 /*
- * Following rules applied for page offline:
- * Once a page is broken, it can't be assigned anymore
- * A page will be offlined only if it is free
- * return original count_info
+ * Per-CPU caches of small free blocks.
+ *
+ * Allocations and frees of blocks below order HEAP_CACHE_ORDERS, with no
+ * upper address limit and for the local node, are served by a cache on
+ * the local CPU instead of taking heap_lock.  An empty cache is refilled,
+ * and an overfull one drained, a batch at a time under one acquisition
+ * of heap_lock.
+ *
+ * Cached blocks are not counted in avail[] or total_avail_pages.  They
+ * are in the in-use state with no owner, so offline_page() treats them as
+ * anonymous pages; blocks found offlining or broken are handed back to the
+ * heap rather than reused.  If an allocation would otherwise fail, all
+ * caches are drained and it is retried.
+ *
+ * Caches only come into use once the boot scrub is done, since it does
+ * not look at them.
  */
-static unsigned long mark_page_offline(struct page_info *pg, int broken)
-{
-    unsigned long nx, x, y = pg->count_info;
-
-    ASSERT(page_is_ram_type(page_to_mfn(pg), RAM_TYPE_CONVENTIONAL));
-    ASSERT(spin_is_locked(&heap_lock));
+#define HEAP_CACHE_ORDERS 4
+#define HEAP_CACHE_BATCH  16    /* pages moved per refill or drain */
+#define HEAP_CACHE_HIGH   64    /* pages cached per order before draining */
+
+#define heap_cache_blocks(pages, order) \
+    max_t(unsigned int, 1, (pages) >> (order))
+
+static bool_t __read_mostly opt_heap_cache = 1;
+boolean_param("heap_cache", opt_heap_cache);
+
+static bool_t __read_mostly heap_cache_active;
+
+struct heap_cache {
+    spinlock_t            lock;
+    bool_t                enabled;
+    unsigned int          node;
+    struct page_list_head list[HEAP_CACHE_ORDERS];   /* hottest first */
+    unsigned int          count[HEAP_CACHE_ORDERS];  /* in blocks */
+    /* Statistics. */
+    unsigned long         hits, refills, frees, drains;
+};
 
-    do {
-        nx = x = y;
+static DEFINE_PER_CPU(struct heap_cache, heap_cache);
 
-        if ( ((x & PGC_state) != PGC_state_offlined) &&
-             ((x & PGC_state) != PGC_state_offlining) )
-        {
-            nx &= ~PGC_state;
-            nx |= (((x & PGC_state) == PGC_state_free)
-                   ? PGC_state_offlined : PGC_state_offlining);
-        }
+/*
+ * Move all but the @keep hottest blocks of @order to @list.  Caller must
+ * hold hc->lock.  Returns the number of blocks moved.
+ */
+static unsigned int heap_cache_take(
+    struct heap_cache *hc, unsigned int order, unsigned int keep,
+    struct page_list_head *list)
+{
+    struct page_info *pg;
+    unsigned int n = 0, nr;
 
-        if ( broken )
-            nx |= PGC_broken;
+    page_list_move(list, &hc->list[order]);
+    while ( n < keep && (pg = page_list_remove_head(list)) != NULL )
+    {
+        page_list_add_tail(pg, &hc->list[order]);
+        n++;
+    }
 
-        if ( x == nx )
-            break;
-    } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
+    nr = hc->count[order] - n;
+    hc->count[order] = n;
 
-    return y;
+    return nr;
 }
 
-static int reserve_heap_page(struct page_info *pg)
+static void heap_cache_release(struct page_list_head *list, unsigned int order)
 {
-    struct page_info *head = NULL;
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        free_heap_block(pg, order, 0);
+    spin_unlock(&heap_lock);
+}
+
+static unsigned int heap_cache_refill(
+    struct heap_cache *hc, unsigned int zone_lo, unsigned int order)
+{
+    unsigned int n, nr = heap_cache_blocks(HEAP_CACHE_BATCH, order);
+    struct page_info *pg;
+    PAGE_LIST_HEAD(list);
+
+    spin_lock(&heap_lock);
+
+    /* Leave claimed memory to the slow path, which knows who claimed it. */
+    if ( outstanding_claims + ((unsigned long)nr << order) >
+         total_avail_pages )
+        nr = 0;
+
+    for ( n = 0; n < nr; n++ )
+    {
+        pg = take_heap_block(hc->node, zone_lo, NR_ZONES - 1, order);
+        if ( pg == NULL )
+            break;
+
+        mark_heap_block_inuse(pg, order);
+        page_list_add_tail(pg, &list);
+    }
+
+    if ( n )
+        check_low_mem_virq();
+
+    spin_unlock(&heap_lock);
+
+    if ( n )
+    {
+        spin_lock(&hc->lock);
+        page_list_splice(&list, &hc->list[order]);
+        hc->count[order] += n;
+        hc->refills++;
+        spin_unlock(&hc->lock);
+    }
+
+    return n;
+}
+
+static struct page_info *heap_cache_alloc(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order)
+{
+    struct heap_cache *hc = &this_cpu(heap_cache);
+    struct page_info *pg;
+    unsigned int i;
+
+    if ( !heap_cache_active || order >= HEAP_CACHE_ORDERS ||
+         zone_hi != NR_ZONES - 1 || !hc->enabled || node != hc->node )
+        return NULL;
+
+    spin_lock(&hc->lock);
+
+    if ( hc->count[order] == 0 )
+    {
+        spin_unlock(&hc->lock);
+        if ( !heap_cache_refill(hc, zone_lo, order) )
+            return NULL;
+        spin_lock(&hc->lock);
+    }
+
+    pg = page_list_remove_head(&hc->list[order]);
+    if ( pg != NULL )
+    {
+        if ( page_to_zone(pg) < zone_lo )
+        {
+            /* Cached for a less constrained caller. */
+            page_list_add(pg, &hc->list[order]);
+            pg = NULL;
+        }
+        else
+        {
+            hc->count[order]--;
+            hc->hits++;
+        }
+    }
+
+    spin_unlock(&hc->lock);
+
+    if ( pg == NULL )
+        return NULL;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( (pg[i].count_info & (PGC_state | PGC_broken)) !=
+             PGC_state_inuse )
+        {
+            /* Offlined under our feet: let the heap deal with it. */
+            spin_lock(&heap_lock);
+            free_heap_block(pg, order, 0);
+            spin_unlock(&heap_lock);
+            return NULL;
+        }
+    }
+
+    return pg;
+}
+
+static bool_t heap_cache_free(struct page_info *pg, unsigned int order)
+{
+    struct heap_cache *hc = &this_cpu(heap_cache);
+    unsigned long x;
+    unsigned int i, nr = 0;
+    PAGE_LIST_HEAD(list);
+
+    if ( !heap_cache_active || order >= HEAP_CACHE_ORDERS || !hc->enabled ||
+         phys_to_nid(page_to_maddr(pg)) != hc->node ||
+         page_to_zone(pg) == MEMZONE_XEN )
+        return 0;
+
+    /*
+     * Pages being offlined or broken go straight back to the heap.  Nothing
+     * serialises us against offline_page() here, hence the cmpxchg.
+     */
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        x = pg[i].count_info;
+        if ( ((x & (PGC_state | PGC_broken)) != PGC_state_inuse) ||
+             (cmpxchg(&pg[i].count_info, x, PGC_state_inuse) != x) )
+            return 0;
+    }
+
+    spin_lock(&hc->lock);
+    page_list_add(pg, &hc->list[order]);
+    hc->frees++;
+    if ( ++hc->count[order] > heap_cache_blocks(HEAP_CACHE_HIGH, order) )
+    {
+        nr = heap_cache_take(hc, order,
+                             hc->count[order] -
+                             heap_cache_blocks(HEAP_CACHE_BATCH, order),
+                             &list);
+        hc->drains++;
+    }
+    spin_unlock(&hc->lock);
+
+    if ( nr )
+        heap_cache_release(&list, order);
+
+    return 1;
+}
+
+/* Return every block in @hc to the heap.  Returns the number of pages. */
+static unsigned long heap_cache_drain(struct heap_cache *hc)
+{
+    unsigned int order, nr;
+    unsigned long pages = 0;
+    PAGE_LIST_HEAD(list);
+
+    for ( order = 0; order < HEAP_CACHE_ORDERS; order++ )
+    {
+        spin_lock(&hc->lock);
+        if ( (nr = heap_cache_take(hc, order, 0, &list)) != 0 )
+            hc->drains++;
+        spin_unlock(&hc->lock);
+
+        if ( nr )
+        {
+            heap_cache_release(&list, order);
+            pages += (unsigned long)nr << order;
+        }
+    }
+
+    return pages;
+}
+
+static unsigned long heap_cache_drain_all(void)
+{
+    unsigned int cpu;
+    unsigned long pages = 0;
+
+    if ( !heap_cache_active )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        pages += heap_cache_drain(&per_cpu(heap_cache, cpu));
+
+    return pages;
+}
+
+/* Pages sitting in the caches.  Unlocked, so only an estimate. */
+static unsigned long heap_cache_pages(void)
+{
+    unsigned int cpu, order;
+    unsigned long pages = 0;
+
+    if ( !heap_cache_active )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        for ( order = 0; order < HEAP_CACHE_ORDERS; order++ )
+            pages += (unsigned long)per_cpu(heap_cache, cpu).count[order]
+                     << order;
+
+    return pages;
+}
+
+static int heap_cache_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu, order;
+    struct heap_cache *hc = &per_cpu(heap_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&hc->lock);
+        hc->node = cpu_to_node(cpu);
+        for ( order = 0; order < HEAP_CACHE_ORDERS; order++ )
+        {
+            INIT_PAGE_LIST_HEAD(&hc->list[order]);
+            hc->count[order] = 0;
+        }
+        hc->hits = hc->refills = hc->frees = hc->drains = 0;
+        hc->enabled = 1;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        hc->enabled = 0;
+        heap_cache_drain(hc);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block heap_cache_cpu_nfb = {
+    .notifier_call = heap_cache_cpu_callback
+};
+
+static int __init heap_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    heap_cache_cpu_callback(&heap_cache_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&heap_cache_cpu_nfb);
+    return 0;
+}
+presmp_initcall(heap_cache_init);
+
+static void heap_cache_info(void)
+{
+    unsigned int cpu;
+    unsigned long hits = 0, refills = 0, frees = 0, drains = 0;
+
+    if ( !heap_cache_active )
+    {
+        printk("    Per-CPU caches: off\n");
+        return;
+    }
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct heap_cache *hc = &per_cpu(heap_cache, cpu);
+
+        hits += hc->hits;
+        refills += hc->refills;
+        frees += hc->frees;
+        drains += hc->drains;
+    }
+
+    printk("    Per-CPU caches: %lukB cached, %lu allocs hit, %lu refills, "
+           "%lu frees cached, %lu drains\n",
+           heap_cache_pages() << (PAGE_SHIFT-10), hits, refills, frees,
+           drains);
+}
+
+/*
+ * Take a chunk of at most 2^SCRUB_CHUNK_ORDER pages holding dirty pages off
+ * @node's free lists, and mark it in use.  Caller must hold heap_lock.
+ */
+static struct page_info *take_dirty_chunk(
+    unsigned int node, unsigned int *porder)
+{
+    unsigned int zone, j, first_dirty;
+    struct page_info *pg;
+
+    if ( !avail[node] )
+        return NULL;
+
+    /* Dirty chunks are at the tail of the free lists, largest first. */
+    for ( zone = NR_ZONES; zone-- > 0; )
+    {
+        if ( !avail[node][zone] )
+            continue;
+
+        for ( j = MAX_ORDER + 1; j-- > 0; )
+        {
+            if ( page_list_empty(&heap(node, zone, j)) )
+                continue;
+            pg = page_list_last(&heap(node, zone, j));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                goto found;
+        }
+    }
+
+    return NULL;
+
+ found:
+    page_list_del(pg, &heap(node, zone, j));
+    first_dirty = pg->u.free.first_dirty;
+
+    /* Keep halving, holding on to the half with the first dirty page. */
+    while ( j > SCRUB_CHUNK_ORDER )
+    {
+        j--;
+        if ( first_dirty >= (1U << j) )
+        {
+            page_list_add_scrub(pg, node, zone, j, INVALID_DIRTY_IDX);
+            pg += 1 << j;
+            first_dirty -= 1U << j;
+        }
+        else
+            page_list_add_scrub(pg + (1 << j), node, zone, j, 0);
+    }
+
+    avail[node][zone] -= 1UL << j;
+    total_avail_pages -= 1UL << j;
+    mark_heap_block_inuse(pg, j);
+
+    *porder = j;
+    return pg;
+}
+
+/*
+ * Called by idle CPUs.  Each CPU scrubs free memory of its own node, and
+ * of nodes without CPUs of their own; pages on other nodes are left to
+ * the CPUs there, or to whoever allocates them.  Scrubbing stops as soon
+ * as the CPU has something else to do.  Returns whether there may be more
+ * to scrub.
+ */
+bool_t scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), node, order, i;
+    unsigned long scrubbed = 0;
+    struct page_info *pg = NULL;
+
+    if ( !cpu_is_haltable(cpu) )
+        return 0;
+
+    node = cpu_to_node(cpu);
+    if ( node >= MAX_NUMNODES || !node_online(node) )
+        node = first_node(node_online_map);
+
+    if ( !node_need_scrub[node] )
+    {
+        for_each_online_node ( node )
+            if ( node_need_scrub[node] &&
+                 cpumask_empty(&node_to_cpumask(node)) )
+                break;
+        if ( node >= MAX_NUMNODES )
+            return 0;
+    }
+
+    spin_lock(&heap_lock);
+    if ( node_need_scrub[node] )
+        pg = take_dirty_chunk(node, &order);
+    spin_unlock(&heap_lock);
+
+    if ( pg == NULL )
+        return 0;
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        if ( !test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            continue;
+        if ( softirq_pending(cpu) )
+            break;
+        scrub_one_page(&pg[i]);
+        clear_bit(_PGC_need_scrub, &pg[i].count_info);
+        scrubbed++;
+    }
+
+    spin_lock(&heap_lock);
+    node_need_scrub[node] -= scrubbed;
+    free_heap_block(pg, order, 0);
+    spin_unlock(&heap_lock);
+
+    return 1;
+}
+
+/* Free memory still waiting to be scrubbed. */
+unsigned long total_scrub_pages(void)
+{
+    unsigned long pages = 0;
+    unsigned int node;
+
+    for_each_online_node ( node )
+        pages += node_need_scrub[node];
+
+    return pages;
+}
+
+/*
+ * Following rules applied for page offline:
+ * Once a page is broken, it can't be assigned anymore
+ * A page will be offlined only if it is free
+ * return original count_info
+ */
+static unsigned long mark_page_offline(struct page_info *pg, int broken)
+{
+    unsigned long nx, x, y = pg->count_info;
+
+    ASSERT(page_is_ram_type(page_to_mfn(pg), RAM_TYPE_CONVENTIONAL));
+    ASSERT(spin_is_locked(&heap_lock));
+
+    do {
+        nx = x = y;
+
+        if ( ((x & PGC_state) != PGC_state_offlined) &&
+             ((x & PGC_state) != PGC_state_offlining) )
+        {
+            nx &= ~PGC_state;
+            nx |= (((x & PGC_state) == PGC_state_free)
+                   ? PGC_state_offlined : PGC_state_offlining);
+        }
+
+        if ( broken )
+            nx |= PGC_broken;
+
+        if ( x == nx )
+            break;
+    } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
+
+    return y;
+}
+
+static int reserve_heap_page(struct page_info *pg)
+{
+    struct page_info *head = NULL;
     unsigned int i, node = phys_to_nid(page_to_maddr(pg));
     unsigned int zone = page_to_zone(pg);
 
@@ -1115,7 +1819,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
 
     return ret;
 }
@@ -1184,7 +1888,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1211,7 +1915,7 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + heap_cache_pages() - midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -1261,41 +1965,249 @@ void __init end_boot_allocator(void)
  * convoluted than appears necessary because we do not want to continuously
  * hold the lock while scrubbing very large memory areas.
  */
-void __init scrub_heap_pages(void)
+/*
+ * Boot-time scrubbing.  The memory of each node is split evenly between
+ * the node's CPUs, one thread per core, which scrub it in chunks of
+ * bootscrub_chunk, all nodes at once.  Nodes without CPUs are then done
+ * by the CPUs of the nearest node that has some.
+ */
+struct scrub_region {
+    unsigned long offset;       /* into each CPU's share, this round */
+    unsigned long start;        /* first MFN of the node */
+    unsigned long per_cpu_sz;   /* pages per CPU */
+    unsigned long rem;          /* pages left over for the last CPU */
+    cpumask_t cpus;             /* CPUs scrubbing the node */
+    unsigned long free;         /* free pages when the scrub started */
+    s_time_t done;              /* when the last chunk was scrubbed */
+};
+static struct scrub_region __initdata region[MAX_NUMNODES];
+static unsigned long __initdata chunk_size;
+
+static void __init boot_scrub_page(struct page_info *pg)
+{
+    void *p;
+
+    if ( unlikely(pg->count_info & PGC_broken) )
+        return;
+
+    p = __map_domain_page(pg);
+    /* clear_page() uses non-temporal stores where the CPU has them. */
+    if ( opt_bootscrub_nt && !SCRUB_PATTERN )
+        clear_page(p);
+    else
+        memset(p, SCRUB_PATTERN, PAGE_SIZE);
+    unmap_domain_page(p);
+}
+
+static void __init smp_scrub_heap_pages(void *data)
 {
-    unsigned long mfn;
+    unsigned long mfn, start, end;
     struct page_info *pg;
+    struct scrub_region *r;
+    unsigned int temp_cpu, node, cpu_idx = 0;
+    unsigned int cpu = smp_processor_id();
 
-    if ( !opt_bootscrub )
+    if ( data )
+        r = data;
+    else
+    {
+        node = cpu_to_node(cpu);
+        if ( node >= MAX_NUMNODES )
+            return;
+        r = &region[node];
+    }
+
+    /* This CPU's index among those scrubbing the region. */
+    for_each_cpu ( temp_cpu, &r->cpus )
+    {
+        if ( cpu == temp_cpu )
+            break;
+        cpu_idx++;
+    }
+    if ( temp_cpu != cpu )
         return;
 
-    printk("Scrubbing Free RAM: ");
+    start = r->start + (r->per_cpu_sz * cpu_idx) + r->offset;
 
-    for ( mfn = first_valid_mfn; mfn < max_page; mfn++ )
+    if ( r->offset + chunk_size >= r->per_cpu_sz )
     {
-        process_pending_softirqs();
+        /* Last round: finish our share, plus the leftovers if we're last. */
+        end = r->start + (r->per_cpu_sz * cpu_idx) + r->per_cpu_sz;
+        if ( r->rem && (cpumask_weight(&r->cpus) - 1 == cpu_idx) )
+            end += r->rem;
+    }
+    else
+        end = start + chunk_size;
 
+    for ( mfn = start; mfn < end; mfn++ )
+    {
         pg = mfn_to_page(mfn);
 
-        /* Quick lock-free check. */
-        if ( !mfn_valid(mfn) || !page_state_is(pg, free) )
+        /* Skip pages that are not free, or will be scrubbed anyway. */
+        if ( !mfn_valid(mfn) || !page_state_is(pg, free) ||
+             (pg->count_info & PGC_need_scrub) )
             continue;
 
-        /* Every 100MB, print a progress dot. */
-        if ( (mfn % ((100*1024*1024)/PAGE_SIZE)) == 0 )
-            printk(".");
+        boot_scrub_page(pg);
+    }
+}
 
-        spin_lock(&heap_lock);
+/* Pick one thread of each core of @node, returning how many there are. */
+static unsigned int __init find_non_smt(unsigned int node, cpumask_t *dest)
+{
+    cpumask_t node_cpus;
+    unsigned int i, cpu;
+
+    cpumask_and(&node_cpus, &node_to_cpumask(node), &cpu_online_map);
+    cpumask_clear(dest);
+    for_each_cpu ( i, &node_cpus )
+    {
+        if ( cpumask_intersects(dest, per_cpu(cpu_sibling_mask, i)) )
+            continue;
+        cpu = cpumask_first(per_cpu(cpu_sibling_mask, i));
+        cpumask_set_cpu(cpu, dest);
+    }
+
+    return cpumask_weight(dest);
+}
 
-        /* Re-check page status with lock held. */
-        if ( page_state_is(pg, free) )
-            scrub_one_page(pg);
+/* Scrub @r, or every node's region if NULL, with @cpus, chunk by chunk. */
+static void __init scrub_regions(
+    const cpumask_t *cpus, struct scrub_region *r, unsigned long max_per_cpu)
+{
+    unsigned long offset;
+    unsigned int i;
+
+    for ( offset = 0; offset < max_per_cpu; offset += chunk_size )
+    {
+        if ( r )
+            r->offset = offset;
+        else
+            for_each_online_node ( i )
+                region[i].offset = offset;
 
+        process_pending_softirqs();
+
+        /* Nothing may allocate or free memory underneath us. */
+        spin_lock(&heap_lock);
+        on_selected_cpus(cpus, smp_scrub_heap_pages, r, 1);
         spin_unlock(&heap_lock);
+
+        printk(".");
+
+        for_each_online_node ( i )
+            if ( (r == NULL || r == &region[i]) && !region[i].done &&
+                 !cpumask_empty(&region[i].cpus) &&
+                 offset + chunk_size >= region[i].per_cpu_sz )
+                region[i].done = NOW();
+    }
+}
+
+void __init scrub_heap_pages(void)
+{
+    cpumask_t node_cpus, all_worker_cpus;
+    unsigned int i, j, cpus;
+    unsigned long max_per_cpu_sz = 0, start, end;
+    int distance, last_distance, best_node;
+    s_time_t begin;
+
+    if ( !opt_bootscrub )
+        goto out;
+
+    cpumask_clear(&all_worker_cpus);
+    chunk_size = opt_bootscrub_chunk >> PAGE_SHIFT;
+    if ( chunk_size == 0 )
+        chunk_size = MB(128) >> PAGE_SHIFT;
+
+    /* Work out which CPUs scrub what of the nodes that have CPUs. */
+    for_each_online_node ( i )
+    {
+        region[i].done = 0;
+        if ( !node_spanned_pages(i) )
+            continue;
+
+        start = max(node_start_pfn(i), first_valid_mfn);
+        end = min(node_start_pfn(i) + node_spanned_pages(i), max_page);
+        end = max(end, start);
+
+        cpus = find_non_smt(i, &node_cpus);
+        cpumask_or(&all_worker_cpus, &all_worker_cpus, &node_cpus);
+        if ( cpus == 0 )
+        {
+            /* Done further down, once we know by whom. */
+            region[i].rem = 0;
+            region[i].per_cpu_sz = end - start;
+        }
+        else
+        {
+            region[i].rem = (end - start) % cpus;
+            region[i].per_cpu_sz = (end - start) / cpus;
+            if ( region[i].per_cpu_sz > max_per_cpu_sz )
+                max_per_cpu_sz = region[i].per_cpu_sz;
+        }
+        region[i].start = start;
+        region[i].free = avail_node_heap_pages(i);
+        cpumask_copy(&region[i].cpus, &node_cpus);
+    }
+
+    printk("Scrubbing Free RAM on %u nodes using %u CPUs",
+           num_online_nodes(), cpumask_weight(&all_worker_cpus));
+    begin = NOW();
+
+    scrub_regions(&all_worker_cpus, NULL, max_per_cpu_sz);
+
+    /* Nodes without CPUs get scrubbed by those of the nearest node. */
+    for_each_online_node ( i )
+    {
+        if ( !cpumask_empty(&node_to_cpumask(i)) )
+            continue;
+
+        last_distance = INT_MAX;
+        best_node = first_node(node_online_map);
+        for_each_online_node ( j )
+        {
+            if ( cpumask_empty(&node_to_cpumask(j)) )
+                continue;
+
+            distance = __node_distance(i, j);
+            if ( distance < last_distance )
+            {
+                last_distance = distance;
+                best_node = j;
+            }
+        }
+
+        /* If even that node has no CPUs, do it ourselves. */
+        cpus = find_non_smt(best_node, &node_cpus);
+        if ( cpus == 0 )
+        {
+            cpumask_set_cpu(smp_processor_id(), &node_cpus);
+            cpus = 1;
+        }
+
+        region[i].rem = region[i].per_cpu_sz % cpus;
+        region[i].per_cpu_sz /= cpus;
+        cpumask_copy(&region[i].cpus, &node_cpus);
+
+        scrub_regions(&node_cpus, &region[i], region[i].per_cpu_sz);
     }
 
     printk("done.\n");
 
+    for_each_online_node ( i )
+    {
+        if ( !region[i].done )
+            continue;
+        printk(" Node %u: %luMB free, scrubbed by %u CPUs in %lums\n", i,
+               region[i].free >> (20 - PAGE_SHIFT),
+               cpumask_weight(&region[i].cpus),
+               (unsigned long)((region[i].done - begin) / MILLISECS(1)));
+    }
+
+ out:
+    /* Blocks in the per-CPU caches would have escaped the scrub above. */
+    heap_cache_active = opt_heap_cache && !opt_tmem;
+
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
@@ -1357,7 +2269,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1409,12 +2321,9 @@ void free_xenheap_pages(void *v, unsigned int order)
     pg = virt_to_page(v);
 
     for ( i = 0; i < (1u << order); i++ )
-    {
-        scrub_one_page(&pg[i]);
         pg[i].count_info &= ~PGC_xen_heap;
-    }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 1);
 }
 
 #endif
@@ -1518,7 +2427,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1566,25 +2475,18 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
          * it cares about the secrecy of their contents. However, after a 
          * domain has died we assume responsibility for erasure.
          */
-        if ( unlikely(d->is_dying) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, d->is_dying);
     }
     else if ( unlikely(d == dom_cow) )
     {
         ASSERT(order == 0); 
-        scrub_one_page(pg);
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
         drop_dom_ref = 0;
     }
     else
     {
         /* Freeing anonymous domain-heap pages. */
-        for ( i = 0; i < (1 << order); i++ )
-            scrub_one_page(&pg[i]);
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 1);
         drop_dom_ref = 0;
     }
 
@@ -1610,7 +2512,7 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + heap_cache_pages();
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
@@ -1621,7 +2523,7 @@ unsigned long avail_node_heap_pages(unsigned int nodeid)
 
 static void pagealloc_info(unsigned char key)
 {
-    unsigned int zone = MEMZONE_XEN;
+    unsigned int zone = MEMZONE_XEN, node;
     unsigned long n, total = 0;
 
     printk("Physical memory information:\n");
@@ -1644,6 +2546,13 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+
+    for_each_online_node ( node )
+        if ( node_need_scrub[node] )
+            printk("    Node %u: %lukB waiting to be scrubbed\n", node,
+                   node_need_scrub[node] << (PAGE_SHIFT-10));
+
+    heap_cache_info();
 }
 
 static struct keyhandler pagealloc_info_keyhandler = {
@@ -1671,7 +2580,7 @@ void scrub_one_page(struct page_info *pg)
 
 #ifndef NDEBUG
     /* Avoid callers relying on allocations returning zeroed pages. */
-    memset(p, 0xc2, PAGE_SIZE);
+    memset(p, SCRUB_PATTERN, PAGE_SIZE);
 #else
     /* For a production build, clear_page() is the fastest way to scrub. */
     clear_page(p);
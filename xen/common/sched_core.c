@@ -0,0 +1,325 @@
+/******************************************************************************
+ * sched_core.c
+ *
+ * Core scheduling: the SMT siblings of a core only ever run vcpus of one
+ * domain at a time (plus the idle vcpu).
+ *
+ * Each pCPU still picks its own vcpu with its scheduler's do_schedule.
+ * On top of that, each core has an owner: the domain running on its
+ * non-idle siblings.  While a core has an owner, the schedulers that
+ * support this mode (credit and credit2) only pick, on the other siblings,
+ * vcpus of the owner, or the idle vcpu.  The sibling then waits, idle,
+ * for the owner to leave the core.  An owner keeps the core for at most
+ * sched_core_slice_us once a sibling is waiting: past that it is revoked,
+ * its vcpus are descheduled, and the core is handed to the siblings that
+ * were waiting, which pick before the others may take it back.
+ *
+ * The arbitration happens under a per-core lock, held from the start to
+ * the end of schedule() on each sibling.  The order is the pCPU schedule
+ * lock first, then the core lock; a scheduler may only try (not spin on)
+ * another pCPU's schedule lock while holding it, which load balancing
+ * already does.
+ *
+ * For every core, the time with at least one sibling busy, the time with
+ * all siblings running the owner, the time siblings spent idle waiting
+ * for the owner, and the ownership changes are accounted.  They are
+ * printed with the run queues ('r' debug key).
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/sched-if.h>
+#include <xen/smp.h>
+#include <xen/softirq.h>
+#include <xen/spinlock.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+
+bool_t __read_mostly sched_core = 0;
+boolean_param("sched_core", sched_core);
+
+/* How long a core owner may keep siblings waiting for the core. */
+static unsigned int __read_mostly sched_core_slice_us = 1000;
+integer_param("sched_core_slice_us", sched_core_slice_us);
+
+struct sched_core_data {
+    spinlock_t      lock;
+    struct domain  *owner;       /* domain running on the core, or NULL    */
+    domid_t         owner_id;
+    struct domain  *last;        /* previous owner, for counting switches  */
+    cpumask_t       running;     /* siblings running a vcpu of the owner   */
+    cpumask_t       waiters;     /* siblings that skipped a vcpu for it    */
+    cpumask_t       handoff;     /* waiters picking first after a revoke   */
+    bool_t          revoked;     /* owner must leave the core              */
+    s_time_t        owner_since;
+    s_time_t        stamp;       /* last update of busy and cosched        */
+    struct timer    timer;       /* revokes the owner after the slice      */
+
+    /* Statistics. */
+    s_time_t        busy;        /* at least one sibling not idle          */
+    s_time_t        cosched;     /* all siblings running the owner         */
+    s_time_t        idle_waste;  /* siblings idle, waiting for the owner   */
+    unsigned long   switches;    /* changes of owner                       */
+    unsigned long   forced;      /* owners revoked at the end of the slice */
+};
+
+static DEFINE_PER_CPU(struct sched_core_data, sched_core_data);
+static DEFINE_PER_CPU(s_time_t, sched_core_wait_start);
+
+/*
+ * The core whose lock a pCPU took in sched_core_begin().  The sibling map
+ * may change under a running schedule() as a sibling comes up, so the
+ * core is looked up once, and then used until sched_core_end().
+ */
+static DEFINE_PER_CPU(struct sched_core_data *, sched_core_cur);
+
+/*
+ * A core is represented by its first sibling.  The sibling map may still
+ * be empty very early during boot, or while a CPU is being brought up.
+ */
+static const cpumask_t *core_siblings(unsigned int cpu)
+{
+    const cpumask_t *siblings = per_cpu(cpu_sibling_mask, cpu);
+
+    return cpumask_test_cpu(cpu, siblings) ? siblings : cpumask_of(cpu);
+}
+
+static struct sched_core_data *core_data(unsigned int cpu)
+{
+    return &per_cpu(sched_core_data, cpumask_first(core_siblings(cpu)));
+}
+
+static void core_account(struct sched_core_data *core,
+                         const cpumask_t *siblings, s_time_t now)
+{
+    s_time_t delta = now - core->stamp;
+    cpumask_t running;
+
+    core->stamp = now;
+    if ( delta <= 0 )
+        return;
+
+    cpumask_and(&running, &core->running, siblings);
+    if ( cpumask_empty(&running) )
+        return;
+    core->busy += delta;
+    if ( cpumask_equal(&running, siblings) && cpumask_weight(siblings) > 1 )
+        core->cosched += delta;
+}
+
+/* Called with the core lock held. */
+static void core_revoke(struct sched_core_data *core,
+                        const cpumask_t *siblings)
+{
+    cpumask_t running;
+
+    if ( core->revoked )
+        return;
+
+    core->revoked = 1;
+    core->forced++;
+    cpumask_and(&running, &core->running, siblings);
+    cpumask_raise_softirq(&running, SCHEDULE_SOFTIRQ);
+}
+
+static void core_timer_fn(void *data)
+{
+    unsigned int cpu = (unsigned long)data;
+    const cpumask_t *siblings = core_siblings(cpu);
+    struct sched_core_data *core = &per_cpu(sched_core_data, cpu);
+    unsigned long flags;
+    cpumask_t waiters;
+
+    spin_lock_irqsave(&core->lock, flags);
+    cpumask_and(&waiters, &core->waiters, siblings);
+    if ( core->owner != NULL && !cpumask_empty(&waiters) &&
+         NOW() >= core->owner_since + MICROSECS(sched_core_slice_us) )
+        core_revoke(core, siblings);
+    spin_unlock_irqrestore(&core->lock, flags);
+}
+
+/*
+ * May @cpu run @v, given what its siblings are running?  Called by the
+ * schedulers from do_schedule, between sched_core_begin() and
+ * sched_core_end().  If not, and @wait is set, @cpu is recorded as
+ * waiting for the core, and is tickled when the owner leaves.  @wait is
+ * clear for vcpus only looked at on another pCPU's runqueue.
+ */
+int sched_core_check(unsigned int cpu, const struct vcpu *v, bool_t wait)
+{
+    const cpumask_t *siblings = core_siblings(cpu);
+    struct sched_core_data *core = per_cpu(sched_core_cur, cpu);
+    cpumask_t others;
+
+    ASSERT(core != NULL && spin_is_locked(&core->lock));
+
+    if ( core->owner == v->domain && !core->revoked )
+        return 1;
+
+    /* Being handed to other siblings: leave it to them. */
+    cpumask_and(&others, &core->handoff, siblings);
+    if ( !cpumask_empty(&others) && !cpumask_test_cpu(cpu, &others) )
+        goto wait;
+
+    /* Nobody else on the core: take it, unless it was just revoked. */
+    cpumask_and(&others, &core->running, siblings);
+    cpumask_clear_cpu(cpu, &others);
+    if ( cpumask_empty(&others) && core->owner != v->domain )
+        return 1;
+
+ wait:
+    if ( wait )
+        cpumask_set_cpu(cpu, &core->waiters);
+    return 0;
+}
+
+void sched_core_begin(unsigned int cpu)
+{
+    struct sched_core_data *core = core_data(cpu);
+
+    spin_lock(&core->lock);
+    per_cpu(sched_core_cur, cpu) = core;
+    cpumask_clear_cpu(cpu, &core->waiters);
+}
+
+void sched_core_end(unsigned int cpu, const struct vcpu *next, s_time_t now)
+{
+    const cpumask_t *siblings = core_siblings(cpu);
+    struct sched_core_data *core = per_cpu(sched_core_cur, cpu);
+    s_time_t *wait_start = &per_cpu(sched_core_wait_start, cpu);
+    cpumask_t waiters;
+    bool_t handed = 0;
+
+    core_account(core, siblings, now);
+
+    /* Last of the siblings the core was handed to: the others may pick. */
+    if ( cpumask_test_cpu(cpu, &core->handoff) )
+    {
+        cpumask_clear_cpu(cpu, &core->handoff);
+        handed = !cpumask_intersects(&core->handoff, siblings);
+    }
+
+    if ( *wait_start )
+    {
+        core->idle_waste += now - *wait_start;
+        *wait_start = 0;
+    }
+
+    if ( !is_idle_vcpu(next) )
+    {
+        if ( core->owner != next->domain )
+        {
+            if ( core->last != next->domain )
+                core->switches++;
+            core->owner = core->last = next->domain;
+            core->owner_id = next->domain->domain_id;
+            core->owner_since = now;
+            core->revoked = 0;
+
+            /* Waiting siblings may want the new owner, or its slice. */
+            cpumask_and(&waiters, &core->waiters, siblings);
+            cpumask_clear_cpu(cpu, &waiters);
+            cpumask_raise_softirq(&waiters, SCHEDULE_SOFTIRQ);
+        }
+        cpumask_set_cpu(cpu, &core->running);
+        goto out;
+    }
+
+    cpumask_clear_cpu(cpu, &core->running);
+
+    if ( core->owner != NULL &&
+         !cpumask_intersects(&core->running, siblings) )
+    {
+        /*
+         * The owner left the core: let the waiting siblings at it.  If it
+         * was revoked, the other waiters pick first, so that this sibling
+         * cannot take the core straight back for the revoked owner.
+         */
+        cpumask_and(&waiters, &core->waiters, siblings);
+        if ( core->revoked )
+        {
+            cpumask_clear_cpu(cpu, &waiters);
+            cpumask_copy(&core->handoff, &waiters);
+        }
+        core->owner = NULL;
+        core->revoked = 0;
+        cpumask_raise_softirq(&waiters, SCHEDULE_SOFTIRQ);
+    }
+    else if ( cpumask_test_cpu(cpu, &core->waiters) )
+    {
+        *wait_start = now;
+        /* Waiting for a handoff, which tickles it when done. */
+        if ( core->owner == NULL )
+            goto out;
+        if ( now >= core->owner_since + MICROSECS(sched_core_slice_us) )
+            core_revoke(core, siblings);
+        else
+        {
+            if ( core->timer.cpu != cpu )
+                migrate_timer(&core->timer, cpu);
+            set_timer(&core->timer,
+                      core->owner_since + MICROSECS(sched_core_slice_us));
+        }
+    }
+
+ out:
+    if ( handed )
+    {
+        cpumask_and(&waiters, &core->waiters, siblings);
+        cpumask_clear_cpu(cpu, &waiters);
+        cpumask_raise_softirq(&waiters, SCHEDULE_SOFTIRQ);
+    }
+    per_cpu(sched_core_cur, cpu) = NULL;
+    spin_unlock(&core->lock);
+}
+
+void sched_core_dump(void)
+{
+    struct sched_core_data *core;
+    const cpumask_t *siblings;
+    unsigned int cpu;
+    s_time_t now = NOW();
+    char cpustr[64];
+
+    if ( !sched_core )
+        return;
+
+    printk("Core scheduling (slice %uus):\n", sched_core_slice_us);
+    for_each_online_cpu ( cpu )
+    {
+        siblings = core_siblings(cpu);
+        if ( cpumask_first(siblings) != cpu )
+            continue;
+        core = core_data(cpu);
+
+        spin_lock(&core->lock);
+        core_account(core, siblings, now);
+        cpumask_scnprintf(cpustr, sizeof(cpustr), siblings);
+        printk("  core %u cpus=%s owner=", cpu, cpustr);
+        if ( core->owner != NULL )
+            printk("d%d", core->owner_id);
+        else
+            printk("none");
+        printk(" switches=%lu forced=%lu busy=%"PRI_stime"ms"
+               " co-scheduled=%"PRI_stime"%% idle-waste=%"PRI_stime"ms\n",
+               core->switches, core->forced, core->busy / MILLISECS(1),
+               core->busy ? core->cosched * 100 / core->busy : 0,
+               core->idle_waste / MILLISECS(1));
+        spin_unlock(&core->lock);
+    }
+}
+
+void sched_core_init_cpu(unsigned int cpu)
+{
+    struct sched_core_data *core = &per_cpu(sched_core_data, cpu);
+
+    spin_lock_init(&core->lock);
+    init_timer(&core->timer, core_timer_fn, (void *)(unsigned long)cpu, cpu);
+}
+
+void sched_core_deinit_cpu(unsigned int cpu)
+{
+    kill_timer(&per_cpu(sched_core_data, cpu).timer);
+}
@@ -23,6 +23,7 @@
 #include <xen/errno.h>
 #include <xen/keyhandler.h>
 #include <xen/trace.h>
+#include <xen/rbtree.h>
 
 
 /*
@@ -62,8 +63,8 @@
 #define CSCHED_DOM(_dom)    ((struct csched_dom *) (_dom)->sched_priv)
 #define RUNQ(_cpu)          (&(CSCHED_PCPU(_cpu)->runq))
 /* Is the first element of _cpu's runq its idle vcpu? */
-#define IS_RUNQ_IDLE(_cpu)  (list_empty(RUNQ(_cpu)) || \
-                             is_idle_vcpu(__runq_elem(RUNQ(_cpu)->next)->vcpu))
+#define IS_RUNQ_IDLE(_cpu)  (RB_EMPTY_ROOT(RUNQ(_cpu)) || \
+                             is_idle_vcpu(__runq_elem(rb_first(RUNQ(_cpu)))->vcpu))
 
 
 /*
@@ -127,8 +128,15 @@ integer_param("sched_credit_tslice_ms", sched_credit_tslice_ms);
  * Physical CPU
  */
 struct csched_pcpu {
-    struct list_head runq;
+    struct rb_root runq;
     uint32_t runq_sort_last;
+    uint32_t runq_seq;
+    /*
+     * Summary of the runq for load balancing: the priority of its first
+     * vcpu, and how many of its vcpus have a useful node-affinity.
+     */
+    int16_t runq_top_pri;
+    uint16_t runq_node_affine;
     struct timer ticker;
     unsigned int tick;
     unsigned int idle_bias;
@@ -149,7 +157,12 @@ struct csched_pcpu {
  * Virtual CPU
  */
 struct csched_vcpu {
-    struct list_head runq_elem;
+    struct rb_node runq_elem;
+    /* Position on the runq: by priority, then credit, then arrival. */
+    int16_t runq_pri;
+    bool_t runq_node_affine;
+    int runq_credit;
+    uint32_t runq_seq;
     struct list_head active_vcpu_elem;
     struct csched_dom *sdom;
     struct vcpu *vcpu;
@@ -214,51 +227,134 @@ static void csched_acct(void *dummy);
 static inline int
 __vcpu_on_runq(struct csched_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
 static inline struct csched_vcpu *
-__runq_elem(struct list_head *elem)
+__runq_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct csched_vcpu, runq_elem);
+}
+
+static inline int __vcpu_has_node_affinity(const struct vcpu *vc,
+                                           const cpumask_t *mask);
+
+/* Does a go before b on the runq? */
+static inline int
+__runq_before(const struct csched_vcpu *a, const struct csched_vcpu *b)
+{
+    if ( a->runq_pri != b->runq_pri )
+        return a->runq_pri > b->runq_pri;
+    if ( a->runq_credit != b->runq_credit )
+        return a->runq_credit > b->runq_credit;
+    return (int32_t)(a->runq_seq - b->runq_seq) < 0;
+}
+
+static inline void
+__runq_update_summary(struct csched_pcpu *spc)
+{
+    spc->runq_top_pri = RB_EMPTY_ROOT(&spc->runq) ? CSCHED_PRI_IDLE :
+                        __runq_elem(rb_first(&spc->runq))->runq_pri;
+}
+
+/* Link svc into the runq at the position given by its runq_* keys. */
+static inline void
+__runq_link(struct csched_pcpu *spc, struct csched_vcpu *svc)
 {
-    return list_entry(elem, struct csched_vcpu, runq_elem);
+    struct rb_node **link = &spc->runq.rb_node, *parent = NULL;
+
+    while ( *link )
+    {
+        parent = *link;
+        if ( __runq_before(svc, __runq_elem(parent)) )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &spc->runq);
+
+    if ( svc->runq_node_affine )
+        spc->runq_node_affine++;
+    __runq_update_summary(spc);
+}
+
+static inline void
+__runq_unlink(struct csched_pcpu *spc, struct csched_vcpu *svc)
+{
+    rb_erase(&svc->runq_elem, &spc->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
+
+    if ( svc->runq_node_affine )
+        spc->runq_node_affine--;
+    __runq_update_summary(spc);
+}
+
+/*
+ * The first vcpu on the runq of strictly lower priority than pri, or NULL.
+ */
+static inline struct csched_vcpu *
+__runq_first_below(const struct csched_pcpu *spc, int pri)
+{
+    struct rb_node *node = spc->runq.rb_node;
+    struct csched_vcpu *first = NULL, *iter_svc;
+
+    while ( node )
+    {
+        iter_svc = __runq_elem(node);
+        if ( iter_svc->runq_pri < pri )
+        {
+            first = iter_svc;
+            node = node->rb_left;
+        }
+        else
+            node = node->rb_right;
+    }
+
+    return first;
 }
 
 static inline void
 __runq_insert(unsigned int cpu, struct csched_vcpu *svc)
 {
-    const struct list_head * const runq = RUNQ(cpu);
-    struct list_head *iter;
+    struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
+    const struct csched_vcpu *below;
 
     BUG_ON( __vcpu_on_runq(svc) );
     BUG_ON( cpu != svc->vcpu->processor );
 
-    list_for_each( iter, runq )
-    {
-        const struct csched_vcpu * const iter_svc = __runq_elem(iter);
-        if ( svc->pri > iter_svc->pri )
-            break;
-    }
+    svc->runq_pri = svc->pri;
+    svc->runq_credit = atomic_read(&svc->credit);
+    svc->runq_seq = spc->runq_seq++;
+    svc->runq_node_affine = !is_idle_vcpu(svc->vcpu) &&
+        __vcpu_has_node_affinity(svc->vcpu, svc->vcpu->cpu_affinity);
 
     /* If the vcpu yielded, try to put it behind one lower-priority
      * runnable vcpu if we can.  The next runq_sort will bring it forward
-     * within 30ms if the queue too long. */
-    if ( test_bit(CSCHED_FLAG_VCPU_YIELD, &svc->flags)
-         && __runq_elem(iter)->pri > CSCHED_PRI_IDLE )
+     * within 30ms if the queue too long.  Taking that vcpu's place in the
+     * order puts us right behind it, as ties go to the right. */
+    if ( test_bit(CSCHED_FLAG_VCPU_YIELD, &svc->flags) )
     {
-        iter=iter->next;
-
-        /* Some sanity checks */
-        BUG_ON(iter == runq);
+        below = __runq_first_below(spc, svc->pri);
+        if ( below != NULL && below->runq_pri > CSCHED_PRI_IDLE )
+        {
+            svc->runq_pri = below->runq_pri;
+            svc->runq_credit = below->runq_credit;
+            svc->runq_seq = below->runq_seq;
+        }
+        else
+            svc->runq_credit = INT_MIN;
     }
 
-    list_add_tail(&svc->runq_elem, iter);
+    __runq_link(spc, svc);
 }
 
 static inline void
 __runq_remove(struct csched_vcpu *svc)
 {
     BUG_ON( !__vcpu_on_runq(svc) );
-    list_del_init(&svc->runq_elem);
+    __runq_unlink(CSCHED_PCPU(svc->vcpu->processor), svc);
 }
 
 /*
@@ -545,7 +641,8 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
     init_timer(&spc->ticker, csched_tick, (void *)(unsigned long)cpu, cpu);
     set_timer(&spc->ticker, NOW() + MICROSECS(prv->tick_period_us) );
 
-    INIT_LIST_HEAD(&spc->runq);
+    spc->runq = RB_ROOT;
+    spc->runq_top_pri = CSCHED_PRI_IDLE;
     spc->runq_sort_last = prv->runq_sort;
     spc->idle_bias = nr_cpu_ids - 1;
     if ( per_cpu(schedule_data, cpu).sched_priv == NULL )
@@ -889,7 +986,7 @@ csched_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
     if ( svc == NULL )
         return NULL;
 
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
     INIT_LIST_HEAD(&svc->active_vcpu_elem);
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -914,7 +1011,7 @@ csched_free_vdata(const struct scheduler *ops, void *priv)
 {
     struct csched_vcpu *svc = priv;
 
-    BUG_ON( !list_empty(&svc->runq_elem) );
+    BUG_ON( __vcpu_on_runq(svc) );
 
     xfree(svc);
 }
@@ -946,7 +1043,7 @@ csched_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spin_unlock_irqrestore(&(prv->lock), flags);
 
     BUG_ON( sdom == NULL );
-    BUG_ON( !list_empty(&svc->runq_elem) );
+    BUG_ON( __vcpu_on_runq(svc) );
 }
 
 static void
@@ -1171,17 +1268,18 @@ csched_dom_destroy(const struct scheduler *ops, struct domain *dom)
 }
 
 /*
- * This is a O(n) optimized sort of the runq.
+ * Re-sort the runq after accounting has changed priorities.
  *
- * Time-share VCPUs can only be one of two priorities, UNDER or OVER. We walk
- * through the runq and move up any UNDERs that are preceded by OVERS. We
- * remember the last UNDER to make the move up operation O(1).
+ * Time-share VCPUs can only be one of two priorities, UNDER or OVER.  The
+ * runq is ordered by the priority each vcpu had when it was queued, so we
+ * walk through it once and re-queue, O(log n) each, only the vcpus whose
+ * priority has changed since.
  */
 static void
 csched_runq_sort(struct csched_private *prv, unsigned int cpu)
 {
     struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
-    struct list_head *runq, *elem, *next, *last_under;
+    struct rb_node *elem, *next;
     struct csched_vcpu *svc_elem;
     spinlock_t *lock;
     unsigned long flags;
@@ -1195,27 +1293,20 @@ csched_runq_sort(struct csched_private *prv, unsigned int cpu)
 
     lock = pcpu_schedule_lock_irqsave(cpu, &flags);
 
-    runq = &spc->runq;
-    elem = runq->next;
-    last_under = runq;
-
-    while ( elem != runq )
+    for ( elem = rb_first(&spc->runq); elem != NULL; elem = next )
     {
-        next = elem->next;
+        next = rb_next(elem);
         svc_elem = __runq_elem(elem);
 
-        if ( svc_elem->pri >= CSCHED_PRI_TS_UNDER )
+        /* does elem need to move on the runq? */
+        if ( svc_elem->runq_pri != svc_elem->pri )
         {
-            /* does elem need to move up the runq? */
-            if ( elem->prev != last_under )
-            {
-                list_del(elem);
-                list_add(elem, last_under);
-            }
-            last_under = elem;
+            __runq_unlink(spc, svc_elem);
+            svc_elem->runq_pri = svc_elem->pri;
+            svc_elem->runq_credit = atomic_read(&svc_elem->credit);
+            svc_elem->runq_seq = spc->runq_seq++;
+            __runq_link(spc, svc_elem);
         }
-
-        elem = next;
     }
 
     pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
@@ -1447,7 +1538,7 @@ csched_tick(void *_cpu)
      * Check if runq needs to be sorted
      *
      * Every physical CPU resorts the runq after the accounting master has
-     * modified priorities. This is a special O(n) sort and runs at most
+     * modified priorities. This is a single O(n) pass and runs at most
      * once per accounting period (currently 30 milliseconds).
      */
     csched_runq_sort(prv, cpu);
@@ -1458,19 +1549,24 @@ csched_tick(void *_cpu)
 static struct csched_vcpu *
 csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
 {
-    const struct csched_pcpu * const peer_pcpu = CSCHED_PCPU(peer_cpu);
+    struct csched_pcpu * const peer_pcpu = CSCHED_PCPU(peer_cpu);
     const struct vcpu * const peer_vcpu = curr_on_cpu(peer_cpu);
     struct csched_vcpu *speer;
-    struct list_head *iter;
+    struct rb_node *iter;
     struct vcpu *vc;
 
     /*
      * Don't steal from an idle CPU's runq because it's about to
-     * pick up work from it itself.
+     * pick up work from it itself.  Nor, going by the runq summary,
+     * from a runq with nothing of higher priority than ours, or with no
+     * node-affine vcpu on it in the node-affinity step.
      */
-    if ( peer_pcpu != NULL && !is_idle_vcpu(peer_vcpu) )
+    if ( peer_pcpu != NULL && !is_idle_vcpu(peer_vcpu)
+         && peer_pcpu->runq_top_pri > pri
+         && (balance_step != CSCHED_BALANCE_NODE_AFFINITY
+             || peer_pcpu->runq_node_affine) )
     {
-        list_for_each( iter, &peer_pcpu->runq )
+        for ( iter = rb_first(&peer_pcpu->runq); iter; iter = rb_next(iter) )
         {
             speer = __runq_elem(iter);
 
@@ -1485,17 +1581,14 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
             vc = speer->vcpu;
             BUG_ON( is_idle_vcpu(vc) );
 
+            /* Nor if our siblings run another domain (core scheduling). */
+            if ( !sched_core_may_steal(cpu, vc) )
+                continue;
+
             /*
              * If the vcpu has no useful node-affinity, skip this vcpu.
              * In fact, what we want is to check if we have any node-affine
              * work to steal, before starting to look at vcpu-affine work.
-             *
-             * Notice that, if not even one vCPU on this runq has a useful
-             * node-affinity, we could have avoid considering this runq for
-             * a node balancing step in the first place. This, for instance,
-             * can be implemented by taking note of on what runq there are
-             * vCPUs with useful node-affinities in some sort of bitmap
-             * or counter.
              */
             if ( balance_step == CSCHED_BALANCE_NODE_AFFINITY
                  && !__vcpu_has_node_affinity(vc, vc->cpu_affinity) )
@@ -1626,10 +1719,11 @@ csched_schedule(
     const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
 {
     const int cpu = smp_processor_id();
-    struct list_head * const runq = RUNQ(cpu);
+    struct rb_root * const runq = RUNQ(cpu);
     struct csched_vcpu * const scurr = CSCHED_VCPU(current);
     struct csched_private *prv = CSCHED_PRIV(ops);
     struct csched_vcpu *snext;
+    struct rb_node *iter;
     struct task_slice ret;
     s_time_t runtime, tslice;
 
@@ -1670,7 +1764,8 @@ csched_schedule(
          && prv->ratelimit_us
          && vcpu_runnable(current)
          && !is_idle_vcpu(current)
-         && runtime < MICROSECS(prv->ratelimit_us) )
+         && runtime < MICROSECS(prv->ratelimit_us)
+         && sched_core_allowed(cpu, current) )
     {
         snext = scurr;
         snext->start_time += now;
@@ -1687,9 +1782,21 @@ csched_schedule(
     if ( vcpu_runnable(current) )
         __runq_insert(cpu, scurr);
     else
-        BUG_ON( is_idle_vcpu(current) || list_empty(runq) );
+        BUG_ON( is_idle_vcpu(current) || RB_EMPTY_ROOT(runq) );
 
-    snext = __runq_elem(runq->next);
+    iter = rb_first(runq);
+    snext = __runq_elem(iter);
+
+    /*
+     * In core scheduling mode, skip the vcpus our siblings won't let us
+     * run.  The idle vcpu is always allowed, so this stops at the latest
+     * there.
+     */
+    while ( !sched_core_allowed(cpu, snext->vcpu) )
+    {
+        iter = rb_next(iter);
+        snext = __runq_elem(iter);
+    }
     ret.migrated = 0;
 
     /* Tasklet work (which runs in idle VCPU context) overrides all else. */
@@ -1781,7 +1888,8 @@ csched_dump_vcpu(struct csched_vcpu *svc)
 static void
 csched_dump_pcpu(const struct scheduler *ops, int cpu)
 {
-    struct list_head *runq, *iter;
+    struct rb_root *runq;
+    struct rb_node *iter;
     struct csched_pcpu *spc;
     struct csched_vcpu *svc;
     int loop;
@@ -1804,7 +1912,7 @@ csched_dump_pcpu(const struct scheduler *ops, int cpu)
     }
 
     loop = 0;
-    list_for_each( iter, runq )
+    for ( iter = rb_first(runq); iter; iter = rb_next(iter) )
     {
         svc = __runq_elem(iter);
         if ( svc )
@@ -45,6 +45,8 @@
 #define TRC_CSCHED2_RUNQ_ASSIGN      TRC_SCHED_CLASS_EVT(CSCHED2, 10)
 #define TRC_CSCHED2_UPDATE_VCPU_LOAD TRC_SCHED_CLASS_EVT(CSCHED2, 11)
 #define TRC_CSCHED2_UPDATE_RUNQ_LOAD TRC_SCHED_CLASS_EVT(CSCHED2, 12)
+#define TRC_CSCHED2_MIGRATE          TRC_SCHED_CLASS_EVT(CSCHED2, 13)
+#define TRC_CSCHED2_LOAD_BALANCE     TRC_SCHED_CLASS_EVT(CSCHED2, 14)
 
 /*
  * WARNING: This is still in an experimental phase.  Status and work can be found at the
@@ -194,6 +196,48 @@ integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 int opt_overload_balance_tolerance=-3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 
+/*
+ * Runqueue granularity: the CPUs sharing a core (hyperthreads), a last
+ * level cache, or a socket share a runqueue.
+ */
+#define OPT_RUNQUEUE_CORE   0
+#define OPT_RUNQUEUE_LLC    1
+#define OPT_RUNQUEUE_SOCKET 2
+static const char *const opt_runqueue_str[] = {
+    [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_LLC] = "llc",
+    [OPT_RUNQUEUE_SOCKET] = "socket"
+};
+int opt_runqueue = OPT_RUNQUEUE_SOCKET;
+
+static void __init parse_credit2_runqueue(char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+    }
+
+    printk("WARNING, unrecognized value of credit2_runqueue option!\n");
+}
+custom_param("credit2_runqueue", parse_credit2_runqueue);
+
+/*
+ * Load balancing levels.  A CPU balances with the runqueues that share
+ * its last level cache first, then with those on its socket, its node,
+ * and only then anywhere.
+ */
+#define BALANCE_LLC         0
+#define BALANCE_SOCKET      1
+#define BALANCE_NODE        2
+#define BALANCE_ANY         3
+#define BALANCE_LEVELS      4
+
 /*
  * Per-runqueue data
  */
@@ -213,6 +257,9 @@ struct csched_runqueue_data {
     s_time_t load_last_update;  /* Last time average was updated */
     s_time_t avgload;           /* Decaying queue load */
     s_time_t b_avgload;         /* Decaying queue load modified by balancing */
+
+    unsigned int migrations_in, migrations_out; /* vcpus moved in and out */
+    unsigned int balanced[BALANCE_LEVELS]; /* Balancing moves, by level */
 };
 
 /*
@@ -1222,6 +1269,24 @@ void migrate(const struct scheduler *ops,
             update_load(ops, svc->rqd, svc, -1, now);
             on_runq=1;
         }
+        svc->rqd->migrations_out++;
+        trqd->migrations_in++;
+
+        /* TRACE */
+        {
+            struct {
+                unsigned dom:16,vcpu:16;
+                unsigned rqi:16,trqi:16;
+            } d;
+            d.dom = svc->vcpu->domain->domain_id;
+            d.vcpu = svc->vcpu->vcpu_id;
+            d.rqi = svc->rqd->id;
+            d.trqi = trqd->id;
+            trace_var(TRC_CSCHED2_MIGRATE, 1,
+                      sizeof(d),
+                      (unsigned char *)&d);
+        }
+
         __runq_deassign(svc);
         svc->vcpu->processor = cpumask_any(&trqd->active);
         __runq_assign(svc, trqd);
@@ -1235,17 +1300,60 @@ void migrate(const struct scheduler *ops,
 }
 
 
+/* How far apart two runqueues are, as a load balancing level. */
+static int runq_distance(const struct csched_runqueue_data *a,
+                         const struct csched_runqueue_data *b)
+{
+    unsigned int ca = cpumask_first(&a->active);
+    unsigned int cb = cpumask_first(&b->active);
+
+    if ( cpu_to_llc(ca) == cpu_to_llc(cb) )
+        return BALANCE_LLC;
+    if ( cpu_to_socket(ca) == cpu_to_socket(cb) )
+        return BALANCE_SOCKET;
+    if ( cpu_to_node(ca) == cpu_to_node(cb) )
+        return BALANCE_NODE;
+    return BALANCE_ANY;
+}
+
+/* Is the load difference between st->lrqd and st->orqd worth balancing? */
+static int balance_worthwhile(struct csched_private *prv,
+                              const balance_state_t *st)
+{
+    s_time_t load_max;
+    int cpus_max, i;
+
+    load_max = st->lrqd->b_avgload;
+    if ( st->orqd->b_avgload > load_max )
+        load_max = st->orqd->b_avgload;
+
+    cpus_max = cpumask_weight(&st->lrqd->active);
+    i = cpumask_weight(&st->orqd->active);
+    if ( i > cpus_max )
+        cpus_max = i;
+
+    /* If we're under 100% capacaty, only shift if load difference
+     * is > 1.  otherwise, shift if under 12.5% */
+    if ( load_max < (1ULL<<(prv->load_window_shift))*cpus_max )
+        return st->load_delta >= (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance));
+    else
+        return st->load_delta >= (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance));
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched_private *prv = CSCHED_PRIV(ops);
-    int i, max_delta_rqi = -1;
+    int i, level, level_rqi[BALANCE_LEVELS];
+    s_time_t level_delta[BALANCE_LEVELS];
     struct list_head *push_iter, *pull_iter;
 
     balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
     
     /*
      * Basic algorithm: Push, pull, or swap.
-     * - Find the runqueue with the furthest load distance
+     * - Find the runqueue with the furthest load distance, at each
+     *   level of the topology
+     * - Pick the nearest of those worth balancing with
      * - Find a pair that makes the difference the least (where one
      * on either side may be empty).
      */
@@ -1261,7 +1369,11 @@ retry:
     if ( !spin_trylock(&prv->lock) )
         return;
 
-    st.load_delta = 0;
+    for ( level = 0; level < BALANCE_LEVELS; level++ )
+    {
+        level_delta[level] = 0;
+        level_rqi[level] = -1;
+    }
 
     for_each_cpu(i, &prv->active_queues)
     {
@@ -1279,10 +1391,11 @@ retry:
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        level = runq_distance(st.lrqd, st.orqd);
+        if ( delta > level_delta[level] )
         {
-            st.load_delta = delta;
-            max_delta_rqi = i;
+            level_delta[level] = delta;
+            level_rqi[level] = i;
         }
 
         spin_unlock(&st.orqd->lock);
@@ -1290,40 +1403,25 @@ retry:
 
     /* Minimize holding the big lock */
     spin_unlock(&prv->lock);
-    if ( max_delta_rqi == -1 )
-        goto out;
 
+    /* Balance with the nearest runqueue that is out of balance enough. */
+    for ( level = 0; level < BALANCE_LEVELS; level++ )
     {
-        s_time_t load_max;
-        int cpus_max;
+        if ( level_rqi[level] == -1 )
+            continue;
 
-        
-        load_max = st.lrqd->b_avgload;
-        if ( st.orqd->b_avgload > load_max )
-            load_max = st.orqd->b_avgload;
-
-        cpus_max = cpumask_weight(&st.lrqd->active);
-        i = cpumask_weight(&st.orqd->active);
-        if ( i > cpus_max )
-            cpus_max = i;
-
-        /* If we're under 100% capacaty, only shift if load difference
-         * is > 1.  otherwise, shift if under 12.5% */
-        if ( load_max < (1ULL<<(prv->load_window_shift))*cpus_max )
-        {
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_underload_balance_tolerance) ) )
-                 goto out;
-        }
-        else
-            if ( st.load_delta < (1ULL<<(prv->load_window_shift+opt_overload_balance_tolerance)) )
-                goto out;
+        st.orqd = prv->rqd + level_rqi[level];
+        st.load_delta = level_delta[level];
+        if ( balance_worthwhile(prv, &st) )
+            break;
     }
+    if ( level == BALANCE_LEVELS )
+        goto out;
              
     /* Try to grab the other runqueue lock; if it's been taken in the
      * meantime, try the process over again.  This can't deadlock
      * because if it doesn't get any other rqd locks, it will simply
      * give up and return. */
-    st.orqd = prv->rqd + max_delta_rqi;
     if ( !spin_trylock(&st.orqd->lock) )
         goto retry;
 
@@ -1381,6 +1479,26 @@ retry:
     }
 
     /* OK, now we have some candidates; do the moving */
+    if ( st.best_push_svc || st.best_pull_svc )
+    {
+        st.lrqd->balanced[level]++;
+
+        /* TRACE */
+        {
+            struct {
+                unsigned lrqi:16,orqi:16;
+                unsigned level;
+                uint64_t load_delta;
+            } __attribute__((packed)) d;
+            d.lrqi = st.lrqd->id;
+            d.orqi = st.orqd->id;
+            d.level = level;
+            d.load_delta = level_delta[level];
+            trace_var(TRC_CSCHED2_LOAD_BALANCE, 1,
+                      sizeof(d),
+                      (unsigned char *)&d);
+        }
+    }
     if ( st.best_push_svc )
         migrate(ops, st.best_push_svc, st.orqd, now);
     if ( st.best_pull_svc )
@@ -1617,7 +1735,7 @@ runq_candidate(struct csched_runqueue_data *rqd,
     struct csched_vcpu *snext = NULL;
 
     /* Default to current if runnable, idle otherwise */
-    if ( vcpu_runnable(scurr->vcpu) )
+    if ( vcpu_runnable(scurr->vcpu) && sched_core_allowed(cpu, scurr->vcpu) )
         snext = scurr;
     else
         snext = CSCHED_VCPU(idle_vcpu[cpu]);
@@ -1626,6 +1744,10 @@ runq_candidate(struct csched_runqueue_data *rqd,
     {
         struct csched_vcpu * svc = list_entry(iter, struct csched_vcpu, runq_elem);
 
+        /* In core scheduling mode, skip what our siblings won't allow. */
+        if ( !sched_core_allowed(cpu, svc->vcpu) )
+            continue;
+
         /* If this is on a different processor, don't pull it unless
          * its credit is at least CSCHED_MIGRATE_RESIST higher. */
         if ( svc->vcpu->processor != cpu
@@ -1866,25 +1988,40 @@ csched_dump(const struct scheduler *ops)
     int i, loop;
 
     printk("Active queues: %d\n"
-           "\tdefault-weight     = %d\n",
+           "\tdefault-weight     = %d\n"
+           "\trunqueue           = %s\n",
            cpumask_weight(&prv->active_queues),
-           CSCHED_DEFAULT_WEIGHT);
+           CSCHED_DEFAULT_WEIGHT,
+           opt_runqueue_str[opt_runqueue]);
     for_each_cpu(i, &prv->active_queues)
     {
+        struct csched_runqueue_data *rqd = prv->rqd + i;
         s_time_t fraction;
+        char cpustr[100];
         
-        fraction = prv->rqd[i].avgload * 100 / (1ULL<<prv->load_window_shift);
+        fraction = rqd->avgload * 100 / (1ULL<<prv->load_window_shift);
+        cpulist_scnprintf(cpustr, sizeof(cpustr), &rqd->active);
 
         printk("Runqueue %d:\n"
                "\tncpus              = %u\n"
+               "\tcpus               = %s\n"
                "\tmax_weight         = %d\n"
                "\tinstload           = %d\n"
-               "\taveload            = %3"PRI_stime"\n",
+               "\taveload            = %3"PRI_stime"\n"
+               "\tmigrations         = %u in, %u out\n"
+               "\tbalanced           = %u llc, %u socket, %u node, %u other\n",
                i,
-               cpumask_weight(&prv->rqd[i].active),
-               prv->rqd[i].max_weight,
-               prv->rqd[i].load,
-               fraction);
+               cpumask_weight(&rqd->active),
+               cpustr,
+               rqd->max_weight,
+               rqd->load,
+               fraction,
+               rqd->migrations_in,
+               rqd->migrations_out,
+               rqd->balanced[BALANCE_LLC],
+               rqd->balanced[BALANCE_SOCKET],
+               rqd->balanced[BALANCE_NODE],
+               rqd->balanced[BALANCE_ANY]);
 
     }
     /* FIXME: Locking! */
@@ -1922,6 +2059,8 @@ static void activate_runqueue(struct csched_private *prv, int rqi)
 
     rqd->max_weight = 1;
     rqd->id = rqi;
+    rqd->migrations_in = rqd->migrations_out = 0;
+    memset(rqd->balanced, 0, sizeof(rqd->balanced));
     INIT_LIST_HEAD(&rqd->svc);
     INIT_LIST_HEAD(&rqd->runq);
     spin_lock_init(&rqd->lock);
@@ -1942,6 +2081,39 @@ static void deactivate_runqueue(struct csched_private *prv, int rqi)
     cpumask_clear_cpu(rqi, &prv->active_queues);
 }
 
+/* Do cpus a and b belong on the same runqueue? */
+static int same_runqueue(unsigned int a, unsigned int b)
+{
+    switch ( opt_runqueue )
+    {
+    case OPT_RUNQUEUE_CORE:
+        return cpumask_test_cpu(a, per_cpu(cpu_sibling_mask, b));
+    case OPT_RUNQUEUE_LLC:
+        return cpu_to_llc(a) == cpu_to_llc(b);
+    default:
+        return cpu_to_socket(a) == cpu_to_socket(b);
+    }
+}
+
+/*
+ * The runqueue of a cpu: that of any cpu already set up that belongs on
+ * the same one, or else the first free one.
+ */
+static int cpu_runqueue(struct csched_private *prv, unsigned int cpu)
+{
+    unsigned int peer;
+    int rqi;
+
+    for_each_cpu ( peer, &prv->initialized )
+        if ( same_runqueue(peer, cpu) )
+            return prv->runq_map[peer];
+
+    for ( rqi = 0; cpumask_test_cpu(rqi, &prv->active_queues); rqi++ )
+        continue;
+
+    return rqi;
+}
+
 static void init_pcpu(const struct scheduler *ops, int cpu)
 {
     int rqi;
@@ -1960,21 +2132,13 @@ static void init_pcpu(const struct scheduler *ops, int cpu)
     }
 
     /* Figure out which runqueue to put it in */
-    rqi = 0;
-
-    /* Figure out which runqueue to put it in */
-    /* NB: cpu 0 doesn't get a STARTING callback, so we hard-code it to runqueue 0. */
-    if ( cpu == 0 )
-        rqi = 0;
-    else
-        rqi = cpu_to_socket(cpu);
-
-    if ( rqi < 0 )
-    {
-        printk("%s: cpu_to_socket(%d) returned %d!\n",
-               __func__, cpu, rqi);
-        BUG();
-    }
+    /*
+     * NB: cpu 0 doesn't get a STARTING callback, and is set up before
+     * its topology is known.  It is the first cpu, so it gets runqueue 0;
+     * the others compare themselves with it later, once it is known.
+     */
+    rqi = cpu_runqueue(prv, cpu);
+    BUG_ON(rqi >= nr_cpu_ids);
 
     rqd=prv->rqd + rqi;
 
@@ -2125,6 +2289,7 @@ csched_init(struct scheduler *ops)
     printk(" load_window_shift: %d\n", opt_load_window_shift);
     printk(" underload_balance_tolerance: %d\n", opt_underload_balance_tolerance);
     printk(" overload_balance_tolerance: %d\n", opt_overload_balance_tolerance);
+    printk(" runqueues: one per %s\n", opt_runqueue_str[opt_runqueue]);
 
     if ( opt_load_window_shift < LOADAVG_WINDOW_SHIFT_MIN )
     {
@@ -0,0 +1,1069 @@
+/*****************************************************************************
+ * Real-time deferrable server (RTDS) scheduler
+ *
+ *        File: common/sched_rt.c
+ *
+ * Description: Global EDF scheduling of vcpus as deferrable servers.
+ *
+ * Every vcpu is a server with a budget and a period.  At the start of each
+ * period the budget is refilled and the deadline moves to the end of the
+ * period.  The budget is only used up while the vcpu runs: a vcpu that
+ * blocks keeps what is left of it until the end of the period (this is
+ * what makes the server "deferrable"), but does not carry it over.
+ *
+ * All the cpus of a pool share one runqueue, ordered by deadline, and one
+ * lock, which is the schedule lock of each of them.  A cpu runs the
+ * runnable vcpu with budget left and the earliest deadline that may run
+ * on it (global EDF).  Pinning every vcpu to one cpu, or giving each cpu
+ * a cpupool of its own, turns this into partitioned EDF.
+ *
+ * Vcpus that have used up their budget wait on the depleted queue.  The
+ * ends of the periods of runnable vcpus are kept on the replenishment
+ * queue, which drives a single timer per pool.  A vcpu that is still
+ * runnable, with budget left, when its period ends has missed its
+ * deadline: that is counted, and traced.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/domain.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+#include <xen/sched-if.h>
+#include <xen/softirq.h>
+#include <xen/errno.h>
+#include <xen/trace.h>
+#include <xen/cpu.h>
+
+/*
+ * RTDS tracing events.  Check include/public/trace.h for more details.
+ */
+#define TRC_RTDS_TICKLE           TRC_SCHED_CLASS_EVT(RTDS, 1)
+#define TRC_RTDS_RUNQ_PICK        TRC_SCHED_CLASS_EVT(RTDS, 2)
+#define TRC_RTDS_BUDGET_BURN      TRC_SCHED_CLASS_EVT(RTDS, 3)
+#define TRC_RTDS_BUDGET_REPLENISH TRC_SCHED_CLASS_EVT(RTDS, 4)
+#define TRC_RTDS_DEADLINE_MISS    TRC_SCHED_CLASS_EVT(RTDS, 5)
+
+/*
+ * Default server of a vcpu, and the smallest ones allowed: below some
+ * tens of microseconds the scheduler overhead is larger than the budget.
+ */
+#define RTDS_DEFAULT_PERIOD     MICROSECS(10000)
+#define RTDS_DEFAULT_BUDGET     MICROSECS(4000)
+#define RTDS_MIN_PERIOD         MICROSECS(XEN_DOMCTL_RTDS_MIN_PERIOD)
+#define RTDS_MIN_BUDGET         MICROSECS(XEN_DOMCTL_RTDS_MIN_BUDGET)
+
+/*
+ * Flags
+ */
+/* The vcpu is running, or its context has not been saved yet. */
+#define __RTDS_scheduled          1
+/* Put the vcpu back on a queue once its context has been saved. */
+#define __RTDS_delayed_runq_add   2
+
+/*
+ * Useful macros
+ */
+#define RT_PRIV(_ops)     ((struct rt_private *)((_ops)->sched_data))
+#define RT_VCPU(_vcpu)    ((struct rt_vcpu *) (_vcpu)->sched_priv)
+#define RT_DOM(_dom)      ((struct rt_dom *) (_dom)->sched_priv)
+
+/*
+ * System-wide private data
+ */
+struct rt_private {
+    spinlock_t lock;            /* Schedule lock of all the pool's cpus */
+    struct list_head sdom;      /* All domains, for the dump */
+    struct list_head runq;      /* Runnable vcpus with budget, by deadline */
+    struct list_head depletedq; /* Runnable vcpus without budget */
+    struct list_head replq;     /* Runnable vcpus, by end of period */
+    struct timer repl_timer;    /* Fires at the head of replq */
+    unsigned int repl_cpu;      /* Where repl_timer runs */
+    cpumask_t cpus;             /* Cpus of the pool */
+    cpumask_t tickled;          /* Cpus told to reschedule, not done yet */
+};
+
+/*
+ * Virtual CPU
+ */
+struct rt_vcpu {
+    struct list_head q_elem;     /* On runq or depletedq */
+    struct list_head replq_elem; /* On replq */
+    struct list_head sdom_elem;  /* On the domain's vcpu list */
+    struct rt_dom *sdom;
+    struct vcpu *vcpu;
+
+    s_time_t period;
+    s_time_t budget;
+
+    s_time_t cur_budget;         /* Budget left in this period */
+    s_time_t cur_deadline;       /* End of this period */
+    s_time_t last_start;         /* When the budget was last burnt */
+
+    unsigned flags;
+    unsigned int misses;         /* Deadline misses */
+};
+
+/*
+ * Domain
+ */
+struct rt_dom {
+    struct list_head vcpu;       /* Its vcpus */
+    struct list_head sdom_elem;  /* On rt_private's list */
+    struct domain *dom;
+};
+
+static inline struct rt_vcpu *
+__q_elem(struct list_head *elem)
+{
+    return list_entry(elem, struct rt_vcpu, q_elem);
+}
+
+static inline struct rt_vcpu *
+__replq_elem(struct list_head *elem)
+{
+    return list_entry(elem, struct rt_vcpu, replq_elem);
+}
+
+static inline int
+__vcpu_on_q(const struct rt_vcpu *svc)
+{
+    return !list_empty(&svc->q_elem);
+}
+
+static inline int
+__vcpu_on_replq(const struct rt_vcpu *svc)
+{
+    return !list_empty(&svc->replq_elem);
+}
+
+/*
+ * A vcpu with budget goes on the runqueue, after those with the same
+ * deadline; one without on the depleted queue, until its next period.
+ */
+static void
+__q_insert(const struct scheduler *ops, struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct list_head *iter;
+
+    ASSERT(spin_is_locked(&prv->lock));
+    ASSERT(!__vcpu_on_q(svc));
+    ASSERT(!is_idle_vcpu(svc->vcpu));
+
+    if ( svc->cur_budget <= 0 )
+    {
+        list_add_tail(&svc->q_elem, &prv->depletedq);
+        return;
+    }
+
+    list_for_each ( iter, &prv->runq )
+        if ( svc->cur_deadline < __q_elem(iter)->cur_deadline )
+            break;
+    list_add_tail(&svc->q_elem, iter);
+}
+
+static inline void
+__q_remove(struct rt_vcpu *svc)
+{
+    ASSERT(__vcpu_on_q(svc));
+    list_del_init(&svc->q_elem);
+}
+
+/* Returns whether the vcpu is now the first one to replenish. */
+static int
+__replq_link(struct rt_private *prv, struct rt_vcpu *svc)
+{
+    struct list_head *iter;
+
+    ASSERT(!__vcpu_on_replq(svc));
+
+    list_for_each ( iter, &prv->replq )
+        if ( svc->cur_deadline < __replq_elem(iter)->cur_deadline )
+            break;
+    list_add_tail(&svc->replq_elem, iter);
+
+    return prv->replq.next == &svc->replq_elem;
+}
+
+static void
+__replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+
+    if ( __replq_link(prv, svc) )
+        set_timer(&prv->repl_timer, svc->cur_deadline);
+}
+
+static void
+__replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    int first = prv->replq.next == &svc->replq_elem;
+
+    list_del_init(&svc->replq_elem);
+
+    if ( !first )
+        return;
+    if ( list_empty(&prv->replq) )
+        stop_timer(&prv->repl_timer);
+    else
+        set_timer(&prv->repl_timer,
+                  __replq_elem(prv->replq.next)->cur_deadline);
+}
+
+/* Start the period that contains now, with a full budget. */
+static void
+rt_update_deadline(struct rt_vcpu *svc, s_time_t now)
+{
+    ASSERT(now >= svc->cur_deadline);
+
+    /* A vcpu that never ran starts its first period now. */
+    if ( svc->cur_deadline == 0 )
+        svc->cur_deadline = now;
+
+    svc->cur_deadline += ((now - svc->cur_deadline) / svc->period + 1) *
+                         svc->period;
+    svc->cur_budget = svc->budget;
+
+    /* TRACE */
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned deadline_lo, deadline_hi;
+            unsigned budget;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.deadline_lo = (unsigned)svc->cur_deadline;
+        d.deadline_hi = (unsigned)(svc->cur_deadline >> 32);
+        d.budget = svc->cur_budget;
+        trace_var(TRC_RTDS_BUDGET_REPLENISH, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
+/* Charge a running vcpu for the time since it was last charged. */
+static void
+burn_budget(struct rt_vcpu *svc, s_time_t now)
+{
+    s_time_t delta;
+
+    if ( is_idle_vcpu(svc->vcpu) )
+        return;
+
+    delta = now - svc->last_start;
+    svc->last_start = now;
+    if ( delta <= 0 || svc->cur_budget <= 0 )
+        return;
+
+    svc->cur_budget -= delta;
+    if ( svc->cur_budget < 0 )
+        svc->cur_budget = 0;
+
+    /* TRACE */
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            int budget;
+            unsigned delta;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.budget = svc->cur_budget;
+        d.delta = delta;
+        trace_var(TRC_RTDS_BUDGET_BURN, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
+static void
+deadline_miss(struct rt_vcpu *svc)
+{
+    svc->misses++;
+
+    /* TRACE */
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned deadline_lo, deadline_hi;
+            unsigned budget;
+            unsigned misses;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.deadline_lo = (unsigned)svc->cur_deadline;
+        d.deadline_hi = (unsigned)(svc->cur_deadline >> 32);
+        d.budget = svc->cur_budget;
+        d.misses = svc->misses;
+        trace_var(TRC_RTDS_DEADLINE_MISS, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+}
+
+/*
+ * A vcpu has become runnable with budget: find it a cpu.  That is an idle
+ * cpu it may run on, preferably the one it last ran on, or else the cpu
+ * running the latest deadline, if later than its own.  Cpus that were
+ * already tickled are left alone, as they will pick the earliest deadline
+ * anyway.
+ */
+static void
+runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu *latest = NULL, *cur;
+    cpumask_t cpus;
+    unsigned int cpu;
+
+    if ( is_idle_vcpu(new->vcpu) || new->cur_budget <= 0 )
+        return;
+
+    cpumask_and(&cpus, cpupool_scheduler_cpumask(new->vcpu->domain->cpupool),
+                new->vcpu->cpu_affinity);
+    cpumask_andnot(&cpus, &cpus, &prv->tickled);
+
+    cpu = new->vcpu->processor;
+    if ( cpumask_test_cpu(cpu, &cpus) && is_idle_vcpu(curr_on_cpu(cpu)) )
+        goto tickle;
+
+    for_each_cpu ( cpu, &cpus )
+    {
+        if ( is_idle_vcpu(curr_on_cpu(cpu)) )
+            goto tickle;
+
+        cur = RT_VCPU(curr_on_cpu(cpu));
+        if ( latest == NULL || cur->cur_deadline > latest->cur_deadline )
+            latest = cur;
+    }
+
+    if ( latest == NULL || latest->cur_deadline <= new->cur_deadline )
+        return;
+    cpu = latest->vcpu->processor;
+
+ tickle:
+    /* TRACE */
+    {
+        struct {
+            unsigned dom:16,vcpu:16;
+            unsigned cpu;
+        } d;
+        d.dom = new->vcpu->domain->domain_id;
+        d.vcpu = new->vcpu->vcpu_id;
+        d.cpu = cpu;
+        trace_var(TRC_RTDS_TICKLE, 1,
+                  sizeof(d),
+                  (unsigned char *)&d);
+    }
+
+    cpumask_set_cpu(cpu, &prv->tickled);
+    cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
+}
+
+/*
+ * The end of the period of one or more vcpus.  Count a deadline miss for
+ * those that still wanted to run, refill them all, and see whether that
+ * changes what should run where.
+ */
+static void
+repl_timer_handler(void *data)
+{
+    const struct scheduler *ops = data;
+    struct rt_private *prv = RT_PRIV(ops);
+    struct list_head *iter, *tmp;
+    struct rt_vcpu *svc, *head;
+    struct vcpu *vc;
+    LIST_HEAD(expired);
+    unsigned long flags;
+    s_time_t now;
+    int running;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    now = NOW();
+
+    list_for_each_safe ( iter, tmp, &prv->replq )
+    {
+        if ( __replq_elem(iter)->cur_deadline > now )
+            break;
+        list_move_tail(iter, &expired);
+    }
+
+    list_for_each_safe ( iter, tmp, &expired )
+    {
+        svc = __replq_elem(iter);
+        vc = svc->vcpu;
+        running = curr_on_cpu(vc->processor) == vc;
+
+        list_del_init(iter);
+
+        if ( running )
+            burn_budget(svc, now);
+
+        if ( vcpu_runnable(vc) && svc->cur_budget > 0 )
+            deadline_miss(svc);
+
+        rt_update_deadline(svc, now);
+
+        if ( running )
+        {
+            __replq_link(prv, svc);
+
+            /* Its new deadline may be later than that of a waiting vcpu. */
+            if ( !list_empty(&prv->runq) )
+            {
+                head = __q_elem(prv->runq.next);
+                if ( head->cur_deadline < svc->cur_deadline )
+                    runq_tickle(ops, head);
+            }
+        }
+        else if ( __vcpu_on_q(svc) )
+        {
+            __replq_link(prv, svc);
+            __q_remove(svc);
+            __q_insert(ops, svc);
+            runq_tickle(ops, svc);
+        }
+        else if ( vcpu_runnable(vc) )
+        {
+            /* Descheduled, and queued again once its context is saved. */
+            __replq_link(prv, svc);
+        }
+        /* Otherwise it is blocked, and wake() starts a new period. */
+    }
+
+    if ( !list_empty(&prv->replq) )
+        set_timer(&prv->repl_timer,
+                  __replq_elem(prv->replq.next)->cur_deadline);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+static void *
+rt_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
+{
+    struct rt_vcpu *svc;
+
+    /* Allocate per-VCPU info */
+    svc = xzalloc(struct rt_vcpu);
+    if ( svc == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&svc->q_elem);
+    INIT_LIST_HEAD(&svc->replq_elem);
+    INIT_LIST_HEAD(&svc->sdom_elem);
+
+    svc->sdom = dd;
+    svc->vcpu = vc;
+
+    if ( !is_idle_vcpu(vc) )
+    {
+        BUG_ON( svc->sdom == NULL );
+
+        svc->period = RTDS_DEFAULT_PERIOD;
+        svc->budget = RTDS_DEFAULT_BUDGET;
+    }
+
+    SCHED_STAT_CRANK(vcpu_init);
+
+    return svc;
+}
+
+static void
+rt_free_vdata(const struct scheduler *ops, void *priv)
+{
+    struct rt_vcpu *svc = priv;
+
+    xfree(svc);
+}
+
+static void
+rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu *svc = RT_VCPU(vc);
+    spinlock_t *lock;
+
+    /* Idle vcpus are never queued. */
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    lock = vcpu_schedule_lock_irq(vc);
+    list_add_tail(&svc->sdom_elem, &svc->sdom->vcpu);
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+    spinlock_t *lock;
+
+    if ( is_idle_vcpu(vc) )
+        return;
+
+    SCHED_STAT_CRANK(vcpu_destroy);
+
+    lock = vcpu_schedule_lock_irq(vc);
+
+    if ( __vcpu_on_q(svc) )
+        __q_remove(svc);
+    if ( __vcpu_on_replq(svc) )
+        __replq_remove(ops, svc);
+    list_del_init(&svc->sdom_elem);
+
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static void
+rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( curr_on_cpu(vc->processor) == vc )
+    {
+        /* Taken off replq once its context is saved. */
+        cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+        return;
+    }
+
+    if ( __vcpu_on_q(svc) )
+        __q_remove(svc);
+    else if ( test_bit(__RTDS_delayed_runq_add, &svc->flags) )
+    {
+        clear_bit(__RTDS_delayed_runq_add, &svc->flags);
+        return;
+    }
+
+    if ( __vcpu_on_replq(svc) )
+        __replq_remove(ops, svc);
+}
+
+static void
+rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+    s_time_t now;
+
+    /* Schedule lock should be held at this point. */
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( unlikely(curr_on_cpu(vc->processor) == vc) )
+        return;
+
+    if ( unlikely(__vcpu_on_q(svc)) )
+        return;
+
+    /*
+     * What is left of the budget is kept until the end of the period; if
+     * that has gone by while the vcpu slept, a new one starts now.
+     */
+    now = NOW();
+    if ( now >= svc->cur_deadline )
+    {
+        /*
+         * Until its context is saved, the vcpu may still be on the
+         * replenishment queue, which is sorted by deadline.
+         */
+        if ( __vcpu_on_replq(svc) )
+            __replq_remove(ops, svc);
+        rt_update_deadline(svc, now);
+    }
+    if ( !__vcpu_on_replq(svc) )
+        __replq_insert(ops, svc);
+
+    /* If the context hasn't been saved yet, queue it once it has. */
+    if ( unlikely(test_bit(__RTDS_scheduled, &svc->flags)) )
+    {
+        set_bit(__RTDS_delayed_runq_add, &svc->flags);
+        return;
+    }
+
+    __q_insert(ops, svc);
+    runq_tickle(ops, svc);
+}
+
+static void
+rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
+{
+    struct rt_vcpu * const svc = RT_VCPU(vc);
+    spinlock_t *lock = vcpu_schedule_lock_irq(vc);
+
+    clear_bit(__RTDS_scheduled, &svc->flags);
+
+    if ( is_idle_vcpu(vc) )
+        goto out;
+
+    if ( test_and_clear_bit(__RTDS_delayed_runq_add, &svc->flags) &&
+         likely(vcpu_runnable(vc)) )
+    {
+        __q_insert(ops, svc);
+        runq_tickle(ops, svc);
+    }
+    else if ( !vcpu_runnable(vc) && __vcpu_on_replq(svc) )
+        __replq_remove(ops, svc);
+
+ out:
+    vcpu_schedule_unlock_irq(lock, vc);
+}
+
+static int
+rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
+{
+    cpumask_t cpus;
+    const cpumask_t *online = cpupool_scheduler_cpumask(vc->domain->cpupool);
+
+    cpumask_and(&cpus, online, vc->cpu_affinity);
+    if ( cpumask_empty(&cpus) )
+        cpumask_copy(&cpus, online);
+
+    /*
+     * Any cpu will do: the vcpu runs on whichever of them picks it, and
+     * moves there when it does.
+     */
+    return cpumask_test_cpu(vc->processor, &cpus) ? vc->processor
+                                                   : cpumask_any(&cpus);
+}
+
+static int
+rt_dom_cntl(
+    const struct scheduler *ops,
+    struct domain *d,
+    struct xen_domctl_scheduler_op *op)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct xen_domctl_sched_rtds *rtds = &op->u.rtds;
+    int all = rtds->vcpuid == XEN_DOMCTL_RTDS_ALL_VCPUS;
+    s_time_t period = MICROSECS(rtds->period);
+    s_time_t budget = MICROSECS(rtds->budget);
+    struct rt_vcpu *svc;
+    struct vcpu *v;
+    unsigned long flags;
+
+    if ( all ? (d->vcpu == NULL || d->vcpu[0] == NULL)
+             : (rtds->vcpuid >= d->max_vcpus ||
+                d->vcpu[rtds->vcpuid] == NULL) )
+        return -EINVAL;
+
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_putinfo &&
+         (period < RTDS_MIN_PERIOD || budget < RTDS_MIN_BUDGET ||
+          budget > period) )
+        return -EINVAL;
+
+    /* The schedule lock of all the vcpus of the domain. */
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
+    {
+        svc = RT_VCPU(d->vcpu[all ? 0 : rtds->vcpuid]);
+        rtds->period = svc->period / MICROSECS(1);
+        rtds->budget = svc->budget / MICROSECS(1);
+        rtds->misses = 0;
+        for_each_vcpu ( d, v )
+            if ( all || v->vcpu_id == rtds->vcpuid )
+                rtds->misses += RT_VCPU(v)->misses;
+    }
+    else
+    {
+        ASSERT(op->cmd == XEN_DOMCTL_SCHEDOP_putinfo);
+
+        /* The new server takes over at the next replenishment. */
+        for_each_vcpu ( d, v )
+        {
+            if ( !all && v->vcpu_id != rtds->vcpuid )
+                continue;
+            svc = RT_VCPU(v);
+            svc->period = period;
+            svc->budget = budget;
+            if ( svc->cur_budget > budget )
+                svc->cur_budget = budget;
+        }
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return 0;
+}
+
+static void *
+rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+    unsigned long flags;
+
+    sdom = xzalloc(struct rt_dom);
+    if ( sdom == NULL )
+        return NULL;
+
+    INIT_LIST_HEAD(&sdom->vcpu);
+    INIT_LIST_HEAD(&sdom->sdom_elem);
+    sdom->dom = dom;
+
+    spin_lock_irqsave(&RT_PRIV(ops)->lock, flags);
+    list_add_tail(&sdom->sdom_elem, &RT_PRIV(ops)->sdom);
+    spin_unlock_irqrestore(&RT_PRIV(ops)->lock, flags);
+
+    return sdom;
+}
+
+static int
+rt_dom_init(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom;
+
+    if ( is_idle_domain(dom) )
+        return 0;
+
+    sdom = rt_alloc_domdata(ops, dom);
+    if ( sdom == NULL )
+        return -ENOMEM;
+
+    dom->sched_priv = sdom;
+
+    return 0;
+}
+
+static void
+rt_free_domdata(const struct scheduler *ops, void *data)
+{
+    struct rt_dom *sdom = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&RT_PRIV(ops)->lock, flags);
+    list_del_init(&sdom->sdom_elem);
+    spin_unlock_irqrestore(&RT_PRIV(ops)->lock, flags);
+
+    xfree(data);
+}
+
+static void
+rt_dom_destroy(const struct scheduler *ops, struct domain *dom)
+{
+    struct rt_dom *sdom = RT_DOM(dom);
+
+    BUG_ON(!list_empty(&sdom->vcpu));
+
+    rt_free_domdata(ops, sdom);
+}
+
+/* The first vcpu on the runqueue that may run on this cpu. */
+static struct rt_vcpu *
+__runq_pick(const struct scheduler *ops, unsigned int cpu)
+{
+    struct list_head *iter;
+    struct rt_vcpu *svc;
+
+    list_for_each ( iter, &RT_PRIV(ops)->runq )
+    {
+        svc = __q_elem(iter);
+        if ( cpumask_test_cpu(cpu, svc->vcpu->cpu_affinity) )
+            return svc;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the earliest deadline, until its budget runs out: a replenishment,
+ * or a wakeup, with an earlier deadline tickles this cpu before that.
+ */
+static struct task_slice
+rt_schedule(
+    const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
+{
+    const unsigned int cpu = smp_processor_id();
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_vcpu * const scurr = RT_VCPU(current);
+    struct rt_vcpu *snext;
+    struct task_slice ret;
+
+    SCHED_STAT_CRANK(schedule);
+
+    /* Protected by the pool lock */
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    burn_budget(scurr, now);
+
+    if ( tasklet_work_scheduled )
+        snext = RT_VCPU(idle_vcpu[cpu]);
+    else
+    {
+        snext = __runq_pick(ops, cpu);
+        if ( snext == NULL )
+            snext = RT_VCPU(idle_vcpu[cpu]);
+
+        /* Keep the current vcpu, unless there is an earlier deadline. */
+        if ( !is_idle_vcpu(current) && vcpu_runnable(current) &&
+             scurr->cur_budget > 0 &&
+             (is_idle_vcpu(snext->vcpu) ||
+              scurr->cur_deadline <= snext->cur_deadline) )
+            snext = scurr;
+    }
+
+    /* If switching from a non-idle runnable vcpu, queue it again. */
+    if ( snext != scurr && !is_idle_vcpu(current) && vcpu_runnable(current) )
+        set_bit(__RTDS_delayed_runq_add, &scurr->flags);
+
+    ret.migrated = 0;
+    snext->last_start = now;
+
+    if ( !is_idle_vcpu(snext->vcpu) )
+    {
+        if ( snext != scurr )
+        {
+            __q_remove(snext);
+            set_bit(__RTDS_scheduled, &snext->flags);
+        }
+
+        /* Safe because the lock of every cpu of the pool is held */
+        if ( snext->vcpu->processor != cpu )
+        {
+            snext->vcpu->processor = cpu;
+            ret.migrated = 1;
+        }
+
+        /* TRACE */
+        {
+            struct {
+                unsigned dom:16,vcpu:16;
+                unsigned deadline_lo, deadline_hi;
+                unsigned budget;
+            } d;
+            d.dom = snext->vcpu->domain->domain_id;
+            d.vcpu = snext->vcpu->vcpu_id;
+            d.deadline_lo = (unsigned)snext->cur_deadline;
+            d.deadline_hi = (unsigned)(snext->cur_deadline >> 32);
+            d.budget = snext->cur_budget;
+            trace_var(TRC_RTDS_RUNQ_PICK, 1,
+                      sizeof(d),
+                      (unsigned char *)&d);
+        }
+
+        ret.time = snext->cur_budget;
+    }
+    else
+        ret.time = -1;
+
+    ret.task = snext->vcpu;
+
+    return ret;
+}
+
+static void
+rt_dump_vcpu(const struct rt_vcpu *svc)
+{
+    printk("[%i.%i] cpu=%i period=%"PRI_stime" budget=%"PRI_stime
+           " cur_b=%"PRI_stime" cur_d=%"PRI_stime" misses=%u flags=%x\n",
+           svc->vcpu->domain->domain_id,
+           svc->vcpu->vcpu_id,
+           svc->vcpu->processor,
+           svc->period,
+           svc->budget,
+           svc->cur_budget,
+           svc->cur_deadline,
+           svc->misses,
+           svc->flags);
+}
+
+static void
+rt_dump_pcpu(const struct scheduler *ops, int cpu)
+{
+    struct vcpu *curr = curr_on_cpu(cpu);
+
+    if ( is_idle_vcpu(curr) )
+        printk("idle\n");
+    else
+        rt_dump_vcpu(RT_VCPU(curr));
+}
+
+static void
+rt_dump(const struct scheduler *ops)
+{
+    struct list_head *iter, *iter_svc;
+    struct rt_private *prv = RT_PRIV(ops);
+    struct rt_dom *sdom;
+    unsigned long flags;
+    char cpustr[100];
+    int loop;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    cpulist_scnprintf(cpustr, sizeof(cpustr), &prv->cpus);
+    printk("cpus: %s\n"
+           "default period %"PRI_stime"us, budget %"PRI_stime"us\n",
+           cpustr,
+           RTDS_DEFAULT_PERIOD / MICROSECS(1),
+           RTDS_DEFAULT_BUDGET / MICROSECS(1));
+
+    printk("Runqueue:\n");
+    loop = 0;
+    list_for_each ( iter, &prv->runq )
+    {
+        printk("\t%3d: ", ++loop);
+        rt_dump_vcpu(__q_elem(iter));
+    }
+
+    printk("Depleted:\n");
+    loop = 0;
+    list_for_each ( iter, &prv->depletedq )
+    {
+        printk("\t%3d: ", ++loop);
+        rt_dump_vcpu(__q_elem(iter));
+    }
+
+    printk("Domain info:\n");
+    list_for_each ( iter, &prv->sdom )
+    {
+        sdom = list_entry(iter, struct rt_dom, sdom_elem);
+        printk("\tDomain: %d\n", sdom->dom->domain_id);
+
+        loop = 0;
+        list_for_each ( iter_svc, &sdom->vcpu )
+        {
+            printk("\t%3d: ", ++loop);
+            rt_dump_vcpu(list_entry(iter_svc, struct rt_vcpu, sdom_elem));
+        }
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+static void *
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    spinlock_t *old_lock;
+    unsigned long flags;
+
+    /* Move the cpu's schedule lock to the pool lock. */
+    old_lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
+    spin_unlock_irqrestore(old_lock, flags);
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    cpumask_set_cpu(cpu, &prv->cpus);
+
+    /* Replenish on a cpu of the pool, rather than disturb another one. */
+    if ( cpu_online(cpu) && !cpumask_test_cpu(prv->repl_cpu, &prv->cpus) )
+    {
+        prv->repl_cpu = cpu;
+        migrate_timer(&prv->repl_timer, cpu);
+    }
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    return (void *)1;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    unsigned long flags;
+    cpumask_t online;
+    unsigned int new_cpu;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    cpumask_clear_cpu(cpu, &prv->cpus);
+    cpumask_clear_cpu(cpu, &prv->tickled);
+
+    /*
+     * A cpu going offline has its timers moved by the timer code; one
+     * leaving the pool hands the timer over to another of the pool's cpus.
+     */
+    cpumask_and(&online, &prv->cpus, &cpu_online_map);
+    if ( prv->repl_cpu == cpu && cpu_online(cpu) &&
+         (new_cpu = cpumask_any(&online)) < nr_cpu_ids )
+    {
+        prv->repl_cpu = new_cpu;
+        migrate_timer(&prv->repl_timer, new_cpu);
+    }
+
+    /*
+     * Give the cpu its own schedule lock back, unless the scheduler of
+     * the pool it moves to has already put its own in place.
+     */
+    if ( sd->schedule_lock == &prv->lock )
+        sd->schedule_lock = &sd->_lock;
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+static int
+rt_init(struct scheduler *ops)
+{
+    struct rt_private *prv;
+
+    prv = xzalloc(struct rt_private);
+    if ( prv == NULL )
+        return -ENOMEM;
+    ops->sched_data = prv;
+
+    spin_lock_init(&prv->lock);
+    INIT_LIST_HEAD(&prv->sdom);
+    INIT_LIST_HEAD(&prv->runq);
+    INIT_LIST_HEAD(&prv->depletedq);
+    INIT_LIST_HEAD(&prv->replq);
+
+    /* Moved to a cpu of the pool once it has one. */
+    prv->repl_cpu = smp_processor_id();
+    init_timer(&prv->repl_timer, repl_timer_handler, ops, prv->repl_cpu);
+
+    return 0;
+}
+
+static void
+rt_deinit(const struct scheduler *ops)
+{
+    struct rt_private *prv = RT_PRIV(ops);
+
+    if ( prv == NULL )
+        return;
+
+    kill_timer(&prv->repl_timer);
+    xfree(prv);
+}
+
+const struct scheduler sched_rtds_def = {
+    .name           = "SMP RTDS Scheduler",
+    .opt_name       = "rtds",
+    .sched_id       = XEN_SCHEDULER_RTDS,
+    .sched_data     = NULL,
+
+    .init_domain    = rt_dom_init,
+    .destroy_domain = rt_dom_destroy,
+
+    .insert_vcpu    = rt_vcpu_insert,
+    .remove_vcpu    = rt_vcpu_remove,
+
+    .sleep          = rt_vcpu_sleep,
+    .wake           = rt_vcpu_wake,
+
+    .adjust         = rt_dom_cntl,
+
+    .pick_cpu       = rt_cpu_pick,
+    .do_schedule    = rt_schedule,
+    .context_saved  = rt_context_saved,
+
+    .dump_cpu_state = rt_dump_pcpu,
+    .dump_settings  = rt_dump,
+    .init           = rt_init,
+    .deinit         = rt_deinit,
+    .alloc_vdata    = rt_alloc_vdata,
+    .free_vdata     = rt_free_vdata,
+    .alloc_pdata    = rt_alloc_pdata,
+    .free_pdata     = rt_free_pdata,
+    .alloc_domdata  = rt_alloc_domdata,
+    .free_domdata   = rt_free_domdata,
+};
@@ -69,6 +69,7 @@ static const struct scheduler *schedulers[] = {
     &sched_credit_def,
     &sched_credit2_def,
     &sched_arinc653_def,
+    &sched_rtds_def,
 };
 
 static struct scheduler __read_mostly ops;
@@ -1181,6 +1182,9 @@ static void schedule(void)
 
     stop_timer(&sd->s_timer);
     
+    if ( sched_core )
+        sched_core_begin(cpu);
+
     /* get policy-specific decision on scheduling... */
     sched = this_cpu(scheduler);
     next_slice = sched->do_schedule(sched, now, tasklet_work_scheduled);
@@ -1189,6 +1193,9 @@ static void schedule(void)
 
     sd->curr = next;
 
+    if ( sched_core )
+        sched_core_end(cpu, next, now);
+
     if ( next_slice.time >= 0 ) /* -ve means no limit */
         set_timer(&sd->s_timer, now + next_slice.time);
 
@@ -1302,6 +1309,7 @@ static int cpu_schedule_up(unsigned int cpu)
     sd->curr = idle_vcpu[cpu];
     init_timer(&sd->s_timer, s_timer_fn, NULL, cpu);
     atomic_set(&sd->urgent_count, 0);
+    sched_core_init_cpu(cpu);
 
     /* Boot CPU is dealt with later in schedule_init(). */
     if ( cpu == 0 )
@@ -1327,6 +1335,7 @@ static void cpu_schedule_down(unsigned int cpu)
         SCHED_OP(&ops, free_pdata, sd->sched_priv, cpu);
 
     kill_timer(&sd->s_timer);
+    sched_core_deinit_cpu(cpu);
 }
 
 static int cpu_schedule_callback(
@@ -29,12 +29,34 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Keep timers that are far in the future on a timer wheel, not the heap. */
+static bool_t __read_mostly opt_timer_wheel;
+boolean_param("timer_wheel", opt_timer_wheel);
+
+#define TIMER_WHEEL_SHIFT  20   /* Level-0 slots are 2^20ns, about 1ms. */
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SIZE   (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS  (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE)
+#define TIMER_WHEEL_GRAN   ((s_time_t)1 << TIMER_WHEEL_SHIFT)
+/* Timers due within this many level-0 slots go straight on the heap. */
+#define TIMER_WHEEL_NEAR   2
+
+#define wheel_shift(l)     (TIMER_WHEEL_SHIFT + (l) * TIMER_WHEEL_BITS)
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
     struct timer  *running;
     struct list_head inactive;
+
+    /* Far-future timers: see TIMER WHEEL OPERATIONS below. */
+    s_time_t       wheel_base;
+    s_time_t       wheel_next;
+    unsigned int   wheel_count;
+    DECLARE_BITMAP(wheel_pending, TIMER_WHEEL_SLOTS);
+    struct hlist_head wheel[TIMER_WHEEL_SLOTS];
 } __cacheline_aligned;
 
 static DEFINE_PER_CPU(struct timers, timers);
@@ -167,6 +189,177 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ *
+ * Level l of the wheel has TIMER_WHEEL_SIZE slots of 2^wheel_shift(l)ns,
+ * indexed by absolute time.  A timer goes on the lowest level on which it
+ * is less than a revolution beyond wheel_base, always in a slot starting
+ * after wheel_base.  The softirq handler moves wheel_base along and re-adds
+ * the timers in every slot it passes: they drop to a lower level, or onto
+ * the heap once they are near.  Timers only ever expire from the heap, so
+ * the wheel costs no precision; it keeps set_timer() and stop_timer() of
+ * far-off timers O(1) and the heap small.
+ */
+
+/* Is @t far enough in the future to go on the wheel? */
+static bool_t far_timer(const struct timers *ts, const struct timer *t)
+{
+    return (t->expires >= ts->wheel_base + TIMER_WHEEL_NEAR * TIMER_WHEEL_GRAN);
+}
+
+/* Add @t to the wheel. Return TRUE if it moves the next wheel event up. */
+static int add_to_wheel(struct timers *ts, struct timer *t)
+{
+    uint64_t e = t->expires, b = ts->wheel_base;
+    unsigned int l, shift = 0, slot;
+    s_time_t start;
+
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+    {
+        shift = wheel_shift(l);
+        if ( (e >> shift) - (b >> shift) < TIMER_WHEEL_SIZE )
+            break;
+    }
+
+    /* Beyond the top level: park in its last slot, to be re-added later. */
+    if ( l == TIMER_WHEEL_LEVELS )
+    {
+        l--;
+        e = ((b >> shift) + TIMER_WHEEL_SIZE - 1) << shift;
+    }
+
+    slot = (l << TIMER_WHEEL_BITS) | ((e >> shift) & (TIMER_WHEEL_SIZE - 1));
+    t->wheel_slot = slot;
+    hlist_add_head(&t->wheel, &ts->wheel[slot]);
+    __set_bit(slot, ts->wheel_pending);
+    ts->wheel_count++;
+
+    start = (e >> shift) << shift;
+    if ( start >= ts->wheel_next )
+        return 0;
+    ts->wheel_next = start;
+    return 1;
+}
+
+/* Delete @t from the wheel. Never changes the earliest deadline. */
+static int remove_from_wheel(struct timers *ts, struct timer *t)
+{
+    hlist_del(&t->wheel);
+    if ( hlist_empty(&ts->wheel[t->wheel_slot]) )
+        __clear_bit(t->wheel_slot, ts->wheel_pending);
+    if ( --ts->wheel_count == 0 )
+        ts->wheel_next = STIME_MAX;
+
+    return 0;
+}
+
+static struct timer *first_wheel_timer(struct timers *ts)
+{
+    unsigned int slot;
+
+    if ( !ts->wheel_count )
+        return NULL;
+
+    slot = find_first_bit(ts->wheel_pending, TIMER_WHEEL_SLOTS);
+    return hlist_entry(ts->wheel[slot].first, struct timer, wheel);
+}
+
+/* Recompute when the first non-empty wheel slot starts. */
+static void wheel_next_event(struct timers *ts)
+{
+    uint64_t b = ts->wheel_base, pos, rel;
+    unsigned int l, shift, first, end, idx;
+    s_time_t start;
+
+    ts->wheel_next = STIME_MAX;
+    if ( !ts->wheel_count )
+        return;
+
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+    {
+        shift = wheel_shift(l);
+        pos = b >> shift;
+        first = l << TIMER_WHEEL_BITS;
+        end = first + TIMER_WHEEL_SIZE;
+
+        /* The first pending slot after wheel_base, wrapping around. */
+        idx = find_next_bit(ts->wheel_pending, end,
+                            first + ((pos + 1) & (TIMER_WHEEL_SIZE - 1)));
+        if ( idx >= end )
+            idx = find_next_bit(ts->wheel_pending, end, first);
+        if ( idx >= end )
+            continue;
+
+        rel = ((idx - first) - pos - 1) & (TIMER_WHEEL_SIZE - 1);
+        start = (pos + rel + 1) << shift;
+        if ( start < ts->wheel_next )
+            ts->wheel_next = start;
+    }
+}
+
+static int add_entry(struct timer *t);
+
+/*
+ * Move wheel_base up to the first level-0 slot that starts a slot's worth
+ * after @now, re-adding the timers of every slot whose start is passed.
+ */
+static void advance_wheel(struct timers *ts, s_time_t now)
+{
+    uint64_t b = ts->wheel_base, nb, o, n, i;
+    unsigned int l, slot, moved = 0;
+    struct hlist_head todo = HLIST_HEAD_INIT;
+    struct hlist_node *node;
+    struct timer *t;
+
+    nb = (now + TIMER_WHEEL_GRAN) & ~(TIMER_WHEEL_GRAN - 1);
+    if ( nb <= b )
+        return;
+
+    if ( !ts->wheel_count )
+    {
+        ts->wheel_base = nb;
+        return;
+    }
+
+    for ( l = 0; l < TIMER_WHEEL_LEVELS; l++ )
+    {
+        o = b >> wheel_shift(l);
+        n = nb >> wheel_shift(l);
+        for ( i = o + 1; i <= n && i <= o + TIMER_WHEEL_SIZE; i++ )
+        {
+            slot = (l << TIMER_WHEEL_BITS) | (i & (TIMER_WHEEL_SIZE - 1));
+            if ( !test_bit(slot, ts->wheel_pending) )
+                continue;
+            __clear_bit(slot, ts->wheel_pending);
+            while ( !hlist_empty(&ts->wheel[slot]) )
+            {
+                node = ts->wheel[slot].first;
+                hlist_del(node);
+                hlist_add_head(node, &todo);
+                moved++;
+            }
+        }
+    }
+
+    /*
+     * Every timer re-added now lands in a slot after the new base, so none
+     * of them can be passed again.  wheel_count still counts the timers
+     * being moved until they are all back.
+     */
+    ts->wheel_base = nb;
+    while ( !hlist_empty(&todo) )
+    {
+        node = todo.first;
+        hlist_del(node);
+        t = hlist_entry(node, struct timer, wheel);
+        t->status = TIMER_STATUS_invalid;
+        add_entry(t);
+    }
+    ts->wheel_count -= moved;
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -184,6 +377,9 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        rc = remove_from_wheel(timers, t);
+        break;
     default:
         rc = 0;
         BUG();
@@ -200,6 +396,12 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    if ( opt_timer_wheel && far_timer(timers, t) )
+    {
+        t->status = TIMER_STATUS_in_wheel;
+        return add_to_wheel(timers, t);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -277,7 +479,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -461,6 +663,10 @@ static void timer_softirq_action(void)
 
     now = NOW();
 
+    /* Bring timers due soon off the wheel and onto the heap. */
+    if ( opt_timer_wheel )
+        advance_wheel(ts, now);
+
     /* Execute ready heap timers. */
     while ( (GET_HEAP_SIZE(heap) != 0) &&
             ((t = heap[1])->expires < now) )
@@ -492,6 +698,11 @@ static void timer_softirq_action(void)
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+    /* Wake up a slot early, to move the slot's timers onto the heap. */
+    wheel_next_event(ts);
+    if ( (ts->wheel_next != STIME_MAX) &&
+         (ts->wheel_next - TIMER_WHEEL_GRAN < deadline) )
+        deadline = ts->wheel_next - TIMER_WHEEL_GRAN;
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -520,6 +731,7 @@ static void dump_timerq(unsigned char key)
 {
     struct timer  *t;
     struct timers *ts;
+    struct hlist_node *node;
     unsigned long  flags;
     s_time_t       now = NOW();
     int            i, j;
@@ -536,6 +748,9 @@ static void dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
             dump_timer(t, now);
+        for ( j = 0; j < TIMER_WHEEL_SLOTS; j++ )
+            hlist_for_each_entry ( t, node, &ts->wheel[j], wheel )
+                dump_timer(t, now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -569,8 +784,8 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = GET_HEAP_SIZE(old_ts->heap)
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    while ( (t = GET_HEAP_SIZE(old_ts->heap) ? old_ts->heap[1] :
+             old_ts->list ?: first_wheel_timer(old_ts)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
@@ -606,6 +821,7 @@ static int cpu_callback(
         INIT_LIST_HEAD(&ts->inactive);
         spin_lock_init(&ts->lock);
         ts->heap = &dummy_heap;
+        ts->wheel_next = STIME_MAX;
         break;
     case CPU_UP_CANCELED:
     case CPU_DEAD:
@@ -627,6 +843,9 @@ void __init timer_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
 
+    BUILD_BUG_ON(TIMER_WHEEL_SLOTS >
+                 (1U << (8 * sizeof(((struct timer *)0)->wheel_slot))));
+
     open_softirq(TIMER_SOFTIRQ, timer_softirq_action);
 
     /*
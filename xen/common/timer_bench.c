@@ -0,0 +1,180 @@
+/******************************************************************************
+ * timer_bench.c
+ *
+ * Stress test of the timer subsystem, run from the 'b' debug key.  Only
+ * built into debug hypervisors.
+ *
+ * Every online CPU gets TIMER_BENCH_TIMERS timers, set the way guest
+ * periodic timers (vpt, vcpu periodic timers, RTC) are: periods from 1ms
+ * to 1s, at many different phases.  All CPUs then, at once and with
+ * interrupts off, set, re-arm, migrate to the next CPU and back, and stop
+ * all their timers, TIMER_BENCH_ROUNDS times.  The cost per operation is
+ * printed for each step, averaged over the CPUs and for the slowest CPU.
+ * Boot with and without timer_wheel to compare the heap and the wheel.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/smp.h>
+#include <xen/cpumask.h>
+#include <xen/time.h>
+#include <xen/timer.h>
+#include <xen/softirq.h>
+#include <xen/keyhandler.h>
+#include <xen/xmalloc.h>
+
+#define TIMER_BENCH_TIMERS 4096
+#define TIMER_BENCH_ROUNDS 16
+
+enum {
+    BENCH_set,
+    BENCH_rearm,
+    BENCH_migrate,
+    BENCH_return,
+    BENCH_stop,
+    BENCH_NR
+};
+
+static const char *const bench_step[BENCH_NR] = {
+    [BENCH_set]     = "set",
+    [BENCH_rearm]   = "re-arm",
+    [BENCH_migrate] = "migrate",
+    [BENCH_return]  = "migrate back",
+    [BENCH_stop]    = "stop",
+};
+
+struct bench_cpu {
+    struct timer *timers;
+    unsigned int  peer;
+    s_time_t      ns[BENCH_NR];
+};
+
+static struct bench_cpu *bench;
+
+static const s_time_t bench_period[] = {
+    MILLISECS(1), MILLISECS(4), MILLISECS(10), MILLISECS(100), SECONDS(1)
+};
+
+static void bench_fn(void *unused)
+{
+}
+
+static s_time_t bench_expiry(unsigned int i, s_time_t now)
+{
+    s_time_t period = bench_period[i % ARRAY_SIZE(bench_period)];
+
+    /* Spread the timers of each period over the whole period. */
+    return now + period + (i * 7919ULL) % period;
+}
+
+static void bench_round(void *unused)
+{
+    struct bench_cpu *b = &bench[smp_processor_id()];
+    s_time_t start, now;
+    unsigned int i;
+
+    start = now = NOW();
+    for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+        set_timer(&b->timers[i], bench_expiry(i, now));
+    now = NOW();
+    b->ns[BENCH_set] += now - start;
+
+    start = now;
+    for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+        set_timer(&b->timers[i], bench_expiry(i, now));
+    now = NOW();
+    b->ns[BENCH_rearm] += now - start;
+
+    start = now;
+    for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+        migrate_timer(&b->timers[i], b->peer);
+    now = NOW();
+    b->ns[BENCH_migrate] += now - start;
+
+    start = now;
+    for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+        migrate_timer(&b->timers[i], smp_processor_id());
+    now = NOW();
+    b->ns[BENCH_return] += now - start;
+
+    start = now;
+    for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+        stop_timer(&b->timers[i]);
+    now = NOW();
+    b->ns[BENCH_stop] += now - start;
+}
+
+static void run_timer_bench(unsigned char key)
+{
+    unsigned int cpu, i, nr = 0, round;
+    s_time_t total, worst, ops = TIMER_BENCH_TIMERS * TIMER_BENCH_ROUNDS;
+
+    bench = xzalloc_array(struct bench_cpu, nr_cpu_ids);
+    if ( !bench )
+        return;
+
+    for_each_online_cpu ( cpu )
+    {
+        bench[cpu].timers = xmalloc_array(struct timer, TIMER_BENCH_TIMERS);
+        if ( !bench[cpu].timers )
+            goto out;
+        bench[cpu].peer = cpumask_cycle(cpu, &cpu_online_map);
+        for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+            init_timer(&bench[cpu].timers[i], bench_fn, NULL, cpu);
+        nr++;
+    }
+
+    printk("Timer stress: %u timers on each of %u CPUs, %u rounds\n",
+           TIMER_BENCH_TIMERS, nr, TIMER_BENCH_ROUNDS);
+
+    /*
+     * Two rounds that don't count, for every CPU to grow its timer heap to
+     * hold its own timers and its neighbour's.  Until it has, timers spill
+     * onto the much slower overflow list.
+     */
+    for ( round = 0; round < TIMER_BENCH_ROUNDS + 2; round++ )
+    {
+        if ( round == 2 )
+            for_each_online_cpu ( cpu )
+                memset(bench[cpu].ns, 0, sizeof(bench[cpu].ns));
+        process_pending_softirqs();
+        on_each_cpu(bench_round, NULL, 1);
+    }
+
+    for ( i = 0; i < BENCH_NR; i++ )
+    {
+        total = worst = 0;
+        for_each_online_cpu ( cpu )
+        {
+            total += bench[cpu].ns[i];
+            worst = max(worst, bench[cpu].ns[i]);
+        }
+        printk("  %-12s %6"PRId64"ns/op, slowest CPU %6"PRId64"ns/op\n",
+               bench_step[i], total / (nr * ops), worst / ops);
+    }
+
+ out:
+    for_each_online_cpu ( cpu )
+    {
+        if ( !bench[cpu].timers )
+            continue;
+        for ( i = 0; i < TIMER_BENCH_TIMERS; i++ )
+            kill_timer(&bench[cpu].timers[i]);
+        xfree(bench[cpu].timers);
+    }
+    xfree(bench);
+    bench = NULL;
+}
+
+static struct keyhandler timer_bench_keyhandler = {
+    .u.fn = run_timer_bench,
+    .desc = "timer stress test"
+};
+
+static int __init timer_bench_init(void)
+{
+    register_keyhandler('b', &timer_bench_keyhandler);
+    return 0;
+}
+__initcall(timer_bench_init);
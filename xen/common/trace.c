@@ -30,7 +30,6 @@
 #include <xen/mm.h>
 #include <xen/percpu.h>
 #include <xen/pfn.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -54,9 +53,24 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
+/*
+ * Per-CPU producer state, only ever accessed by its own CPU.
+ *
+ * Records are written without a lock.  A writer reserves space by moving
+ * head on with cmpxchg and fills it in.  The outermost writer on the CPU
+ * then publishes everything reserved so far by moving the buffer's prod up
+ * to head.  A writer interrupted by another one on the same CPU, in IRQ or
+ * NMI context, therefore never holds it up, and the consumer never sees a
+ * record that is still being written.
+ */
+struct t_prod {
+    u32 head;           /* Space handed out up to here, modulo 2*data_size. */
+    unsigned int nest;  /* Writers in progress, interrupted ones included. */
+};
+static DEFINE_PER_CPU(struct t_prod, t_prod);
+
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
@@ -79,21 +93,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -226,13 +225,12 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
         per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
         buf->cons = buf->prod = 0;
+        per_cpu(t_prod, cpu).head = 0;
 
         printk(XENLOG_INFO "xentrace: p%d mfn %x offset %u\n",
                    cpu, t_info_mfn_list[offset], offset);
@@ -342,7 +340,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -414,16 +411,18 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         int i;
 
         tb_init_done = 0;
-        smp_wmb();
-        /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
+        smp_mb();
+        /*
+         * Clear any lost-record info so we don't get phantom lost records
+         * next time we start tracing.  Wait for writers to finish to make
+         * sure we're not racing anyone.  After this hypercall returns, no
+         * more records should be placed into the buffers.
+         */
         for_each_online_cpu(i)
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
+            while ( read_atomic(&per_cpu(t_prod, i).nest) )
+                cpu_relax();
+            per_cpu(lost_records, i) = 0;
         }
     }
         break;
@@ -460,12 +459,10 @@ static inline bool_t bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(u32 prod, u32 cons)
 {
-    u32 prod = buf->prod, cons = buf->cons;
     s32 x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
     if ( bogus(prod, cons) )
         return data_size;
 
@@ -479,16 +476,11 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(u32 pos)
 {
-    u32 prod = buf->prod, cons = buf->cons;
     s32 x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
-
-    x = data_size - prod;
+    x = data_size - pos;
     if ( x <= 0 )
         x += data_size;
 
@@ -498,27 +490,36 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
+static inline u32 advance(u32 pos, u32 bytes)
+{
+    pos += bytes;
+    if ( pos >= 2*data_size )
+        pos -= 2*data_size;
+    ASSERT(pos < 2*data_size);
+    return pos;
+}
+
+/* Where the next record goes after one of @size placed at @pos. */
+static inline u32 next_pos(u32 pos, unsigned int size)
 {
-    return data_size - calc_unconsumed_bytes(buf);
+    u32 bytes_to_wrap = calc_bytes_to_wrap(pos);
+
+    /* A record that doesn't fit before the wrap is preceded by padding. */
+    if ( size > bytes_to_wrap )
+        pos = advance(pos, bytes_to_wrap);
+
+    return advance(pos, size);
 }
 
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
+static unsigned char *next_record(u32 x, unsigned char **next_page,
+                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
     if ( x >= data_size )
         x -= data_size;
 
@@ -548,6 +549,7 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
 }
 
 static inline void __insert_record(struct t_buf *buf,
+                                   u32 pos,
                                    unsigned long event,
                                    unsigned int extra,
                                    bool_t cycles,
@@ -559,16 +561,13 @@ static inline void __insert_record(struct t_buf *buf,
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
+    this_page = next_record(pos, &next_page, &offset);
 
     remaining = PAGE_SIZE - offset;
 
@@ -576,11 +575,15 @@ static inline void __insert_record(struct t_buf *buf,
     {
         if ( next_page == NULL )
         {
-            /* access beyond end of buffer */
-            printk(XENLOG_WARNING
-                   "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
-                   __func__, data_size, next, buf->cons, rec_size, remaining);
-            return;
+            /*
+             * Access beyond end of buffer.  Records are padded up to the
+             * wrap, so this is a bug; and as the space is reserved already,
+             * returning would publish it unwritten.
+             */
+            printk(XENLOG_ERR
+                   "%s: size=%08x pos=%08x cons=%08x rec=%u remaining=%u\n",
+                   __func__, data_size, pos, buf->cons, rec_size, remaining);
+            BUG();
         }
         rec = &split_rec;
     } else {
@@ -606,20 +609,13 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(this_page + offset, rec, remaining);
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
-
-    smp_wmb();
-
-    next += rec_size;
-    if ( next >= 2*data_size )
-        next -= 2*data_size;
-    ASSERT(next < 2*data_size);
-    buf->prod = next;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
-                                      unsigned int size)
+/* Pad from @pos to the wrap. Return the position after the padding. */
+static inline u32 insert_wrap_record(struct t_buf *buf, u32 pos,
+                                     unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(pos);
     unsigned int extra_space = space_left - sizeof(u32);
     bool_t cycles = 0;
 
@@ -633,13 +629,15 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+    __insert_record(buf, pos, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
                     space_left, NULL);
+
+    return advance(pos, space_left);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline void insert_lost_records(struct t_buf *buf, u32 pos)
 {
     struct {
         u32 lost_records;
@@ -649,12 +647,15 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
+    /*
+     * Records lost by interrupting writers from here on are counted in with
+     * these, or else start a new count with a new first_tsc.
+     */
     ed.first_tsc = this_cpu(lost_records_first_tsc);
+    barrier();
+    ed.lost_records = xchg(&this_cpu(lost_records), 0);
 
-    this_cpu(lost_records) = 0;
-
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+    __insert_record(buf, pos, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
                     LOST_REC_SIZE, &ed);
 }
 
@@ -676,17 +677,18 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
  * @extra: size of additional trace data in bytes
  * @extra_data: pointer to additional trace data
  *
- * Logs a trace record into the appropriate buffer.
+ * Logs a trace record into the appropriate buffer.  Safe to call from any
+ * context, including while interrupting another call on the same CPU.
  */
 void __trace_var(u32 event, bool_t cycles, unsigned int extra,
                  const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
-    u32 bytes_to_tail, bytes_to_wrap;
+    struct t_prod *tp;
+    u32 head, next, pos, cons, prod;
     unsigned int rec_size, total_size;
     unsigned int extra_word;
-    bool_t started_below_highwater;
+    bool_t lost, started_below_highwater;
 
     if( !tb_init_done )
         return;
@@ -720,99 +722,102 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
-
     if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        return;
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    tp = &this_cpu(t_prod);
+    tp->nest++;
+    barrier();
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
- 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
-    
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-    
-    /* 
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
+
+    /*
+     * Only the outermost writer reports lost records, so that no two
+     * writers report the same ones.
      */
-    total_size = 0;
+    lost = (tp->nest == 1) && this_cpu(lost_records);
 
-    /* First, check to see if we need to include a lost_record.
+    /*
+     * Reserve space for the record, preceded by a lost-records record and
+     * padding up to the wrap as needed.
      */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
-        {
-            total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
-        } 
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
+    do {
+        head = tp->head;
+        cons = buf->cons;
+        barrier(); /* must read buf->cons only once */
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    } 
-    total_size += rec_size;
+        next = head;
+        if ( lost )
+            next = next_pos(next, LOST_REC_SIZE);
+        next = next_pos(next, rec_size);
 
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        total_size = (next >= head) ? next - head : next + 2*data_size - head;
+
+        /* Do we have enough space for everything? */
+        if ( total_size > data_size - calc_unconsumed_bytes(head, cons) )
+        {
+            if ( arch_fetch_and_add(&this_cpu(lost_records), 1) == 0 )
+                this_cpu(lost_records_first_tsc) = (u64)get_cycles();
+            goto out;
+        }
+    } while ( cmpxchg(&tp->head, head, next) != head );
 
     /*
-     * Now, actually write information 
+     * Now, actually write information
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-
-    if ( this_cpu(lost_records) )
+    pos = head;
+    if ( lost )
     {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
-        {
-            insert_wrap_record(buf, LOST_REC_SIZE);
-            bytes_to_wrap = data_size;
-        } 
-        insert_lost_records(buf);
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
+        if ( LOST_REC_SIZE > calc_bytes_to_wrap(pos) )
+            pos = insert_wrap_record(buf, pos, LOST_REC_SIZE);
+        insert_lost_records(buf, pos);
+        pos = advance(pos, LOST_REC_SIZE);
     }
 
-    if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+    if ( rec_size > calc_bytes_to_wrap(pos) )
+        pos = insert_wrap_record(buf, pos, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    __insert_record(buf, pos, event, extra, cycles, rec_size, extra_data);
+
+ out:
+    if ( tp->nest > 1 )
+    {
+        /* The writer we interrupted will publish this record. */
+        tp->nest--;
+        return;
+    }
+
+    prod = buf->prod;
+    cons = buf->cons;
+    barrier(); /* must read buf->prod and buf->cons only once */
+    started_below_highwater =
+        (calc_unconsumed_bytes(prod, cons) < t_buf_highwater);
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    /*
+     * Publish all records reserved so far.  Writers which interrupt us
+     * after we have dropped nest publish their own; any reservation made
+     * before that would go unpublished, so check for one and go again.
+     */
+    for ( ; ; )
+    {
+        head = tp->head;
+        smp_wmb(); /* records written before prod is updated */
+        buf->prod = head;
+        barrier();
+        tp->nest = 0;
+        barrier();
+        if ( likely(tp->head == head) )
+            break;
+        tp->nest = 1;
+        barrier();
+    }
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( started_below_highwater
+         && (calc_unconsumed_bytes(head, cons) >= t_buf_highwater) )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 
@@ -11,7 +11,8 @@ static inline __attribute__((pure)) int phys_to_nid(paddr_t addr)
 }
 
 /* XXX: implement NUMA support */
-#define node_spanned_pages(nid) (total_pages)
+#define node_start_pfn(nid) (pdx_to_pfn(frametable_base_mfn))
+#define node_spanned_pages(nid) (max_page - node_start_pfn(nid))
 #define __node_distance(a, b) (20)
 
 #endif /* __ARCH_ARM_NUMA_H */
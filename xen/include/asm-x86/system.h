@@ -136,6 +136,14 @@ static always_inline unsigned long __cmpxchg(
 #define smp_rmb()       rmb()
 #define smp_wmb()       wmb()
 
+/*
+ * Ticket spinlocks: a lock-prefixed xadd is already a full barrier, and
+ * stores are not reordered with older loads or stores.
+ */
+#define arch_fetch_and_add(x, v)    __sync_fetch_and_add(x, v)
+#define arch_lock_acquire_barrier() barrier()
+#define arch_lock_release_barrier() barrier()
+
 #define set_mb(var, value) do { xchg(&var, value); } while (0)
 #define set_wmb(var, value) do { var = value; wmb(); } while (0)
 
@@ -321,6 +321,16 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_max_vcpus_t);
 #define XEN_SCHEDULER_CREDIT   5
 #define XEN_SCHEDULER_CREDIT2  6
 #define XEN_SCHEDULER_ARINC653 7
+#define XEN_SCHEDULER_RTDS     8
+/*
+ * RTDS: putinfo sets the period and budget of one vcpu, or of all of them.
+ * getinfo returns those of one vcpu, or of vcpu 0, with the deadline
+ * misses of that vcpu, or of all of them.
+ */
+#define XEN_DOMCTL_RTDS_ALL_VCPUS  (~0U)
+/* Smallest period and budget putinfo accepts, in microseconds. */
+#define XEN_DOMCTL_RTDS_MIN_PERIOD 100
+#define XEN_DOMCTL_RTDS_MIN_BUDGET 10
 /* Set or get info? */
 #define XEN_DOMCTL_SCHEDOP_putinfo 0
 #define XEN_DOMCTL_SCHEDOP_getinfo 1
@@ -342,6 +352,12 @@ struct xen_domctl_scheduler_op {
         struct xen_domctl_sched_credit2 {
             uint16_t weight;
         } credit2;
+        struct xen_domctl_sched_rtds {
+            uint32_t period;    /* IN/OUT: microseconds */
+            uint32_t budget;    /* IN/OUT: microseconds */
+            uint32_t vcpuid;    /* IN: vcpu, or XEN_DOMCTL_RTDS_ALL_VCPUS */
+            uint32_t misses;    /* OUT: deadline misses */
+        } rtds;
     } u;
 };
 typedef struct xen_domctl_scheduler_op xen_domctl_scheduler_op_t;
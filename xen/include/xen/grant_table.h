@@ -64,7 +64,18 @@ struct grant_mapping {
     domid_t  domid;         /* granting domain */
 };
 
-/* Per-domain grant information. */
+/*
+ * Per-domain grant information.
+ *
+ * Lock ordering: the table lock is taken before any active entry lock.
+ * Map, unmap and copy only read-lock the table and then lock the active
+ * entries they touch, so that backends on several CPUs working on
+ * different grant references do not serialise.  Anything that resizes
+ * the table, changes its version or walks every entry takes the table
+ * lock for writing.  The maptrack free list has a lock of its own and
+ * nests inside neither; free maptrack handles are mostly cached per vCPU
+ * (see struct vcpu), under a lock that nests inside nothing either.
+ */
 struct grant_table {
     /* Table size. Number of frames shared with guest */
     unsigned int          nr_grant_frames;
@@ -84,11 +95,15 @@ struct grant_table {
     struct grant_mapping **maptrack;
     unsigned int          maptrack_head;
     unsigned int          maptrack_limit;
-    /* Lock protecting updates to active and shared grant tables. */
-    spinlock_t            lock;
+    /* Lock protecting the table-wide maptrack free list and its growth. */
+    spinlock_t            maptrack_lock;
+    /* Lock protecting the table size, version and shared grant table. */
+    rwlock_t              lock;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
+
+    struct lock_profile_qhead profile_head;
 };
 
 /* Create/destroy per-domain grant table context. */
@@ -96,6 +111,7 @@ int grant_table_create(
     struct domain *d);
 void grant_table_destroy(
     struct domain *d);
+void grant_table_init_vcpu(struct vcpu *v);
 
 /* Domain death release of granted mappings of other domains' memory. */
 void
@@ -103,7 +119,7 @@ gnttab_release_mappings(
     struct domain *d);
 
 /* Increase the size of a domain's grant table.
- * Caller must hold d's grant table lock.
+ * Caller must hold d's grant table write lock.
  */
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames);
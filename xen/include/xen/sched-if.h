@@ -21,6 +21,29 @@ extern cpumask_t cpupool_free_cpus;
 #define SCHED_DEFAULT_RATELIMIT_US 1000
 extern int sched_ratelimit_us;
 
+/*
+ * Core scheduling (sched_core.c): schedulers supporting it only pick, on
+ * a pCPU, vcpus for which sched_core_allowed() holds, falling back to the
+ * idle vcpu.  It is only meaningful from within do_schedule.
+ */
+extern bool_t sched_core;
+int sched_core_check(unsigned int cpu, const struct vcpu *v, bool_t wait);
+void sched_core_begin(unsigned int cpu);
+void sched_core_end(unsigned int cpu, const struct vcpu *next, s_time_t now);
+void sched_core_init_cpu(unsigned int cpu);
+void sched_core_deinit_cpu(unsigned int cpu);
+
+static inline int sched_core_allowed(unsigned int cpu, const struct vcpu *v)
+{
+    return !sched_core || is_idle_vcpu(v) || sched_core_check(cpu, v, 1);
+}
+
+/* Same, for a vcpu on another pCPU's runqueue: @cpu does not wait for it. */
+static inline int sched_core_may_steal(unsigned int cpu, const struct vcpu *v)
+{
+    return !sched_core || is_idle_vcpu(v) || sched_core_check(cpu, v, 0);
+}
+
 
 /*
  * In order to allow a scheduler to remap the lock->cpu mapping,
@@ -171,6 +194,7 @@ extern const struct scheduler sched_sedf_def;
 extern const struct scheduler sched_credit_def;
 extern const struct scheduler sched_credit2_def;
 extern const struct scheduler sched_arinc653_def;
+extern const struct scheduler sched_rtds_def;
 
 
 struct cpupool
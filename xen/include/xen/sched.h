@@ -219,6 +219,11 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Cache of free grant maptrack handles (see grant_table.c). */
+    unsigned int     maptrack_head;
+    unsigned int     maptrack_count;
+    spinlock_t       maptrack_lock;
+
     struct arch_vcpu arch;
 };
 
@@ -817,6 +822,7 @@ void set_vcpu_migration_delay(unsigned int delay);
 unsigned int get_vcpu_migration_delay(void);
 
 extern bool_t sched_smt_power_savings;
+void sched_core_dump(void);
 
 extern enum cpufreq_controller {
     FREQCTL_none, FREQCTL_dom0_kernel, FREQCTL_xen